@@ -26,8 +26,54 @@
 
 NS_ASSUME_NONNULL_BEGIN
 
+/**
+ A columnar store of geopoints. Coordinates are stored contiguously, along with the offset and length of the feature
+ properties in the geojson file, which is mapped and only read when properties are requested.
+ */
+@interface CKGeoPointStore : NSObject
+
+/**
+ The number of geopoints.
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ The coordinates of the geopoints.
+ */
+@property (nonatomic, readonly) CLLocationCoordinate2D *coordinates;
+
+/**
+ Parses the properties of a geopoint.
+ 
+ @param index The index of the geopoint.
+ 
+ @return The feature properties, nil when the feature has none.
+ */
+- (nullable NSDictionary<NSString *, id> *)propertiesAtIndex:(NSUInteger)index;
+
+@end
+
+/**
+ A geopoint annotation reading its coordinate and properties from a store.
+ The title and subtitle are read once from the feature properties, the first time either is accessed or set.
+ */
+@interface CKGeoPointAnnotation : MKPointAnnotation
+
+/**
+ The store of the geopoint.
+ */
+@property (nonatomic, readonly) CKGeoPointStore *store;
+
+/**
+ The index of the geopoint in the store.
+ */
+@property (nonatomic, readonly) NSUInteger index;
+
+@end
+
 /**
  Operation to retrieve geopoints from the embed geojson file.
+ The file is read by chunks and tokenized incrementally, only the coordinates and properties location of the features are kept.
  */
 @interface CKGeoPointOperation : NSOperation
 
@@ -45,6 +91,16 @@ NS_ASSUME_NONNULL_BEGIN
  */
 @property (nonatomic, assign) dispatch_queue_t failureCallbackQueue;
 
+/**
+ The block called with the fraction of the file read so far, on the success callback queue.
+ */
+@property (nonatomic, copy, nullable) void (^progressBlock)(double progress);
+
+/**
+ The store of the geopoints found in the geojson file.
+ */
+@property (nonatomic, nullable, readonly) CKGeoPointStore *store;
+
 /**
  The geopoints found in the geojson file.
  */
@@ -20,13 +20,284 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 // THE SOFTWARE.
 
-#import <objc/runtime.h>
-#import <GeoJSONSerialization/GeoJSONSerialization.h>
-
 #import "CKGeoPointOperation.h"
 
+/// Size of the chunks read from the file
+#define HB_GSCAN_CHUNK (64 * 1024)
+
+/// Maximum nesting depth tracked by the scanner, deeper containers are skipped
+#define HB_GSCAN_MAXDEPTH 32
+
+/// Maximum length of the keys and tokens kept by the scanner, longer ones are truncated
+#define HB_GSCAN_TOKEN 64
+
+/// Container kinds
+typedef NS_ENUM(uint8_t, hb_gkind_t) {
+    hb_gkind_object,
+    hb_gkind_array
+};
+
+/// Incremental GeoJSON scanner, reporting the point features of a feature collection.
+typedef struct hb_gscan {
+    uint64_t offset;                            ///< Offset of the next byte in the stream
+    unsigned depth;                             ///< Number of open containers
+    hb_gkind_t kinds[HB_GSCAN_MAXDEPTH + 1];    ///< Kind of each open container
+    char keys[HB_GSCAN_MAXDEPTH + 1][HB_GSCAN_TOKEN]; ///< Current key of each open object
+    bool expects_key;                           ///< Whether the next string of the current object is a key
+    
+    bool string;                                ///< Whether inside a string
+    bool escape;                                ///< Whether the previous string character is a backslash
+    bool number;                                ///< Whether inside a number
+    bool is_key;                                ///< Whether the current string is a key
+    char token[HB_GSCAN_TOKEN];                 ///< Current string or number
+    size_t length;                              ///< Length of the current token
+    
+    bool feature;                               ///< Whether inside a feature
+    bool point;                                 ///< Whether the feature geometry is a point
+    unsigned ncoords;                           ///< Number of coordinates of the feature
+    double coords[2];                           ///< Longitude and latitude of the feature
+    uint64_t properties;                        ///< Offset of the feature properties
+    uint64_t plength;                           ///< Length of the feature properties, 0 when none
+    
+    void (*emit)(void *ctx, double longitude, double latitude, uint64_t properties, uint64_t length);
+    void *ctx;
+} hb_gscan_t;
+
+static inline bool key_(hb_gscan_t *s, unsigned depth, const char *key) {
+    return depth <= s->depth && depth <= HB_GSCAN_MAXDEPTH && s->kinds[depth] == hb_gkind_object && !strcmp(s->keys[depth], key);
+}
+
+/// Whether the current container is the feature object of a feature collection, at depth 3.
+static inline bool in_feature_(hb_gscan_t *s) {
+    return s->depth >= 3 && key_(s, 1, "features") && s->kinds[2] == hb_gkind_array && s->kinds[3] == hb_gkind_object;
+}
+
+/// Whether the current container is the coordinates array of a feature geometry.
+static inline bool in_coordinates_(hb_gscan_t *s) {
+    return s->feature && s->depth == 5 && key_(s, 3, "geometry") && key_(s, 4, "coordinates") && s->kinds[5] == hb_gkind_array;
+}
+
+static void hb_gscan_open(hb_gscan_t *s, hb_gkind_t kind) {
+    s->depth++;
+    if (s->depth > HB_GSCAN_MAXDEPTH) return;
+    
+    s->kinds[s->depth] = kind;
+    s->keys[s->depth][0] = 0;
+    s->expects_key = (kind == hb_gkind_object);
+    
+    if (s->depth == 3 && in_feature_(s)) {
+        s->feature = true;
+        s->point = false;
+        s->ncoords = 0;
+        s->plength = 0;
+    } else if (s->feature && s->depth == 4 && kind == hb_gkind_object && key_(s, 3, "properties")) {
+        s->properties = s->offset;
+    }
+}
+
+static void hb_gscan_close(hb_gscan_t *s) {
+    if (!s->depth) return;
+    
+    if (s->feature && s->depth == 4 && key_(s, 3, "properties")) {
+        s->plength = s->offset + 1 - s->properties;
+    } else if (s->feature && s->depth == 3) {
+        if (s->point && s->ncoords == 2) s->emit(s->ctx, s->coords[0], s->coords[1], s->properties, s->plength);
+        s->feature = false;
+    }
+    
+    s->depth--;
+    s->expects_key = false;
+}
+
+static void hb_gscan_end_token(hb_gscan_t *s) {
+    s->token[MIN(s->length, HB_GSCAN_TOKEN - 1)] = 0;
+    
+    if (s->number) {
+        s->number = false;
+        if (in_coordinates_(s) && s->ncoords < 2) s->coords[s->ncoords++] = strtod(s->token, NULL);
+        
+    } else if (s->is_key) {
+        if (s->depth <= HB_GSCAN_MAXDEPTH) memcpy(s->keys[s->depth], s->token, HB_GSCAN_TOKEN);
+        
+    } else if (s->feature && s->depth == 4 && key_(s, 3, "geometry") && key_(s, 4, "type")) {
+        s->point = !strcmp(s->token, "Point");
+    }
+    s->length = 0;
+}
+
+static inline void append_(hb_gscan_t *s, char c) {
+    if (s->length < HB_GSCAN_TOKEN - 1) s->token[s->length] = c;
+    s->length++;
+}
+
+/// Scans a chunk of the stream, tokens may span several chunks.
+static void hb_gscan_feed(hb_gscan_t *s, const uint8_t *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++, s->offset++) {
+        char c = (char)bytes[i];
+        
+        if (s->string) {
+            if (s->escape) {
+                s->escape = false;
+                append_(s, c);
+            } else if (c == '\\') {
+                s->escape = true;
+            } else if (c == '"') {
+                s->string = false;
+                hb_gscan_end_token(s);
+            } else {
+                append_(s, c);
+            }
+            continue;
+        }
+        
+        if (s->number) {
+            if ((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+                append_(s, c);
+                continue;
+            }
+            hb_gscan_end_token(s);
+        }
+        
+        switch (c) {
+            case '{': hb_gscan_open(s, hb_gkind_object); break;
+            case '[': hb_gscan_open(s, hb_gkind_array); break;
+            case '}':
+            case ']': hb_gscan_close(s); break;
+            case ':': s->expects_key = false; break;
+            case ',': s->expects_key = (s->depth <= HB_GSCAN_MAXDEPTH && s->kinds[s->depth] == hb_gkind_object); break;
+            case '"':
+                s->string = true;
+                s->is_key = s->expects_key;
+                s->length = 0;
+                break;
+            default:
+                if ((c >= '0' && c <= '9') || c == '-') {
+                    s->number = true;
+                    s->length = 0;
+                    append_(s, c);
+                }
+                break;
+        }
+    }
+}
+
+@interface CKGeoPointStore ()
+- (instancetype)initWithData:(NSData *)data;
+- (void)appendCoordinate:(CLLocationCoordinate2D)coordinate properties:(uint64_t)properties length:(uint64_t)length;
+@end
+
+@implementation CKGeoPointStore {
+    NSData *_data;          ///< Mapped geojson file
+    uint64_t *_properties;  ///< Offset of the properties of each geopoint
+    uint64_t *_lengths;     ///< Length of the properties of each geopoint, 0 when none
+    NSUInteger _capacity;
+}
+
+- (instancetype)initWithData:(NSData *)data {
+    self = [super init];
+    if (self) {
+        _data = data;
+    }
+    return self;
+}
+
+- (void)appendCoordinate:(CLLocationCoordinate2D)coordinate properties:(uint64_t)properties length:(uint64_t)length {
+    if (_count == _capacity) {
+        _capacity = MAX(2 * _capacity, 1024);
+        _coordinates = realloc(_coordinates, _capacity * sizeof(CLLocationCoordinate2D));
+        _properties = realloc(_properties, _capacity * sizeof(uint64_t));
+        _lengths = realloc(_lengths, _capacity * sizeof(uint64_t));
+    }
+    
+    _coordinates[_count] = coordinate;
+    _properties[_count] = properties;
+    _lengths[_count] = length;
+    _count++;
+}
+
+- (NSDictionary<NSString *,id> *)propertiesAtIndex:(NSUInteger)index {
+    if (index >= _count || !_lengths[index] || _properties[index] + _lengths[index] > _data.length) return nil;
+    
+    NSData *data = [_data subdataWithRange:NSMakeRange((NSUInteger)_properties[index], (NSUInteger)_lengths[index])];
+    id properties = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
+    return [properties isKindOfClass:[NSDictionary class]] ? properties : nil;
+}
+
+- (void)dealloc {
+    free(_coordinates);
+    free(_properties);
+    free(_lengths);
+}
+
+@end
+
+@interface CKGeoPointAnnotation ()
+- (instancetype)initWithStore:(CKGeoPointStore *)store index:(NSUInteger)index;
+@end
+
+@implementation CKGeoPointAnnotation {
+    BOOL _parsed;   ///< Whether the title and subtitle were read from the feature properties
+}
+
+- (instancetype)initWithStore:(CKGeoPointStore *)store index:(NSUInteger)index {
+    self = [super init];
+    if (self) {
+        _store = store;
+        _index = index;
+    }
+    return self;
+}
+
+- (CLLocationCoordinate2D)coordinate {
+    return _store.coordinates[_index];
+}
+
+- (void)setCoordinate:(CLLocationCoordinate2D)coordinate {
+    _store.coordinates[_index] = coordinate;
+}
+
+- (NSString *)title {
+    [self parseProperties];
+    return [super title];
+}
+
+- (void)setTitle:(NSString *)title {
+    [self parseProperties];
+    [super setTitle:title];
+}
+
+- (NSString *)subtitle {
+    [self parseProperties];
+    return [super subtitle];
+}
+
+- (void)setSubtitle:(NSString *)subtitle {
+    [self parseProperties];
+    [super setSubtitle:subtitle];
+}
+
+/// Reads the title and subtitle from the feature properties once, the first time either is accessed.
+- (void)parseProperties {
+    if (_parsed) return;
+    _parsed = YES;
+    
+    NSDictionary<NSString *, id> *properties = [_store propertiesAtIndex:_index];
+    id title = properties[@"title"];
+    id subtitle = properties[@"subtitle"];
+    if ([title isKindOfClass:[NSString class]]) [super setTitle:title];
+    if ([subtitle isKindOfClass:[NSString class]]) [super setSubtitle:subtitle];
+}
+
+@end
+
+static void hb_gstore_emit(void *ctx, double longitude, double latitude, uint64_t properties, uint64_t length) {
+    CKGeoPointStore *store = (__bridge CKGeoPointStore *)ctx;
+    [store appendCoordinate:CLLocationCoordinate2DMake(latitude, longitude) properties:properties length:length];
+}
+
 @implementation CKGeoPointOperation
 
+@synthesize store = _store;
 @synthesize points = _points;
 @synthesize error = _error;
 
@@ -34,12 +305,63 @@
     NSBundle *bundle = [NSBundle bundleForClass:[self class]];
     NSURL *URL = [bundle URLForResource:@"stations" withExtension:@"geojson"];
     
-    NSData *data = [NSData dataWithContentsOfURL:URL];
-    NSDictionary *geoJSON = [NSJSONSerialization JSONObjectWithData:data options:0 error:nil];
-    
+    // The file is mapped, properties are only paged in when read.
     NSError *error = nil;
-    _points = [GeoJSONSerialization shapesFromGeoJSONFeatureCollection:geoJSON error:&error];
-    _error = error;
+    NSData *data = [NSData dataWithContentsOfURL:URL options:NSDataReadingMappedIfSafe error:&error];
+    if (!data) {
+        _error = error;
+        return;
+    }
+    
+    CKGeoPointStore *store = [[CKGeoPointStore alloc] initWithData:data];
+    hb_gscan_t *scan = calloc(1, sizeof(hb_gscan_t));
+    scan->emit = hb_gstore_emit;
+    scan->ctx = (__bridge void *)store;
+    
+    NSInputStream *stream = [NSInputStream inputStreamWithURL:URL];
+    [stream open];
+    
+    uint8_t *chunk = malloc(HB_GSCAN_CHUNK);
+    double reported = 0;
+    NSInteger length;
+    
+    while (!self.isCancelled && (length = [stream read:chunk maxLength:HB_GSCAN_CHUNK]) > 0) {
+        hb_gscan_feed(scan, chunk, (size_t)length);
+        
+        double progress = (double)scan->offset / MAX(data.length, 1);
+        if (self.progressBlock && progress - reported >= 0.01) {
+            reported = progress;
+            void (^progressBlock)(double) = self.progressBlock;
+            dispatch_async(self.successCallbackQueue ?: dispatch_get_main_queue(), ^{
+                progressBlock(progress);
+            });
+        }
+    }
+    
+    BOOL complete = !scan->depth && !scan->string && !stream.streamError;
+    error = stream.streamError;
+    [stream close];
+    free(chunk);
+    free(scan);
+    
+    if (self.isCancelled) {
+        _error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSUserCancelledError userInfo:nil];
+        return;
+    }
+    
+    if (!complete) {
+        _error = error ?: [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadCorruptFileError userInfo:@{NSURLErrorKey: URL}];
+        return;
+    }
+    
+    // The annotations only hold their index, they are given to the cluster manager at once, which bulk loads them.
+    NSMutableArray<MKPointAnnotation *> *points = [NSMutableArray arrayWithCapacity:store.count];
+    for (NSUInteger i = 0; i < store.count; i++) {
+        [points addObject:[[CKGeoPointAnnotation alloc] initWithStore:store index:i]];
+    }
+    
+    _store = store;
+    _points = points;
 }
 
 - (void)setCompletionBlock:(void (^)(void))completionBlock {
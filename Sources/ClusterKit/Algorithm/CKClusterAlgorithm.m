@@ -36,16 +36,35 @@
 
 - (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree {
     NSArray *annotations = [tree annotationsInRect:rect];
-    NSMutableArray *clusters = [NSMutableArray arrayWithCapacity:annotations.count];
+    NSUInteger count = annotations.count;
+    NSMutableArray *clusters = [NSMutableArray arrayWithCapacity:count];
+    if (!count) return clusters;
     
-    for (id<MKAnnotation> annotation in annotations) {
-        CKCluster *cluster = [self clusterWithCoordinate:annotation.coordinate];
-        [cluster addAnnotation:annotation];
+    CKAnnotationBuffer buffer = {0};
+    CKAnnotationBufferReserve(&buffer, count);
+    [annotations getObjects:buffer.annotations range:NSMakeRange(0, count)];
+    for (NSUInteger i = 0; i < count; i++) {
+        buffer.points[i] = MKMapPointForCoordinate(buffer.annotations[i].coordinate);
+    }
+    
+    // Every annotation makes a cluster, all of them referencing a single members storage.
+    __unsafe_unretained id<MKAnnotation> *stored = buffer.annotations;
+    hb_cmembers_t *members = hb_cmembers_take(&buffer, count, nil);
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        CKCluster *cluster = [self clusterWithCoordinate:stored[i].coordinate];
+        [cluster setMembers:members range:NSMakeRange(i, 1)];
         [clusters addObject:cluster];
     }
+    
+    hb_cmembers_release(members);
     return clusters;
 }
 
+- (double)tileSizeAtZoom:(double)zoom {
+    return 0;
+}
+
 @end
 
 @implementation CKClusterAlgorithm (CKCluster)
@@ -59,4 +78,8 @@
     return [_clusterClass clusterWithCoordinate:coordinate];
 }
 
+- (CKCluster *)clusterWithAnnotations:(__unsafe_unretained id<MKAnnotation> const *)annotations count:(NSUInteger)count {
+    return [_clusterClass clusterWithAnnotations:annotations count:count];
+}
+
 @end
@@ -22,7 +22,43 @@
 
 #import <ClusterKit/CKGridBasedAlgorithm.h>
 
-@implementation CKGridBasedAlgorithm
+/// Minimum number of annotations per stripe, smaller queries are clustered on the calling thread.
+#define HB_GRID_STRIPE      4096
+#define HB_GRID_MAXSTRIPES  32
+
+typedef struct hb_gcell {
+    uint64_t key;           ///< Cell id plus one, 0 for an empty slot
+    NSUInteger count;       ///< Number of annotations in the cell
+    NSUInteger start;       ///< Offset of the cell annotations once grouped
+} hb_gcell_t;
+
+typedef struct hb_gstripe {
+    NSUInteger start;       ///< Offset of the stripe annotations in _items
+    NSUInteger count;       ///< Number of annotations in the stripe
+    NSUInteger base;        ///< Offset of the stripe table in _cells
+    NSUInteger capacity;    ///< Capacity of the stripe table, a power of two
+} hb_gstripe_t;
+
+static inline uint64_t hash_(uint64_t key) {
+    return key * 0x9E3779B97F4A7C15ULL;
+}
+
+@implementation CKGridBasedAlgorithm {
+    CKAnnotationBuffer _annotations;
+    CKAnnotationBuffer _grouped;
+    
+    hb_gcell_t *_cells;     ///< Open addressing tables of the stripes, left empty after each pass
+    NSUInteger _capacity;
+    
+    uint64_t *_keys;        ///< Cell key of each annotation
+    NSUInteger *_slots;     ///< Cell slot of each annotation
+    NSUInteger *_items;     ///< Annotation indices by stripe, in query order within a stripe
+    uint8_t *_heads;        ///< Whether each annotation is the first of its cell
+    NSUInteger _size;       ///< Capacity of the per annotation arrays
+    
+    hb_gstripe_t _stripes[HB_GRID_MAXSTRIPES];
+    NSUInteger _histogram[HB_GRID_MAXSTRIPES][HB_GRID_MAXSTRIPES];
+}
 
 - (instancetype)init {
     self = [super init];
@@ -33,32 +69,211 @@
     return self;
 }
 
+- (void)dealloc {
+    CKAnnotationBufferFree(&_annotations);
+    CKAnnotationBufferFree(&_grouped);
+    free(_cells);
+    free(_keys);
+    free(_slots);
+    free(_items);
+    free(_heads);
+}
+
 - (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree {
-    NSMutableDictionary<NSNumber *, CKCluster *> *clusters = [[NSMutableDictionary alloc] init];
+    NSMutableArray<CKCluster *> *clusters = [NSMutableArray array];
     
     @synchronized(tree) {
-        NSArray *annotations = [tree annotationsInRect:rect];
-        
-        // Divide the whole map into a numCells x numCells grid and assign annotations to them.
-        long numCells = (long)ceil(256 * pow(2, zoom) / self.cellSize);
-        
-        for (id<MKAnnotation> annotation in annotations) {
-            
-            MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
-            NSUInteger col = numCells * point.x / MKMapSizeWorld.width;
-            NSUInteger row = numCells * point.y / MKMapSizeWorld.height;
-            
-            NSNumber *key = @(numCells * row + col);
-            CKCluster *cluster = clusters[key];
-            if (!cluster) {
-                cluster = [self clusterWithCoordinate:annotation.coordinate];
-                clusters[key] = cluster;
+        @synchronized(self) {
+            NSUInteger count = [self annotationsInRect:rect tree:tree];
+            if (!count) return clusters;
+            
+            [self reserve:count];
+            
+            // Divide the whole map into a numCells x numCells grid and assign annotations to them.
+            long numCells = (long)ceil(256 * pow(2, zoom) / self.cellSize);
+            
+            // Cells are independent, so the rect is split in stripes of whole columns clustered concurrently.
+            // Workers only touch their own stripe and never lock, the tree stays locked by the calling thread.
+            MKMapRect world = MKMapRectIntersection(rect, MKMapRectWorld);
+            if (MKMapRectIsNull(world)) world = MKMapRectWorld;
+            
+            long col0 = numCells * MKMapRectGetMinX(world) / MKMapSizeWorld.width;
+            long cols = MAX((long)ceil(numCells * MKMapRectGetMaxX(world) / MKMapSizeWorld.width) - col0, 1);
+            NSUInteger stripes = MAX(MIN(MIN(count / HB_GRID_STRIPE, HB_GRID_MAXSTRIPES), (NSUInteger)cols), 1);
+            
+            dispatch_queue_t queue = dispatch_get_global_queue(qos_class_self(), 0);
+            
+            __unsafe_unretained id<MKAnnotation> *annotations = _annotations.annotations;
+            MKMapPoint *points = _annotations.points;
+            uint64_t *keys = _keys;
+            NSUInteger *slots = _slots;
+            NSUInteger *items = stripes > 1 ? _items : NULL;
+            uint8_t *heads = _heads;
+            hb_gstripe_t *stripe = _stripes;
+            NSUInteger (*histogram)[HB_GRID_MAXSTRIPES] = _histogram;
+            
+            // Annotations wrapped around the 180th meridian fall in the first stripe, a cell never spans two stripes.
+            #define HB_GSTRIPE(key) (NSUInteger)MIN(MAX(((long)(((key) - 1) % numCells) - col0) * (long)stripes / cols, 0), (long)stripes - 1)
+            
+            // Compute the cell keys by chunks of annotations, counting the annotations of each stripe per chunk.
+            dispatch_apply(stripes, queue, ^(size_t chunk) {
+                NSUInteger *counts = histogram[chunk];
+                memset(counts, 0, stripes * sizeof(NSUInteger));
+                
+                for (NSUInteger i = count * chunk / stripes; i < count * (chunk + 1) / stripes; i++) {
+                    NSUInteger col = numCells * points[i].x / MKMapSizeWorld.width;
+                    NSUInteger row = numCells * points[i].y / MKMapSizeWorld.height;
+                    keys[i] = (uint64_t)numCells * row + col + 1;
+                    if (items) counts[HB_GSTRIPE(keys[i])]++;
+                }
+            });
+            
+            // Lay out the stripes, each one getting a table at most half full.
+            NSUInteger start = 0, base = 0;
+            for (NSUInteger s = 0; s < stripes; s++) {
+                NSUInteger n = 0;
+                for (NSUInteger chunk = 0; chunk < stripes; chunk++) {
+                    NSUInteger c = histogram[chunk][s];
+                    histogram[chunk][s] = start + n;
+                    n += c;
+                }
+                if (!items) n = count;
+                
+                NSUInteger capacity = 16;
+                while (2 * n > capacity) capacity <<= 1;
+                
+                stripe[s] = (hb_gstripe_t){ .start = start, .count = n, .base = base, .capacity = capacity };
+                start += n;
+                base += capacity;
+            }
+            
+            [self reserveCells:base];
+            hb_gcell_t *cells = _cells;
+            
+            // Distribute the annotations to their stripe, keeping the query order within each stripe.
+            if (items) {
+                dispatch_apply(stripes, queue, ^(size_t chunk) {
+                    NSUInteger *offsets = histogram[chunk];
+                    for (NSUInteger i = count * chunk / stripes; i < count * (chunk + 1) / stripes; i++) {
+                        items[offsets[HB_GSTRIPE(keys[i])]++] = i;
+                    }
+                });
+            }
+            
+            #undef HB_GSTRIPE
+            
+            // Assign the annotations of each stripe to its cells.
+            dispatch_apply(stripes, queue, ^(size_t s) {
+                hb_gcell_t *table = cells + stripe[s].base;
+                NSUInteger mask = stripe[s].capacity - 1;
+                
+                for (NSUInteger k = stripe[s].start; k < stripe[s].start + stripe[s].count; k++) {
+                    NSUInteger i = items ? items[k] : k;
+                    uint64_t key = keys[i];
+                    NSUInteger slot = hash_(key) & mask;
+                    
+                    while (table[slot].key && table[slot].key != key) {
+                        slot = (slot + 1) & mask;
+                    }
+                    
+                    heads[i] = !table[slot].key;
+                    table[slot].key = key;
+                    table[slot].count++;
+                    slots[i] = stripe[s].base + slot;
+                }
+            });
+            
+            // Group the annotations by cell, in order of appearance, whatever the stripe of the cell.
+            start = 0;
+            for (NSUInteger i = 0; i < count; i++) {
+                if (!heads[i]) continue;
+                
+                hb_gcell_t *cell = &cells[slots[i]];
+                cell->start = start;
+                start += cell->count;
+            }
+            
+            __unsafe_unretained id<MKAnnotation> *grouped = _grouped.annotations;
+            MKMapPoint *groupedPoints = _grouped.points;
+            
+            dispatch_apply(stripes, queue, ^(size_t s) {
+                for (NSUInteger k = stripe[s].start; k < stripe[s].start + stripe[s].count; k++) {
+                    NSUInteger i = items ? items[k] : k;
+                    NSUInteger j = cells[slots[i]].start++;
+                    grouped[j] = annotations[i];
+                    groupedPoints[j] = points[i];
+                }
+            });
+            
+            // Clusters are only created for non-empty cells, each one referencing its range of the grouped annotations.
+            // The storage takes over the grouped buffer rather than copying it. Clusters are created on the calling thread,
+            // which is cheap since their members are summarized lazily, so that cluster classes need not be thread-safe.
+            hb_cmembers_t *members = hb_cmembers_take(&_grouped, count, nil);
+            
+            for (NSUInteger i = 0; i < count; i++) {
+                if (!heads[i]) continue;
+                
+                hb_gcell_t *cell = &cells[slots[i]];
+                NSUInteger offset = cell->start - cell->count;
+                
+                CKCluster *cluster = [self clusterWithCoordinate:grouped[offset].coordinate];
+                [cluster setMembers:members range:NSMakeRange(offset, cell->count)];
+                [clusters addObject:cluster];
+                
+                *cell = (hb_gcell_t){0};
             }
-            [cluster addAnnotation:annotation];
+            
+            hb_cmembers_release(members);
         }
     }
     
-    return clusters.allValues;
+    return clusters;
+}
+
+- (double)tileSizeAtZoom:(double)zoom {
+    
+    // Whole cells only, for about 512 points wide tiles.
+    double numCells = ceil(256 * pow(2, zoom) / self.cellSize);
+    return ceil(512 / self.cellSize) * MKMapSizeWorld.width / numCells;
+}
+
+#pragma mark Private
+
+- (NSUInteger)annotationsInRect:(MKMapRect)rect tree:(id<CKAnnotationTree>)tree {
+    if ([tree respondsToSelector:@selector(annotationsInRect:buffer:)]) {
+        return [tree annotationsInRect:rect buffer:&_annotations];
+    }
+    
+    NSArray *annotations = [tree annotationsInRect:rect];
+    CKAnnotationBufferReserve(&_annotations, annotations.count);
+    [annotations getObjects:_annotations.annotations range:NSMakeRange(0, annotations.count)];
+    _annotations.count = annotations.count;
+    
+    for (NSUInteger i = 0; i < _annotations.count; i++) {
+        _annotations.points[i] = MKMapPointForCoordinate(_annotations.annotations[i].coordinate);
+    }
+    return _annotations.count;
+}
+
+- (void)reserve:(NSUInteger)count {
+    CKAnnotationBufferReserve(&_grouped, count);
+    
+    if (count > _size) {
+        _size = MAX(count, 2 * _size);
+        _keys = realloc(_keys, _size * sizeof(uint64_t));
+        _slots = realloc(_slots, _size * sizeof(NSUInteger));
+        _items = realloc(_items, _size * sizeof(NSUInteger));
+        _heads = realloc(_heads, _size * sizeof(uint8_t));
+    }
+}
+
+- (void)reserveCells:(NSUInteger)capacity {
+    if (capacity <= _capacity) return;
+    
+    // The tables are left empty after each pass, so they only need to be cleared when allocated.
+    _capacity = MAX(capacity, 2 * _capacity);
+    free(_cells);
+    _cells = calloc(_capacity, sizeof(hb_gcell_t));
 }
 
 @end
@@ -0,0 +1,595 @@
+// CKHierarchicalDistanceBasedAlgorithm.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <ClusterKit/CKHierarchicalDistanceBasedAlgorithm.h>
+
+#define HB_KDNODE_SIZE 16
+
+#pragma mark - Index buffer
+
+typedef struct hb_hbuf {
+    NSUInteger *ids;    ///< Node indices
+    NSUInteger cnt;     ///< Number of indices
+    NSUInteger cap;     ///< Capacity of the buffer
+} hb_hbuf_t;
+
+static inline void hb_hbuf_push(hb_hbuf_t *b, NSUInteger i) {
+    if (b->cnt == b->cap) {
+        b->cap = MAX(2 * b->cap, 64);
+        b->ids = realloc(b->ids, b->cap * sizeof(NSUInteger));
+    }
+    b->ids[b->cnt++] = i;
+}
+
+#pragma mark - Static kd-tree
+
+/// Points sorted as an implicit kd-tree, leaves holding up to HB_KDNODE_SIZE points.
+typedef struct hb_kdtree {
+    NSInteger cnt;      ///< Number of points
+    NSUInteger *ids;    ///< Point indices, in tree order
+    double *coords;     ///< Interleaved x and y coordinates, in tree order
+} hb_kdtree_t;
+
+static inline void swap_(hb_kdtree_t *t, NSInteger i, NSInteger j) {
+    NSUInteger k = t->ids[i];
+    t->ids[i] = t->ids[j];
+    t->ids[j] = k;
+    
+    double x = t->coords[2 * i], y = t->coords[2 * i + 1];
+    t->coords[2 * i] = t->coords[2 * j];
+    t->coords[2 * i + 1] = t->coords[2 * j + 1];
+    t->coords[2 * j] = x;
+    t->coords[2 * j + 1] = y;
+}
+
+// Floyd-Rivest selection: rearranges [left, right] so that k holds the median on the given axis.
+static void select_(hb_kdtree_t *t, NSInteger k, NSInteger left, NSInteger right, int axis) {
+    double *c = t->coords;
+    
+    while (right > left) {
+        if (right - left > 600) {
+            double n = right - left + 1;
+            double m = k - left + 1;
+            double z = log(n);
+            double s = 0.5 * exp(2 * z / 3);
+            double sd = 0.5 * sqrt(z * s * (n - s) / n) * (m - n / 2 < 0 ? -1 : 1);
+            NSInteger l = MAX(left, (NSInteger)floor(k - m * s / n + sd));
+            NSInteger r = MIN(right, (NSInteger)floor(k + (n - m) * s / n + sd));
+            select_(t, k, l, r, axis);
+        }
+        
+        double pivot = c[2 * k + axis];
+        NSInteger i = left;
+        NSInteger j = right;
+        
+        swap_(t, left, k);
+        if (c[2 * right + axis] > pivot) swap_(t, left, right);
+        
+        while (i < j) {
+            swap_(t, i, j);
+            i++;
+            j--;
+            while (c[2 * i + axis] < pivot) i++;
+            while (c[2 * j + axis] > pivot) j--;
+        }
+        
+        if (c[2 * left + axis] == pivot) {
+            swap_(t, left, j);
+        } else {
+            j++;
+            swap_(t, j, right);
+        }
+        
+        if (j <= k) left = j + 1;
+        if (k <= j) right = j - 1;
+    }
+}
+
+static void sort_(hb_kdtree_t *t, NSInteger left, NSInteger right, int axis) {
+    if (right - left <= HB_KDNODE_SIZE) return;
+    
+    NSInteger m = (left + right) >> 1;
+    select_(t, m, left, right, axis);
+    sort_(t, left, m - 1, 1 - axis);
+    sort_(t, m + 1, right, 1 - axis);
+}
+
+static void hb_kdtree_init(hb_kdtree_t *t, const MKMapPoint *points, NSUInteger cnt, NSUInteger stride) {
+    t->cnt = cnt;
+    t->ids = malloc(MAX(cnt, 1) * sizeof(NSUInteger));
+    t->coords = malloc(MAX(cnt, 1) * 2 * sizeof(double));
+    
+    const char *p = (const char *)points;
+    for (NSUInteger i = 0; i < cnt; i++, p += stride) {
+        const MKMapPoint *point = (const MKMapPoint *)p;
+        t->ids[i] = i;
+        t->coords[2 * i] = point->x;
+        t->coords[2 * i + 1] = point->y;
+    }
+    
+    sort_(t, 0, t->cnt - 1, 0);
+}
+
+static void hb_kdtree_free(hb_kdtree_t *t) {
+    free(t->ids);
+    free(t->coords);
+}
+
+// Appends the indices of the points within the closed box [minX, maxX] x [minY, maxY].
+static void hb_kdtree_range(hb_kdtree_t *t, double minX, double minY, double maxX, double maxY, hb_hbuf_t *out) {
+    if (!t->cnt) return;
+    
+    // Each level halves the range, so the depth is bounded by the bits of an index.
+    NSInteger stack[3 * 2 * sizeof(NSInteger) * 8];
+    NSInteger top = 0;
+    
+    stack[top++] = 0;
+    stack[top++] = t->cnt - 1;
+    stack[top++] = 0;
+    
+    while (top) {
+        int axis = (int)stack[--top];
+        NSInteger right = stack[--top];
+        NSInteger left = stack[--top];
+        
+        if (right - left <= HB_KDNODE_SIZE) {
+            for (NSInteger i = left; i <= right; i++) {
+                double x = t->coords[2 * i], y = t->coords[2 * i + 1];
+                if (x >= minX && x <= maxX && y >= minY && y <= maxY) hb_hbuf_push(out, t->ids[i]);
+            }
+            continue;
+        }
+        
+        NSInteger m = (left + right) >> 1;
+        double x = t->coords[2 * m], y = t->coords[2 * m + 1];
+        if (x >= minX && x <= maxX && y >= minY && y <= maxY) hb_hbuf_push(out, t->ids[m]);
+        
+        if (axis == 0 ? minX <= x : minY <= y) {
+            stack[top++] = left;
+            stack[top++] = m - 1;
+            stack[top++] = 1 - axis;
+        }
+        if (axis == 0 ? maxX >= x : maxY >= y) {
+            stack[top++] = m + 1;
+            stack[top++] = right;
+            stack[top++] = 1 - axis;
+        }
+    }
+}
+
+#pragma mark - Cluster hierarchy
+
+typedef struct hb_hnode {
+    MKMapPoint point;       ///< Weighted centroid of the node annotations
+    NSUInteger count;       ///< Number of annotations below the node
+    NSUInteger first;       ///< Position of the node annotations in the leaf order
+    NSUInteger parent;      ///< Index of the parent in the coarser level, NSNotFound until clusterized
+} hb_hnode_t;
+
+typedef struct hb_hlevel {
+    NSUInteger cnt;         ///< Number of nodes
+    hb_hnode_t *nodes;      ///< Level nodes
+    hb_kdtree_t index;      ///< Spatial index of the nodes
+    NSUInteger *offsets;    ///< Children ranges, cnt + 1 entries, NULL for the finest level
+    NSUInteger *children;   ///< Child indices in the finer level
+} hb_hlevel_t;
+
+typedef struct hb_hindex {
+    NSUInteger cnt;         ///< Number of levels, the last one holding the annotations
+    hb_hlevel_t *levels;    ///< Levels from the coarsest to the finest
+} hb_hindex_t;
+
+static void hb_hlevel_free(hb_hlevel_t *l) {
+    free(l->nodes);
+    free(l->offsets);
+    free(l->children);
+    hb_kdtree_free(&l->index);
+}
+
+// Clusterizes the nodes of the finer level within the given radius into a new level.
+static void hb_hlevel_build(hb_hlevel_t *l, hb_hlevel_t *finer, double radius, hb_hbuf_t *neighbors) {
+    double r2 = radius * radius;
+    
+    l->cnt = 0;
+    l->nodes = malloc(MAX(finer->cnt, 1) * sizeof(hb_hnode_t));
+    
+    // Nodes are visited in the kd-tree order, so that consecutive range searches hit the same memory.
+    for (NSUInteger i = 0; i < finer->cnt; i++) {
+        hb_hnode_t *p = &finer->nodes[finer->index.ids[i]];
+        if (p->parent != NSNotFound) continue;
+        
+        neighbors->cnt = 0;
+        hb_kdtree_range(&finer->index, p->point.x - radius, p->point.y - radius, p->point.x + radius, p->point.y + radius, neighbors);
+        
+        double wx = p->point.x * p->count;
+        double wy = p->point.y * p->count;
+        NSUInteger count = p->count;
+        p->parent = l->cnt;
+        
+        for (NSUInteger k = 0; k < neighbors->cnt; k++) {
+            hb_hnode_t *q = &finer->nodes[neighbors->ids[k]];
+            if (q->parent != NSNotFound) continue;
+            
+            double dx = q->point.x - p->point.x;
+            double dy = q->point.y - p->point.y;
+            if (dx * dx + dy * dy > r2) continue;
+            
+            wx += q->point.x * q->count;
+            wy += q->point.y * q->count;
+            count += q->count;
+            q->parent = l->cnt;
+        }
+        
+        l->nodes[l->cnt++] = (hb_hnode_t) {
+            .point = MKMapPointMake(wx / count, wy / count),
+            .count = count,
+            .first = 0,
+            .parent = NSNotFound
+        };
+    }
+    
+    // Children are grouped by parent with a counting sort.
+    l->offsets = calloc(l->cnt + 1, sizeof(NSUInteger));
+    l->children = malloc(MAX(finer->cnt, 1) * sizeof(NSUInteger));
+    
+    for (NSUInteger i = 0; i < finer->cnt; i++) l->offsets[finer->nodes[i].parent + 1]++;
+    for (NSUInteger i = 0; i < l->cnt; i++) l->offsets[i + 1] += l->offsets[i];
+    for (NSUInteger i = 0; i < finer->cnt; i++) l->children[l->offsets[finer->nodes[i].parent]++] = i;
+    for (NSUInteger i = l->cnt; i > 0; i--) l->offsets[i] = l->offsets[i - 1];
+    l->offsets[0] = 0;
+    
+    hb_kdtree_init(&l->index, &l->nodes->point, l->cnt, sizeof(hb_hnode_t));
+}
+
+static inline NSUInteger hash_(uint64_t identifier) {
+    uint64_t h = identifier * 0x9E3779B97F4A7C15ULL;
+    return (NSUInteger)(h ^ (h >> 32));
+}
+
+static void hb_hindex_free(hb_hindex_t *x) {
+    for (NSUInteger i = 0; i < x->cnt; i++) {
+        hb_hlevel_free(&x->levels[i]);
+    }
+    free(x->levels);
+    x->levels = NULL;
+    x->cnt = 0;
+}
+
+// Lays the annotations out so that the ones below any node are contiguous, from the coarsest level down.
+static void hb_hindex_order(hb_hindex_t *x) {
+    hb_hlevel_t *coarsest = &x->levels[0];
+    NSUInteger first = 0;
+    for (NSUInteger i = 0; i < coarsest->cnt; i++) {
+        coarsest->nodes[i].first = first;
+        first += coarsest->nodes[i].count;
+    }
+    
+    for (NSUInteger level = 0; level + 1 < x->cnt; level++) {
+        hb_hlevel_t *l = &x->levels[level];
+        hb_hlevel_t *finer = &x->levels[level + 1];
+        
+        for (NSUInteger i = 0; i < l->cnt; i++) {
+            first = l->nodes[i].first;
+            for (NSUInteger k = l->offsets[i]; k < l->offsets[i + 1]; k++) {
+                hb_hnode_t *child = &finer->nodes[l->children[k]];
+                child->first = first;
+                first += child->count;
+            }
+        }
+    }
+}
+
+/// Indexes the annotations of the finest level by address, each slot holding a node index plus one, 0 when free.
+static NSUInteger *hb_hindex_leaf_ids(const hb_hlevel_t *finest, __unsafe_unretained id<MKAnnotation> *leaves, NSUInteger *mask) {
+    NSUInteger cap = 64;
+    while (cap < 2 * finest->cnt) cap <<= 1;
+    NSUInteger *slots = calloc(cap, sizeof(NSUInteger));
+    
+    for (NSUInteger i = 0; i < finest->cnt; i++) {
+        uintptr_t identifier = (uintptr_t)(__bridge void *)leaves[finest->nodes[i].first];
+        NSUInteger k = hash_(identifier) & (cap - 1);
+        while (slots[k]) k = (k + 1) & (cap - 1);
+        slots[k] = i + 1;
+    }
+    
+    *mask = cap - 1;
+    return slots;
+}
+
+#pragma mark - Algorithm
+
+@implementation CKHierarchicalDistanceBasedAlgorithm {
+    hb_hindex_t _index;
+    hb_hbuf_t _buffer;
+    CKAnnotationBuffer _members;
+    
+    NSArray<id<MKAnnotation>> *_annotations;
+    hb_cmembers_t *_storage;                            ///< The annotations in the leaf order, owned by _annotations
+    __unsafe_unretained id<MKAnnotation> *_leaves;      ///< The annotations of the storage
+    MKMapPoint *_points;                                ///< The projected coordinates of the storage
+    NSUInteger *_leafIds;                               ///< Finest nodes by annotation address, built on the first link lookup
+    NSUInteger _leafMask;
+    
+    __weak id<CKAnnotationTree> _tree;
+    NSUInteger _version;
+    NSUInteger _zoom;
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        self.cellSize = 100;
+        self.minZoomLevel = 0;
+        self.maxZoomLevel = 20;
+        [self registerClusterClass:[CKCentroidCluster class]];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    hb_hindex_free(&_index);
+    hb_cmembers_release(_storage);
+    free(_leafIds);
+    free(_buffer.ids);
+    CKAnnotationBufferFree(&_members);
+}
+
+- (void)setCellSize:(CGFloat)cellSize {
+    _cellSize = cellSize;
+    [self invalidate];
+}
+
+- (void)setMinZoomLevel:(NSUInteger)minZoomLevel {
+    _minZoomLevel = minZoomLevel;
+    [self invalidate];
+}
+
+- (void)setMaxZoomLevel:(NSUInteger)maxZoomLevel {
+    _maxZoomLevel = maxZoomLevel;
+    [self invalidate];
+}
+
+- (void)invalidate {
+    @synchronized(self) {
+        _tree = nil;
+    }
+}
+
+- (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree {
+    NSMutableArray<CKCluster *> *clusters = [NSMutableArray array];
+    
+    @synchronized(tree) {
+        @synchronized(self) {
+            [self prepareWithTree:tree];
+            
+            if (!_index.cnt) return clusters;
+            
+            double z = MIN(MAX(floor(zoom), _zoom), _zoom + _index.cnt - 1);
+            NSUInteger level = (NSUInteger)z - _zoom;
+            hb_kdtree_t *index = &_index.levels[level].index;
+            
+            _buffer.cnt = 0;
+            
+            // For map rects that span the 180th meridian, we get the portion outside the world.
+            if (MKMapRectSpans180thMeridian(rect)) {
+                MKMapRect remainder = MKMapRectRemainder(rect);
+                hb_kdtree_range(index, MKMapRectGetMinX(remainder), MKMapRectGetMinY(remainder), MKMapRectGetMaxX(remainder), MKMapRectGetMaxY(remainder), &_buffer);
+                rect = MKMapRectIntersection(rect, MKMapRectWorld);
+            }
+            
+            hb_kdtree_range(index, MKMapRectGetMinX(rect), MKMapRectGetMinY(rect), MKMapRectGetMaxX(rect), MKMapRectGetMaxY(rect), &_buffer);
+            
+            BOOL filter = [self filtersAnnotations];
+            for (NSUInteger i = 0; i < _buffer.cnt; i++) {
+                CKCluster *cluster = [self clusterAtLevel:level index:_buffer.ids[i] filter:filter];
+                if (cluster) [clusters addObject:cluster];
+            }
+        }
+    }
+    
+    return clusters;
+}
+
+- (CKCluster *)parentOfCluster:(CKCluster *)cluster {
+    @synchronized(self) {
+        NSUInteger level, index;
+        if (![self getLevel:&level index:&index ofCluster:cluster coarsest:YES] || level == 0) return nil;
+        
+        return [self clusterAtLevel:level - 1 index:_index.levels[level].nodes[index].parent filter:[self filtersAnnotations]];
+    }
+}
+
+- (NSArray<CKCluster *> *)childrenOfCluster:(CKCluster *)cluster {
+    @synchronized(self) {
+        NSUInteger level, index;
+        if (![self getLevel:&level index:&index ofCluster:cluster coarsest:NO]) return @[];
+        
+        hb_hlevel_t *l = &_index.levels[level];
+        if (!l->offsets) return @[];
+        
+        BOOL filter = [self filtersAnnotations];
+        NSMutableArray *children = [NSMutableArray arrayWithCapacity:l->offsets[index + 1] - l->offsets[index]];
+        for (NSUInteger k = l->offsets[index]; k < l->offsets[index + 1]; k++) {
+            CKCluster *child = [self clusterAtLevel:level + 1 index:l->children[k] filter:filter];
+            if (child) [children addObject:child];
+        }
+        return children;
+    }
+}
+
+#pragma mark Private
+
+// Any change of the tree, a single move included, rebuilds the whole hierarchy in O(n log n) on the next query.
+// Greedy merges cascade through the levels, so changes are not patched into the affected nodes.
+- (void)prepareWithTree:(id<CKAnnotationTree>)tree {
+    BOOL versioned = [tree respondsToSelector:@selector(version)];
+    if (tree == _tree && (!versioned || tree.version == _version)) return;
+    
+    hb_hindex_free(&_index);
+    hb_cmembers_release(_storage);
+    _storage = NULL;
+    free(_leafIds);
+    _leafIds = NULL;
+    
+    _tree = tree;
+    _version = versioned ? tree.version : 0;
+    _zoom = MIN(self.minZoomLevel, self.maxZoomLevel);
+    
+    // The annotations come with their projected coordinate, unless the delegate would filter them out of range queries.
+    CKAnnotationBuffer stored = {0};
+    if ([tree respondsToSelector:@selector(annotationsInRect:buffer:)] && ![self filtersAnnotations]) {
+        [tree annotationsInRect:MKMapRectWorld buffer:&stored];
+    } else {
+        NSArray<id<MKAnnotation>> *annotations = tree.annotations;
+        CKAnnotationBufferReserve(&stored, annotations.count);
+        [annotations getObjects:stored.annotations range:NSMakeRange(0, annotations.count)];
+        stored.count = annotations.count;
+        
+        for (NSUInteger i = 0; i < stored.count; i++) {
+            stored.points[i] = MKMapPointForCoordinate(stored.annotations[i].coordinate);
+        }
+    }
+    
+    NSUInteger count = stored.count;
+    _annotations = [NSArray arrayWithObjects:stored.annotations count:count];
+    
+    _index.cnt = self.maxZoomLevel - _zoom + 2;
+    _index.levels = calloc(_index.cnt, sizeof(hb_hlevel_t));
+    
+    // The finest level holds the annotations, in the tree order.
+    hb_hlevel_t *finest = &_index.levels[_index.cnt - 1];
+    finest->cnt = count;
+    finest->nodes = malloc(MAX(count, 1) * sizeof(hb_hnode_t));
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        finest->nodes[i] = (hb_hnode_t) {
+            .point = stored.points[i],
+            .count = 1,
+            .first = 0,
+            .parent = NSNotFound
+        };
+    }
+    hb_kdtree_init(&finest->index, &finest->nodes->point, count, sizeof(hb_hnode_t));
+    
+    // One screen point at zoom z spans MKMapSizeWorld.width / (256 * 2^z) map points.
+    for (NSUInteger level = _index.cnt - 1; level > 0; level--) {
+        double radius = self.cellSize / 2 * MKMapSizeWorld.width / (256 * pow(2, _zoom + level - 1));
+        hb_hlevel_build(&_index.levels[level - 1], &_index.levels[level], radius, &_buffer);
+    }
+    
+    // Every node then references a range of a single storage, retained once through the annotation array.
+    hb_hindex_order(&_index);
+    
+    CKAnnotationBuffer leaves = {0};
+    CKAnnotationBufferReserve(&leaves, count);
+    for (NSUInteger i = 0; i < count; i++) {
+        leaves.annotations[finest->nodes[i].first] = stored.annotations[i];
+        leaves.points[finest->nodes[i].first] = stored.points[i];
+    }
+    CKAnnotationBufferFree(&stored);
+    
+    _leaves = leaves.annotations;
+    _points = leaves.points;
+    _storage = hb_cmembers_take(&leaves, count, _annotations);
+}
+
+- (BOOL)filtersAnnotations {
+    id<CKAnnotationTreeDelegate> delegate = _tree.delegate;
+    if (![delegate respondsToSelector:@selector(annotationTree:shouldExtractAnnotation:)]) return NO;
+    return ![delegate respondsToSelector:@selector(annotationTreeFiltersAnnotations:)] || [delegate annotationTreeFiltersAnnotations:_tree];
+}
+
+- (CKCluster *)clusterAtLevel:(NSUInteger)level index:(NSUInteger)index filter:(BOOL)filter {
+    hb_hnode_t *node = &_index.levels[level].nodes[index];
+    NSRange range = NSMakeRange(node->first, node->count);
+    CLLocationCoordinate2D coordinate = MKCoordinateForMapPoint(node->point);
+    CKCluster *cluster = [self clusterWithCoordinate:coordinate];
+    
+    if (filter) {
+        id<CKAnnotationTreeDelegate> delegate = _tree.delegate;
+        NSUInteger i = range.location;
+        while (i < NSMaxRange(range) && [delegate annotationTree:_tree shouldExtractAnnotation:_leaves[i]]) i++;
+        
+        // Rejected annotations split the node range, the remaining ones are copied.
+        if (i < NSMaxRange(range)) {
+            CKAnnotationBufferReserve(&_members, range.length);
+            _members.count = i - range.location;
+            memcpy(_members.annotations, _leaves + range.location, _members.count * sizeof(id));
+            memcpy(_members.points, _points + range.location, _members.count * sizeof(MKMapPoint));
+            
+            for (i++; i < NSMaxRange(range); i++) {
+                if (![delegate annotationTree:_tree shouldExtractAnnotation:_leaves[i]]) continue;
+                _members.annotations[_members.count] = _leaves[i];
+                _members.points[_members.count++] = _points[i];
+            }
+            if (!_members.count) return nil;
+            
+            hb_cmembers_t *members = hb_cmembers_new(_members.annotations, _members.points, _members.count);
+            [cluster setMembers:members range:NSMakeRange(0, _members.count)];
+            hb_cmembers_release(members);
+            range.length = 0;
+        }
+    }
+    
+    // The node count and centroid are known, the cluster only references the node range.
+    if (range.length) {
+        [cluster setMembers:_storage range:range coordinate:coordinate];
+    }
+    
+    return cluster;
+}
+
+// Nodes are found from the content of the cluster rather than the cluster object, which the cluster manager may
+// update in place with another cluster: the identifier is the address of the lowest annotation, whose ancestors hold
+// growing counts. Nodes with the same annotations at consecutive levels are one node to the links, the coarsest of them
+// leads to the parent and the finest to the children. Clusters missing annotations of their node are not found.
+- (BOOL)getLevel:(NSUInteger *)level index:(NSUInteger *)index ofCluster:(CKCluster *)cluster coarsest:(BOOL)coarsest {
+    uint64_t identifier = cluster.identifier;
+    if (!identifier || !_index.cnt) return NO;
+    
+    NSUInteger l = _index.cnt - 1;
+    hb_hlevel_t *finest = &_index.levels[l];
+    if (!_leafIds) _leafIds = hb_hindex_leaf_ids(finest, _leaves, &_leafMask);
+    
+    NSUInteger i = NSNotFound;
+    for (NSUInteger k = hash_(identifier) & _leafMask; _leafIds[k]; k = (k + 1) & _leafMask) {
+        if ((uintptr_t)(__bridge void *)_leaves[finest->nodes[_leafIds[k] - 1].first] != identifier) continue;
+        i = _leafIds[k] - 1;
+        break;
+    }
+    if (i == NSNotFound) return NO;
+    
+    NSUInteger count = cluster.count;
+    while (l > 0 && (_index.levels[l].nodes[i].count < count || coarsest)) {
+        NSUInteger parent = _index.levels[l].nodes[i].parent;
+        if (_index.levels[l - 1].nodes[parent].count > count) break;
+        i = parent;
+        l--;
+    }
+    if (_index.levels[l].nodes[i].count != count) return NO;
+    
+    *level = l;
+    *index = i;
+    return YES;
+}
+
+@end
@@ -22,14 +22,36 @@
 
 #import <ClusterKit/CKNonHierarchicalDistanceBasedAlgorithm.h>
 
-@interface CKCandidate : NSObject
-@property (nonatomic) CGFloat distance;
-@property (nonatomic, strong) CKCluster *cluster;
-@end
+typedef struct hb_dpoint {
+    MKMapPoint point;       ///< Projected annotation coordinate
+    double distance;        ///< Distance to the cluster center
+    NSUInteger cluster;     ///< Cluster index, NSNotFound until visited
+    NSUInteger seq;         ///< Position of the last assignment in the assignment log
+} hb_dpoint_t;
 
 MKMapRect CKCreateRectFromSpan(CLLocationCoordinate2D center, double span);
+static MKMapRect CKCreateRectFromRect(MKMapRect rect, CLLocationDegrees span);
+
+static int compare_(const void *a, const void *b) {
+    NSUInteger i = *(const NSUInteger *)a, j = *(const NSUInteger *)b;
+    return (i > j) - (i < j);
+}
 
-@implementation CKNonHierarchicalDistanceBasedAlgorithm
+@implementation CKNonHierarchicalDistanceBasedAlgorithm {
+    CKAnnotationBuffer _annotations;
+    CKAnnotationBuffer _grouped;
+    
+    hb_dpoint_t *_points;   ///< Points of the annotations, by annotation index
+    NSUInteger *_items;     ///< Annotation indices grouped by grid cell
+    NSUInteger *_neighbors; ///< Neighbors of the current seed
+    NSUInteger _size;       ///< Capacity of the per annotation arrays
+    
+    NSUInteger *_cells;     ///< Grid cell offsets into _items
+    NSUInteger _cellsSize;
+    
+    NSUInteger *_log;       ///< Assignment log, annotation indices by order of assignment
+    NSUInteger _logSize;
+}
 
 - (instancetype)init {
     self = [super init];
@@ -39,6 +61,16 @@ MKMapRect CKCreateRectFromSpan(CLLocationCoordinate2D center, double span);
     return self;
 }
 
+- (void)dealloc {
+    CKAnnotationBufferFree(&_annotations);
+    CKAnnotationBufferFree(&_grouped);
+    free(_points);
+    free(_items);
+    free(_neighbors);
+    free(_cells);
+    free(_log);
+}
+
 - (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree {
     
     // The width and height of the square around a point that we'll consider later
@@ -46,49 +78,192 @@ MKMapRect CKCreateRectFromSpan(CLLocationCoordinate2D center, double span);
     
     NSMutableArray<CKCluster *> *clusters = [[NSMutableArray alloc] init];
     
-    NSMapTable<id<MKAnnotation>, CKCandidate *> *visited = [NSMapTable strongToStrongObjectsMapTable];
-
+    if (MKMapRectIsNull(rect)) return clusters;
+    
     @synchronized(tree) {
-        
-        NSArray *annotations = [tree annotationsInRect:rect];
-        
-        for (id<MKAnnotation> annotation in annotations) {
+        @synchronized(self) {
+            
+            // The annotations in the rect are the seeds, their neighbors may lie up to half a span away.
+            MKMapRect remainder = MKMapRectNull;
+            if (MKMapRectSpans180thMeridian(rect)) {
+                remainder = MKMapRectRemainder(rect);
+                rect = MKMapRectIntersection(rect, MKMapRectWorld);
+            }
             
-            if ([visited objectForKey:annotation]) continue;
+            MKMapRect bounds = CKCreateRectFromRect(rect, zoomSpecificSpan);
+            if (!MKMapRectIsNull(remainder)) {
+                bounds = MKMapRectUnion(bounds, CKCreateRectFromRect(remainder, zoomSpecificSpan));
+            }
             
-            CKCluster *cluster = [self clusterWithCoordinate:annotation.coordinate];
-            [clusters addObject:cluster];
+            NSUInteger count = [self annotationsInRect:bounds tree:tree];
+            if (!count) return clusters;
             
-            MKMapRect clusterRect = CKCreateRectFromSpan(annotation.coordinate, zoomSpecificSpan);
-            NSArray *neighbors  = [tree annotationsInRect:clusterRect];
+            [self reserve:count];
             
-            for (id<MKAnnotation> neighbor in neighbors) {
-                
-                CKCandidate *candidate = [visited objectForKey:neighbor];
-                
-                CGFloat distance = CKDistance(neighbor.coordinate, cluster.coordinate);
+            for (NSUInteger i = 0; i < count; i++) {
+                _points[i] = (hb_dpoint_t) {
+                    .point = _annotations.points[i],
+                    .cluster = NSNotFound
+                };
+            }
+            
+            // Bucket the points in a uniform grid, cells being a span wide.
+            double cell = zoomSpecificSpan * MKMapSizeWorld.width / 360;
+            NSUInteger cols = MAX(ceil(bounds.size.width / cell), 1);
+            NSUInteger rows = MAX(ceil(bounds.size.height / cell), 1);
+            
+            if (cols * rows > 2 * count) {
+                cell *= sqrt((double)cols * rows / (2 * count));
+                cols = MAX(ceil(bounds.size.width / cell), 1);
+                rows = MAX(ceil(bounds.size.height / cell), 1);
+            }
+            
+            [self reserveCells:cols * rows];
+            memset(_cells, 0, (cols * rows + 1) * sizeof(NSUInteger));
+            
+            #define HB_DCELL(p) (MIN((NSUInteger)(((p).y - bounds.origin.y) / cell), rows - 1) * cols + \
+                                 MIN((NSUInteger)(((p).x - bounds.origin.x) / cell), cols - 1))
+            
+            for (NSUInteger i = 0; i < count; i++) _cells[HB_DCELL(_points[i].point) + 1]++;
+            for (NSUInteger c = 0; c < cols * rows; c++) _cells[c + 1] += _cells[c];
+            for (NSUInteger i = 0; i < count; i++) _items[_cells[HB_DCELL(_points[i].point)]++] = i;
+            for (NSUInteger c = cols * rows; c > 0; c--) _cells[c] = _cells[c - 1];
+            _cells[0] = 0;
+            
+            #undef HB_DCELL
+            
+            // Seeds are visited in the order the tree returns them, the portion outside the world first.
+            NSMutableArray<CKCluster *> *seedClusters = [NSMutableArray array];
+            NSUInteger assignments = 0;
+            
+            for (int pass = 0; pass < 2; pass++) {
+                MKMapRect seedRect = pass ? rect : remainder;
+                if (MKMapRectIsNull(seedRect)) continue;
                 
-                if (candidate) {
-                    if (candidate.distance < distance) continue;
-                    [candidate.cluster removeAnnotation:neighbor];
-                } else {
-                    candidate = [[CKCandidate alloc] init];
-                    [visited setObject:candidate forKey:neighbor];
+                for (NSUInteger i = 0; i < count; i++) {
+                    hb_dpoint_t *seed = &_points[i];
+                    if (seed->cluster != NSNotFound || !MKMapRectContainsPoint(seedRect, seed->point)) continue;
+                    
+                    NSUInteger cluster = seedClusters.count;
+                    
+                    // Distances are measured to the cluster coordinate, which moves as neighbors join unless the
+                    // registered class keeps it on the seed.
+                    CKCluster *seedCluster = [self clusterWithCoordinate:_annotations.annotations[i].coordinate];
+                    BOOL moving = ![seedCluster isMemberOfClass:[CKCluster class]];
+                    [seedClusters addObject:seedCluster];
+                    
+                    MKMapRect clusterRect = CKCreateRectFromSpan(_annotations.annotations[i].coordinate, zoomSpecificSpan);
+                    
+                    NSUInteger c0 = MIN(MAX(floor((MKMapRectGetMinX(clusterRect) - bounds.origin.x) / cell), 0), cols - 1);
+                    NSUInteger c1 = MIN(MAX(floor((MKMapRectGetMaxX(clusterRect) - bounds.origin.x) / cell), 0), cols - 1);
+                    NSUInteger r0 = MIN(MAX(floor((MKMapRectGetMinY(clusterRect) - bounds.origin.y) / cell), 0), rows - 1);
+                    NSUInteger r1 = MIN(MAX(floor((MKMapRectGetMaxY(clusterRect) - bounds.origin.y) / cell), 0), rows - 1);
+                    
+                    NSUInteger neighbors = 0;
+                    for (NSUInteger r = r0; r <= r1; r++) {
+                        for (NSUInteger c = r * cols + c0; c <= r * cols + c1; c++) {
+                            for (NSUInteger k = _cells[c]; k < _cells[c + 1]; k++) {
+                                if (MKMapRectContainsPoint(clusterRect, _points[_items[k]].point)) {
+                                    _neighbors[neighbors++] = _items[k];
+                                }
+                            }
+                        }
+                    }
+                    
+                    // Neighbors are processed in the tree order, which is the order of the annotation indices.
+                    qsort(_neighbors, neighbors, sizeof(NSUInteger), compare_);
+                    
+                    for (NSUInteger k = 0; k < neighbors; k++) {
+                        hb_dpoint_t *neighbor = &_points[_neighbors[k]];
+                        
+                        MKMapPoint center = moving ? MKMapPointForCoordinate(seedCluster.coordinate) : seed->point;
+                        double distance = CKMapPointDistance(neighbor->point, center);
+                        
+                        if (neighbor->cluster != NSNotFound && neighbor->distance < distance) continue;
+                        
+                        if (assignments == _logSize) {
+                            _logSize = MAX(2 * _logSize, count);
+                            _log = realloc(_log, _logSize * sizeof(NSUInteger));
+                        }
+                        
+                        neighbor->cluster = cluster;
+                        neighbor->distance = distance;
+                        neighbor->seq = assignments;
+                        _log[assignments++] = _neighbors[k];
+                        
+                        // Members a later seed takes over stay in the running cluster, whose coordinate is only read
+                        // while it grows. The final members are set below.
+                        if (moving) [seedCluster addAnnotation:_annotations.annotations[_neighbors[k]]];
+                    }
                 }
+            }
+            
+            // Clusters are assigned one after the other, so the live entries of the log are grouped by cluster
+            // and keep the order in which annotations joined their cluster. The cluster of each entry is kept in _items.
+            CKAnnotationBufferReserve(&_grouped, count);
+            NSUInteger grouped = 0;
+            
+            for (NSUInteger k = 0; k < assignments; k++) {
+                NSUInteger i = _log[k];
+                if (_points[i].seq != k) continue;
+                
+                _grouped.annotations[grouped] = _annotations.annotations[i];
+                _grouped.points[grouped] = _points[i].point;
+                _items[grouped++] = _points[i].cluster;
+            }
+            
+            // Each cluster references its range of the grouped annotations, the storage takes over the buffer.
+            hb_cmembers_t *members = hb_cmembers_take(&_grouped, grouped, nil);
+            
+            for (NSUInteger start = 0, end = 0; start < grouped; start = end) {
+                NSUInteger current = _items[start];
+                while (end < grouped && _items[end] == current) end++;
                 
-                candidate.cluster = cluster;
-                candidate.distance = distance;
-                [cluster addAnnotation:neighbor];
+                CKCluster *cluster = seedClusters[current];
+                [cluster setMembers:members range:NSMakeRange(start, end - start)];
+                [clusters addObject:cluster];
             }
+            
+            hb_cmembers_release(members);
         }
     }
     
     return clusters;
 }
 
-@end
+#pragma mark Private
+
+- (NSUInteger)annotationsInRect:(MKMapRect)rect tree:(id<CKAnnotationTree>)tree {
+    if ([tree respondsToSelector:@selector(annotationsInRect:buffer:)]) {
+        return [tree annotationsInRect:rect buffer:&_annotations];
+    }
+    
+    NSArray *annotations = [tree annotationsInRect:rect];
+    CKAnnotationBufferReserve(&_annotations, annotations.count);
+    [annotations getObjects:_annotations.annotations range:NSMakeRange(0, annotations.count)];
+    _annotations.count = annotations.count;
+    
+    for (NSUInteger i = 0; i < _annotations.count; i++) {
+        _annotations.points[i] = MKMapPointForCoordinate(_annotations.annotations[i].coordinate);
+    }
+    return _annotations.count;
+}
 
-@implementation CKCandidate
+- (void)reserve:(NSUInteger)count {
+    if (count <= _size) return;
+    
+    _size = MAX(count, 2 * _size);
+    _points = realloc(_points, _size * sizeof(hb_dpoint_t));
+    _items = realloc(_items, _size * sizeof(NSUInteger));
+    _neighbors = realloc(_neighbors, _size * sizeof(NSUInteger));
+}
+
+- (void)reserveCells:(NSUInteger)count {
+    if (count + 1 <= _cellsSize) return;
+    
+    _cellsSize = MAX(count + 1, 2 * _cellsSize);
+    _cells = realloc(_cells, _cellsSize * sizeof(NSUInteger));
+}
 
 @end
 
@@ -105,3 +280,18 @@ MKMapRect CKCreateRectFromSpan(CLLocationCoordinate2D center, CLLocationDegrees
     
     return MKMapRectMake(MIN(a.x,b.x), MIN(a.y,b.y), ABS(a.x-b.x), ABS(a.y-b.y));
 }
+
+/// Returns a rect containing the span rects of every point of the given rect.
+static MKMapRect CKCreateRectFromRect(MKMapRect rect, CLLocationDegrees span) {
+    double halfSpan = span / 2;
+    
+    CLLocationCoordinate2D nw = MKCoordinateForMapPoint(rect.origin);
+    CLLocationCoordinate2D se = MKCoordinateForMapPoint(MKMapPointMake(MKMapRectGetMaxX(rect), MKMapRectGetMaxY(rect)));
+    
+    MKMapPoint a = MKMapPointForCoordinate(CLLocationCoordinate2DMake(MIN(nw.latitude + halfSpan, 90), MAX(nw.longitude - halfSpan, -180)));
+    MKMapPoint b = MKMapPointForCoordinate(CLLocationCoordinate2DMake(MAX(se.latitude - halfSpan, -90), MIN(se.longitude + halfSpan, 180)));
+    
+    // Pad by a map point to absorb rounding in the projection round trip.
+    rect = MKMapRectMake(MIN(a.x,b.x), MIN(a.y,b.y), ABS(a.x-b.x), ABS(a.y-b.y));
+    return MKMapRectIntersection(MKMapRectInset(rect, -1, -1), MKMapRectWorld);
+}
@@ -21,11 +21,14 @@
 // THE SOFTWARE.
 
 #import <MapKit/MKGeometry.h>
+#import <stdatomic.h>
 #import <ClusterKit/CKCluster.h>
 
 double CKDistance(CLLocationCoordinate2D from, CLLocationCoordinate2D to) {
-    MKMapPoint a = MKMapPointForCoordinate(from);
-    MKMapPoint b = MKMapPointForCoordinate(to);
+    return CKMapPointDistance(MKMapPointForCoordinate(from), MKMapPointForCoordinate(to));
+}
+
+double CKMapPointDistance(MKMapPoint a, MKMapPoint b) {
     return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
 }
 
@@ -48,12 +51,111 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
     return NSOrderedSame;
 }
 
+/// Mixes the annotation address into a well distributed 64-bit value (splitmix64 finalizer).
+static inline uint64_t hb_annotation_hash(id<MKAnnotation> annotation) {
+    uint64_t x = (uint64_t)(uintptr_t)(__bridge void *)annotation;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static inline uint64_t hb_annotation_id(id<MKAnnotation> annotation) {
+    return (uint64_t)(uintptr_t)(__bridge void *)annotation;
+}
+
+#pragma mark - Cluster members
+
+/// Clusters up to this size are searched linearly, larger ones map their annotations to their index on demand.
+#define HB_CLUSTER_SCANMAX 16
+
+struct hb_cmembers {
+    atomic_ulong refs;          ///< Number of clusters, or builders, referencing the storage
+    NSUInteger count;           ///< Number of annotations in the storage
+    NSUInteger capacity;        ///< Allocated slots
+    __unsafe_unretained id<MKAnnotation> *annotations;  ///< Annotations, retained by the storage
+    MKMapPoint *points;         ///< Projected coordinates of the annotations
+    CFTypeRef owner;            ///< Object keeping the annotations alive, NULL when the storage retains them
+};
+
+static hb_cmembers_t *hb_cmembers_alloc(NSUInteger capacity) {
+    hb_cmembers_t *m = malloc(sizeof(hb_cmembers_t));
+    atomic_init(&m->refs, 1);
+    m->count = 0;
+    m->capacity = MAX(capacity, 1);
+    m->annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(m->capacity * sizeof(id));
+    m->points = malloc(m->capacity * sizeof(MKMapPoint));
+    m->owner = NULL;
+    return m;
+}
+
+static hb_cmembers_t *hb_cmembers_retain(hb_cmembers_t *m) {
+    if (m) atomic_fetch_add(&m->refs, 1);
+    return m;
+}
+
+hb_cmembers_t *hb_cmembers_new(__unsafe_unretained id<MKAnnotation> const *annotations, const MKMapPoint *points, NSUInteger count) {
+    hb_cmembers_t *m = hb_cmembers_alloc(count);
+    for (NSUInteger i = 0; i < count; i++) {
+        m->annotations[i] = annotations[i];
+        m->points[i] = points ? points[i] : MKMapPointForCoordinate(annotations[i].coordinate);
+        CFRetain((__bridge CFTypeRef)annotations[i]);
+    }
+    m->count = count;
+    return m;
+}
+
+hb_cmembers_t *hb_cmembers_take(CKAnnotationBuffer *buffer, NSUInteger count, id owner) {
+    hb_cmembers_t *m = malloc(sizeof(hb_cmembers_t));
+    atomic_init(&m->refs, 1);
+    m->count = count;
+    m->capacity = buffer->capacity;
+    m->annotations = buffer->annotations;
+    m->points = buffer->points;
+    m->owner = owner ? CFBridgingRetain(owner) : NULL;
+    
+    // The buffer storage is handed over, the buffer allocates a new one when it is reserved again.
+    *buffer = (CKAnnotationBuffer){0};
+    
+    if (!owner) {
+        for (NSUInteger i = 0; i < count; i++) {
+            CFRetain((__bridge CFTypeRef)m->annotations[i]);
+        }
+    }
+    return m;
+}
+
+void hb_cmembers_release(hb_cmembers_t *m) {
+    if (!m || atomic_fetch_sub(&m->refs, 1) != 1) return;
+    
+    if (m->owner) {
+        CFRelease(m->owner);
+    } else {
+        for (NSUInteger i = 0; i < m->count; i++) {
+            CFRelease((__bridge CFTypeRef)m->annotations[i]);
+        }
+    }
+    free(m->annotations);
+    free(m->points);
+    free(m);
+}
+
+#pragma mark - Cluster
+
 @implementation CKCluster {
 @protected
-    NSMutableOrderedSet<id<MKAnnotation>> *_annotations;
+    hb_cmembers_t *_members;    ///< Members storage, possibly shared with other clusters until the receiver is mutated
+    NSUInteger _offset;         ///< Offset of the receiver annotations in the storage
+    NSUInteger _count;
+    NSMapTable<id<MKAnnotation>, NSNumber *> *_index;
+    unsigned long _mutations;
     
     MKMapRect _bounds;
     BOOL _invalidate_bounds;
+    
+    uint64_t _fingerprint;
+    BOOL _invalidate_fingerprint;   ///< Set by -setMembers:range:, everything derived from the membership is pending
+    uint64_t _identifier;
+    BOOL _invalidate_identifier;
 }
 
 @synthesize coordinate = _coordinate;
@@ -61,16 +163,27 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 - (instancetype)init{
     self = [super init];
     if (self) {
-        _annotations = [NSMutableOrderedSet orderedSet];
+        _members = NULL;
+        _offset = 0;
+        _count = 0;
         _coordinate = kCLLocationCoordinate2DInvalid;
         _bounds = MKMapRectNull;
         _invalidate_bounds = NO;
+        _fingerprint = 0;
+        _invalidate_fingerprint = NO;
+        _identifier = 0;
+        _invalidate_identifier = NO;
     }
     return self;
 }
 
+- (void)dealloc {
+    hb_cmembers_release(_members);
+}
+
 - (NSArray<id<MKAnnotation>> *)annotations {
-    return _annotations.array;
+    if (!_count) return @[];
+    return [NSArray arrayWithObjects:_members->annotations + _offset count:_count];
 }
 
 - (void)setCoordinate:(CLLocationCoordinate2D)newCoordinate {
@@ -78,10 +191,11 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 }
 
 - (MKMapRect)bounds {
+    if (_invalidate_fingerprint) [self summarize];
     if (_invalidate_bounds) {
         _bounds = MKMapRectNull;
-        for (id<MKAnnotation> annotation in _annotations) {
-            _bounds = MKMapRectByAddingPoint(_bounds, MKMapPointForCoordinate(annotation.coordinate));
+        for (NSUInteger i = 0; i < _count; i++) {
+            _bounds = MKMapRectByAddingPoint(_bounds, _members->points[_offset + i]);
         }
         
         _invalidate_bounds = NO;
@@ -89,44 +203,266 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
     return _bounds;
 }
 
+- (uint64_t)identifier {
+    if (_invalidate_fingerprint) [self summarize];
+    if (_invalidate_identifier) {
+        _identifier = 0;
+        for (NSUInteger i = 0; i < _count; i++) {
+            uint64_t identifier = hb_annotation_id(_members->annotations[_offset + i]);
+            if (!_identifier || identifier < _identifier) _identifier = identifier;
+        }
+        
+        _invalidate_identifier = NO;
+    }
+    return _identifier;
+}
+
+- (uint64_t)fingerprint {
+    if (_invalidate_fingerprint) [self summarize];
+    return _fingerprint;
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range {
+    [self assignMembers:members range:range];
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range coordinate:(CLLocationCoordinate2D)coordinate {
+    [self assignMembers:members range:range];
+    self.coordinate = coordinate;
+}
+
+/// Points the receiver to the range, which is not read until the cluster is used.
+- (void)assignMembers:(hb_cmembers_t *)members range:(NSRange)range {
+    NSAssert(NSMaxRange(range) <= members->count, @"Range {%lu, %lu} out of members bounds.", (unsigned long)range.location, (unsigned long)range.length);
+    
+    hb_cmembers_retain(members);
+    hb_cmembers_release(_members);
+    
+    _members = members;
+    _offset = range.location;
+    _count = range.length;
+    _index = nil;
+    _mutations++;
+    
+    _invalidate_fingerprint = YES;
+}
+
+/// Computes everything derived from the membership in a single pass over the range.
+- (void)summarize {
+    __unsafe_unretained id<MKAnnotation> *annotations = _count ? _members->annotations + _offset : NULL;
+    MKMapPoint *points = _count ? _members->points + _offset : NULL;
+    
+    double x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+    _fingerprint = 0;
+    _identifier = 0;
+    
+    for (NSUInteger i = 0; i < _count; i++) {
+        uint64_t identifier = hb_annotation_id(annotations[i]);
+        if (!_identifier || identifier < _identifier) _identifier = identifier;
+        _fingerprint += hb_annotation_hash(annotations[i]);
+        
+        x0 = MIN(x0, points[i].x);
+        y0 = MIN(y0, points[i].y);
+        x1 = MAX(x1, points[i].x);
+        y1 = MAX(y1, points[i].y);
+    }
+    
+    _bounds = _count ? MKMapRectMake(x0, y0, x1 - x0, y1 - y0) : MKMapRectNull;
+    _invalidate_bounds = NO;
+    _invalidate_identifier = NO;
+    _invalidate_fingerprint = NO;
+}
+
+- (void)reserve:(NSUInteger)count {
+    
+    // The receiver owns its storage when no other cluster shares it and it retains the annotations, otherwise they are copied.
+    if (_members && atomic_load(&_members->refs) == 1 && !_members->owner && _offset == 0 && _count == _members->count) {
+        if (count > _members->capacity) {
+            _members->capacity = MAX(count, 2 * _members->capacity);
+            _members->annotations = (__unsafe_unretained id<MKAnnotation> *)realloc(_members->annotations, _members->capacity * sizeof(id));
+            _members->points = realloc(_members->points, _members->capacity * sizeof(MKMapPoint));
+        }
+        return;
+    }
+    
+    hb_cmembers_t *members = hb_cmembers_alloc(MAX(count, 2 * _count));
+    if (_count) {
+        memcpy(members->annotations, _members->annotations + _offset, _count * sizeof(id));
+        memcpy(members->points, _members->points + _offset, _count * sizeof(MKMapPoint));
+        for (NSUInteger i = 0; i < _count; i++) {
+            CFRetain((__bridge CFTypeRef)members->annotations[i]);
+        }
+    }
+    members->count = _count;
+    
+    hb_cmembers_release(_members);
+    _members = members;
+    _offset = 0;
+}
+
+- (NSUInteger)indexOfAnnotation:(id<MKAnnotation>)annotation {
+    if (!annotation) return NSNotFound;
+    
+    __unsafe_unretained id<MKAnnotation> *annotations = _count ? _members->annotations + _offset : NULL;
+    
+    if (_count > HB_CLUSTER_SCANMAX) {
+        if (!_index) {
+            _index = [[NSMapTable alloc] initWithKeyOptions:NSPointerFunctionsObjectPersonality | NSPointerFunctionsOpaqueMemory
+                                               valueOptions:NSPointerFunctionsStrongMemory
+                                                   capacity:_count];
+            
+            // Filled backwards, so that the first of equal annotations wins.
+            for (NSUInteger i = _count; i > 0; i--) [_index setObject:@(i - 1) forKey:annotations[i - 1]];
+        }
+        NSNumber *index = [_index objectForKey:annotation];
+        return index ? index.unsignedIntegerValue : NSNotFound;
+    }
+    
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (annotations[i] == annotation) return i;
+    }
+    for (NSUInteger i = 0; i < _count; i++) {
+        if ([annotations[i] isEqual:annotation]) return i;
+    }
+    return NSNotFound;
+}
+
+- (void)insertAnnotation:(id<MKAnnotation>)annotation atIndex:(NSUInteger)index {
+    if (_invalidate_fingerprint) [self summarize];
+    [self reserve:_count + 1];
+    
+    MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+    __unsafe_unretained id<MKAnnotation> *annotations = _members->annotations;
+    MKMapPoint *points = _members->points;
+    
+    memmove(annotations + index + 1, annotations + index, (_count - index) * sizeof(id));
+    memmove(points + index + 1, points + index, (_count - index) * sizeof(MKMapPoint));
+    
+    CFRetain((__bridge CFTypeRef)annotation);
+    annotations[index] = annotation;
+    points[index] = point;
+    _members->count = ++_count;
+    
+    // Inserting before the end shifts the indices, the map is built again on demand.
+    if (index + 1 < _count) {
+        _index = nil;
+    } else if (![_index objectForKey:annotation]) {
+        [_index setObject:@(index) forKey:annotation];
+    }
+    _mutations++;
+    
+    [self didAddAnnotation:annotation];
+    if (!_invalidate_bounds) {
+        _bounds = MKMapRectByAddingPoint(_bounds, point);
+    }
+}
+
+- (void)removeAnnotationAtIndex:(NSUInteger)index {
+    if (_invalidate_fingerprint) [self summarize];
+    [self reserve:_count];
+    
+    __unsafe_unretained id<MKAnnotation> *annotations = _members->annotations;
+    MKMapPoint *points = _members->points;
+    
+    // Takes over the storage reference, the annotation lives until the end of the method.
+    id<MKAnnotation> annotation = CFBridgingRelease((__bridge CFTypeRef)annotations[index]);
+    
+    memmove(annotations + index, annotations + index + 1, (_count - index - 1) * sizeof(id));
+    memmove(points + index, points + index + 1, (_count - index - 1) * sizeof(MKMapPoint));
+    _members->count = --_count;
+    
+    _index = nil;
+    _mutations++;
+    
+    [self didRemoveAnnotation:annotation];
+    _invalidate_bounds = YES;
+}
+
+- (void)didAddAnnotation:(id<MKAnnotation>)annotation {
+    _fingerprint += hb_annotation_hash(annotation);
+    
+    uint64_t identifier = hb_annotation_id(annotation);
+    if (!_invalidate_identifier && (!_identifier || identifier < _identifier)) {
+        _identifier = identifier;
+    }
+}
+
+- (void)didRemoveAnnotation:(id<MKAnnotation>)annotation {
+    _fingerprint -= hb_annotation_hash(annotation);
+    
+    if (hb_annotation_id(annotation) == _identifier) {
+        _invalidate_identifier = YES;
+    }
+}
+
+- (void)updateWithCluster:(CKCluster *)cluster {
+    
+    // Read first, resolving the cluster coordinate may reorder its annotations.
+    CLLocationCoordinate2D coordinate = cluster.coordinate;
+    
+    // Both clusters share the storage, the first one to change copies its annotations.
+    hb_cmembers_retain(cluster->_members);
+    hb_cmembers_release(_members);
+    
+    _members = cluster->_members;
+    _offset = cluster->_offset;
+    _count = cluster->_count;
+    _index = nil;
+    _mutations++;
+    
+    _bounds = cluster.bounds;
+    _invalidate_bounds = NO;
+    
+    _fingerprint = cluster.fingerprint;
+    _invalidate_fingerprint = NO;
+    _identifier = cluster.identifier;
+    _invalidate_identifier = NO;
+    
+    self.coordinate = coordinate;
+}
+
 - (NSUInteger)count {
-    return _annotations.count;
+    return _count;
 }
 
 - (id<MKAnnotation>)firstAnnotation {
-    return _annotations.firstObject;
+    return _count ? _members->annotations[_offset] : nil;
 }
 
 - (id<MKAnnotation>)lastAnnotation {
-    return _annotations.firstObject;
+    return _count ? _members->annotations[_offset + _count - 1] : nil;
 }
 
 - (id<MKAnnotation>)annotationAtIndex:(NSUInteger)index {
-    return _annotations[index];
+    if (index >= _count) {
+        [NSException raise:NSRangeException format:@"Index %lu beyond bounds [0 .. %lu].", (unsigned long)index, (unsigned long)_count];
+    }
+    return _members->annotations[_offset + index];
 }
 
 - (id<MKAnnotation>)objectAtIndexedSubscript:(NSUInteger)index {
-    return _annotations[index];
+    return [self annotationAtIndex:index];
 }
 
 - (void)addAnnotation:(id<MKAnnotation>)annotation {
-    [_annotations addObject:annotation];
-    _bounds = MKMapRectByAddingPoint(_bounds, MKMapPointForCoordinate(annotation.coordinate));
+    if ([self indexOfAnnotation:annotation] == NSNotFound) {
+        [self insertAnnotation:annotation atIndex:_count];
+    }
 }
 
 - (void)removeAnnotation:(id<MKAnnotation>)annotation {
-    if ([_annotations containsObject:annotation]) {
-        [_annotations removeObject:annotation];
-        _invalidate_bounds = YES;
+    NSUInteger index = [self indexOfAnnotation:annotation];
+    if (index != NSNotFound) {
+        [self removeAnnotationAtIndex:index];
     }
 }
 
 - (BOOL)containsAnnotation:(id<MKAnnotation>)annotation {
-    return [_annotations containsObject:annotation];
+    return [self indexOfAnnotation:annotation] != NSNotFound;
 }
 
 - (NSUInteger)hash {
-    return _annotations.hash;
+    return (NSUInteger)self.fingerprint;
 }
 
 - (BOOL)isEqual:(id)object {
@@ -140,15 +476,45 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 }
 
 - (BOOL)isEqualToCluster:(CKCluster *)cluster {
-    return [_annotations isEqual:cluster->_annotations];
+    if (_count != cluster->_count || self.fingerprint != cluster.fingerprint) {
+        return NO;
+    }
+    if (!_count || (_members == cluster->_members && _offset == cluster->_offset)) {
+        return YES;
+    }
+    return [self isSubsetOfCluster:cluster];
 }
 
 - (BOOL)intersectsCluster:(CKCluster *)cluster {
-    return [_annotations intersectsOrderedSet:cluster->_annotations];
+    CKCluster *small = _count < cluster->_count ? self : cluster;
+    CKCluster *large = small == self ? cluster : self;
+    
+    for (NSUInteger i = 0; i < small->_count; i++) {
+        if ([large containsAnnotation:small->_members->annotations[small->_offset + i]]) return YES;
+    }
+    return NO;
 }
 
 - (BOOL)isSubsetOfCluster:(CKCluster *)cluster {
-    return [_annotations isSubsetOfOrderedSet:cluster->_annotations];
+    if (_count > cluster->_count) {
+        return NO;
+    }
+    for (NSUInteger i = 0; i < _count; i++) {
+        if (![cluster containsAnnotation:_members->annotations[_offset + i]]) return NO;
+    }
+    return YES;
+}
+
+- (void)setAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    NSUInteger count = annotations.count;
+    __unsafe_unretained id<MKAnnotation> *buffer = (__unsafe_unretained id<MKAnnotation> *)malloc(MAX(count, 1) * sizeof(id));
+    [annotations getObjects:buffer range:NSMakeRange(0, count)];
+    
+    hb_cmembers_t *members = hb_cmembers_new(buffer, NULL, count);
+    free(buffer);
+    
+    [self setMembers:members range:NSMakeRange(0, count)];
+    hb_cmembers_release(members);
 }
 
 #pragma mark <CKCluster>
@@ -159,18 +525,30 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
     return cluster;
 }
 
++ (CKCluster *)clusterWithAnnotations:(__unsafe_unretained id<MKAnnotation> const *)annotations count:(NSUInteger)count {
+    CKCluster *cluster = [self clusterWithCoordinate:count ? annotations[0].coordinate : kCLLocationCoordinate2DInvalid];
+    
+    hb_cmembers_t *members = hb_cmembers_new(annotations, NULL, count);
+    [cluster setMembers:members range:NSMakeRange(0, count)];
+    hb_cmembers_release(members);
+    
+    return cluster;
+}
+
 #pragma mark <MKAnnotation>
 
 - (NSString *)title {
-    if (_annotations.count == 1 && [_annotations.firstObject respondsToSelector:@selector(title)]) {
-        return _annotations.firstObject.title;
+    id<MKAnnotation> annotation = self.firstAnnotation;
+    if (_count == 1 && [annotation respondsToSelector:@selector(title)]) {
+        return annotation.title;
     }
     return nil;
 }
 
 - (NSString *)subtitle {
-    if (_annotations.count == 1 && [_annotations.firstObject respondsToSelector:@selector(subtitle)]) {
-        return _annotations.firstObject.subtitle;
+    id<MKAnnotation> annotation = self.firstAnnotation;
+    if (_count == 1 && [annotation respondsToSelector:@selector(subtitle)]) {
+        return annotation.subtitle;
     }
     return nil;
 }
@@ -178,7 +556,14 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 #pragma mark <NSFastEnumeration>
 
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id  _Nullable __unsafe_unretained [])buffer count:(NSUInteger)len {
-    return [_annotations countByEnumeratingWithState:state objects:buffer count:len];
+    
+    // The annotations are handed out straight from the storage, in a single batch.
+    if (state->state || !_count) return 0;
+    
+    state->state = 1;
+    state->itemsPtr = (__unsafe_unretained id *)(_members->annotations + _offset);
+    state->mutationsPtr = &_mutations;
+    return _count;
 }
 
 @end
@@ -187,15 +572,30 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 
 @implementation CKCentroidCluster
 
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range {
+    [super setMembers:members range:range];
+    
+    CLLocationDegrees latitude = 0, longitude = 0;
+    for (NSUInteger i = 0; i < _count; i++) {
+        CLLocationCoordinate2D coordinate = _members->annotations[_offset + i].coordinate;
+        latitude += coordinate.latitude;
+        longitude += coordinate.longitude;
+    }
+    
+    self.coordinate = _count ? CLLocationCoordinate2DMake(latitude / _count, longitude / _count) : kCLLocationCoordinate2DInvalid;
+}
+
 - (void)addAnnotation:(id<MKAnnotation>)annotation {
-    [super addAnnotation:annotation];
-    self.coordinate = [self coordinateByAddingAnnotation:annotation];
+    if ([self indexOfAnnotation:annotation] == NSNotFound) {
+        [self insertAnnotation:annotation atIndex:_count];
+        self.coordinate = [self coordinateByAddingAnnotation:annotation];
+    }
 }
 
 - (void)removeAnnotation:(id<MKAnnotation>)annotation {
-    if ([_annotations containsObject:annotation]) {
-        [_annotations removeObject:annotation];
-        _invalidate_bounds = YES;
+    NSUInteger index = [self indexOfAnnotation:annotation];
+    if (index != NSNotFound) {
+        [self removeAnnotationAtIndex:index];
         self.coordinate = [self coordinateByRemovingAnnotation:annotation];
     }
 }
@@ -232,77 +632,275 @@ NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2) {
 #pragma mark - Nearest Centroid Cluster
 
 @implementation CKNearestCentroidCluster {
-    CLLocationCoordinate2D _center;
+    CLLocationDegrees _latitude;    ///< Sum of the annotations latitude
+    CLLocationDegrees _longitude;   ///< Sum of the annotations longitude
+    BOOL _invalidate_nearest;
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range {
+    [super setMembers:members range:range];
+    
+    CLLocationCoordinate2D centroid = [super coordinate];
+    _latitude = _count ? centroid.latitude * _count : 0;
+    _longitude = _count ? centroid.longitude * _count : 0;
+    
+    // The range is not shared yet, the nearest annotation is moved to its front in place.
+    [self updateNearest];
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range coordinate:(CLLocationCoordinate2D)coordinate {
+    [super setMembers:members range:range coordinate:coordinate];
+    
+    _latitude = _count ? coordinate.latitude * _count : 0;
+    _longitude = _count ? coordinate.longitude * _count : 0;
+    
+    // The range may be shared, the nearest annotation is moved to the front of a copy on first use.
+    _invalidate_nearest = YES;
 }
 
 - (void)addAnnotation:(id<MKAnnotation>)annotation {
-    if (![_annotations containsObject:annotation]) {
-        [_annotations addObject:annotation];
+    if ([self indexOfAnnotation:annotation] == NSNotFound) {
+        [self insertAnnotation:annotation atIndex:_count];
         
-        _center = [self coordinateByAddingAnnotation:annotation];
-        self.coordinate = [self coordinateByDistanceSort];
-        
-        _bounds = MKMapRectByAddingPoint(_bounds, MKMapPointForCoordinate(annotation.coordinate));
+        _latitude += annotation.coordinate.latitude;
+        _longitude += annotation.coordinate.longitude;
+        _invalidate_nearest = YES;
     }
 }
 
 - (void)removeAnnotation:(id<MKAnnotation>)annotation {
-    if ([_annotations containsObject:annotation]) {
-        [_annotations removeObject:annotation];
+    NSUInteger index = [self indexOfAnnotation:annotation];
+    if (index != NSNotFound) {
+        [self removeAnnotationAtIndex:index];
         
-        _center = [self coordinateByRemovingAnnotation:annotation];
-        self.coordinate = [self coordinateByDistanceSort];
+        _latitude -= annotation.coordinate.latitude;
+        _longitude -= annotation.coordinate.longitude;
+        _invalidate_nearest = YES;
+    }
+}
+
+/// Moves the annotation nearest to the centroid first, keeping the others in order, and sets the coordinate to it.
+- (void)updateNearest {
+    _invalidate_nearest = NO;
+    
+    if (!_count) {
+        self.coordinate = kCLLocationCoordinate2DInvalid;
+        return;
+    }
+    
+    // Single pass over the stored projected points, the center is projected once.
+    MKMapPoint center = MKMapPointForCoordinate(CLLocationCoordinate2DMake(_latitude / _count, _longitude / _count));
+    MKMapPoint *points = _members->points + _offset;
+    
+    NSUInteger nearest = 0;
+    double distance = CKMapPointDistance(center, points[0]);
+    for (NSUInteger i = 1; i < _count; i++) {
+        double d = CKMapPointDistance(center, points[i]);
+        if (d < distance) {
+            distance = d;
+            nearest = i;
+        }
+    }
+    
+    if (nearest) {
+        __unsafe_unretained id<MKAnnotation> *annotations = _members->annotations + _offset;
+        __unsafe_unretained id<MKAnnotation> annotation = annotations[nearest];
+        MKMapPoint point = points[nearest];
         
-        _invalidate_bounds = YES;
+        memmove(annotations + 1, annotations, nearest * sizeof(id));
+        memmove(points + 1, points, nearest * sizeof(MKMapPoint));
+        annotations[0] = annotation;
+        points[0] = point;
+        _index = nil;
+        _mutations++;
     }
+    
+    self.coordinate = _members->annotations[_offset].coordinate;
+}
+
+- (void)validateNearest {
+    if (_invalidate_nearest) {
+        // Mutations own the storage, reserving only guards against a shared one.
+        [self reserve:_count];
+        [self updateNearest];
+    }
+}
+
+- (CLLocationCoordinate2D)coordinate {
+    [self validateNearest];
+    return [super coordinate];
+}
+
+- (NSArray<id<MKAnnotation>> *)annotations {
+    [self validateNearest];
+    return [super annotations];
+}
+
+- (id<MKAnnotation>)firstAnnotation {
+    [self validateNearest];
+    return [super firstAnnotation];
+}
+
+- (id<MKAnnotation>)lastAnnotation {
+    [self validateNearest];
+    return [super lastAnnotation];
+}
+
+- (id<MKAnnotation>)annotationAtIndex:(NSUInteger)index {
+    [self validateNearest];
+    return [super annotationAtIndex:index];
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id  _Nullable __unsafe_unretained [])buffer count:(NSUInteger)len {
+    if (!state->state) [self validateNearest];
+    return [super countByEnumeratingWithState:state objects:buffer count:len];
 }
 
-- (CLLocationCoordinate2D)coordinateByDistanceSort {
-    [_annotations sortUsingComparator:^NSComparisonResult(id<MKAnnotation> _Nonnull obj1, id<MKAnnotation> _Nonnull obj2) {
-        double d1 = CKDistance(self->_center, obj1.coordinate);
-        double d2 = CKDistance(self->_center, obj2.coordinate);
-        if (d1 > d2) return NSOrderedDescending;
-        if (d1 < d2) return NSOrderedAscending;
-        return NSOrderedSame;
-    }];
+- (void)updateWithCluster:(CKCluster *)cluster {
+    [super updateWithCluster:cluster];
     
-    return _annotations.firstObject.coordinate;
+    if ([cluster isKindOfClass:[CKNearestCentroidCluster class]]) {
+        CKNearestCentroidCluster *other = (CKNearestCentroidCluster *)cluster;
+        _latitude = other->_latitude;
+        _longitude = other->_longitude;
+    } else {
+        _latitude = 0;
+        _longitude = 0;
+        for (NSUInteger i = 0; i < _count; i++) {
+            CLLocationCoordinate2D coordinate = _members->annotations[_offset + i].coordinate;
+            _latitude += coordinate.latitude;
+            _longitude += coordinate.longitude;
+        }
+    }
+    
+    // The given cluster coordinate was resolved before its members were shared.
+    _invalidate_nearest = NO;
 }
 
 @end
 
 #pragma mark - Bottom Cluster
 
-@implementation CKBottomCluster
+static inline void hb_members_swap(hb_cmembers_t *m, NSUInteger i, NSUInteger j) {
+    __unsafe_unretained id<MKAnnotation> annotation = m->annotations[i];
+    MKMapPoint point = m->points[i];
+    m->annotations[i] = m->annotations[j];
+    m->points[i] = m->points[j];
+    m->annotations[j] = annotation;
+    m->points[j] = point;
+}
+
+@implementation CKBottomCluster {
+    BOOL _invalidate_bottom;    ///< The bottom annotation of a shared range is not first yet
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range {
+    [super setMembers:members range:range];
+    
+    // The range is not shared yet, the bottom annotation is moved to its front in place.
+    _invalidate_bottom = NO;
+    [self updateBottom];
+}
+
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range coordinate:(CLLocationCoordinate2D)coordinate {
+    [super setMembers:members range:range coordinate:coordinate];
+    
+    // The range may be shared, the coordinate is read in place and the bottom annotation is moved to the front of a
+    // copy on first use.
+    NSUInteger bottom = [self indexOfBottom];
+    self.coordinate = _count ? _members->annotations[_offset + bottom].coordinate : kCLLocationCoordinate2DInvalid;
+    _invalidate_bottom = bottom != 0;
+}
+
+/// Returns the index of the southernmost annotation, the one with the largest projected y.
+- (NSUInteger)indexOfBottom {
+    MKMapPoint *points = _count ? _members->points + _offset : NULL;
+    NSUInteger bottom = 0;
+    for (NSUInteger i = 1; i < _count; i++) {
+        if (points[i].y > points[bottom].y) bottom = i;
+    }
+    return bottom;
+}
+
+/// Swaps the southernmost annotation with the first one.
+- (void)updateBottom {
+    if (!_count) {
+        self.coordinate = kCLLocationCoordinate2DInvalid;
+        return;
+    }
+    
+    NSUInteger bottom = [self indexOfBottom];
+    if (bottom) {
+        hb_members_swap(_members, _offset, _offset + bottom);
+        _index = nil;
+        _mutations++;
+    }
+    self.coordinate = _members->annotations[_offset].coordinate;
+}
+
+- (void)validateBottom {
+    if (_invalidate_bottom) {
+        _invalidate_bottom = NO;
+        [self reserve:_count];
+        [self updateBottom];
+    }
+}
 
 - (void)addAnnotation:(id<MKAnnotation>)annotation {
-    if (![_annotations containsObject:annotation]) {
-        NSUInteger index = [_annotations indexOfObject:annotation
-                                         inSortedRange:NSMakeRange(0, _annotations.count)
-                                               options:NSBinarySearchingInsertionIndex
-                                       usingComparator:^NSComparisonResult(id<MKAnnotation> _Nonnull obj1, id<MKAnnotation> _Nonnull obj2) {
-                                           if (obj1.coordinate.latitude > obj2.coordinate.latitude) return NSOrderedDescending;
-                                           if (obj1.coordinate.latitude < obj2.coordinate.latitude) return NSOrderedAscending;
-                                           return NSOrderedSame;
-                                       }];
-        
-        [_annotations insertObject:annotation atIndex:index];
-        
-        self.coordinate = _annotations.firstObject.coordinate;
+    [self validateBottom];
+    
+    if ([self indexOfAnnotation:annotation] == NSNotFound) {
+        [self insertAnnotation:annotation atIndex:_count];
         
-        _bounds = MKMapRectByAddingPoint(_bounds, MKMapPointForCoordinate(annotation.coordinate));
+        if (_members->points[_count - 1].y > _members->points[0].y) {
+            hb_members_swap(_members, 0, _count - 1);
+            _index = nil;
+            _mutations++;
+        }
+        self.coordinate = _members->annotations[0].coordinate;
     }
 }
 
 - (void)removeAnnotation:(id<MKAnnotation>)annotation {
-    if ([_annotations containsObject:annotation]) {
-        [_annotations removeObject:annotation];
-        
-        self.coordinate = _annotations.firstObject.coordinate;
-        
-        _invalidate_bounds = YES;
+    [self validateBottom];
+    
+    NSUInteger index = [self indexOfAnnotation:annotation];
+    if (index != NSNotFound) {
+        [self removeAnnotationAtIndex:index];
+        if (!index) [self updateBottom];
     }
 }
 
-@end
+- (NSArray<id<MKAnnotation>> *)annotations {
+    [self validateBottom];
+    return [super annotations];
+}
+
+- (id<MKAnnotation>)firstAnnotation {
+    [self validateBottom];
+    return [super firstAnnotation];
+}
 
+- (id<MKAnnotation>)lastAnnotation {
+    [self validateBottom];
+    return [super lastAnnotation];
+}
+
+- (id<MKAnnotation>)annotationAtIndex:(NSUInteger)index {
+    [self validateBottom];
+    return [super annotationAtIndex:index];
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id  _Nullable __unsafe_unretained [])buffer count:(NSUInteger)len {
+    if (!state->state) [self validateBottom];
+    return [super countByEnumeratingWithState:state objects:buffer count:len];
+}
+
+- (void)updateWithCluster:(CKCluster *)cluster {
+    [super updateWithCluster:cluster];
+    
+    // Both clusters share the range, the first one to expose its order copies it.
+    _invalidate_bottom = [cluster isKindOfClass:[CKBottomCluster class]] && ((CKBottomCluster *)cluster)->_invalidate_bottom;
+}
+
+@end
@@ -22,7 +22,10 @@
 
 #import <ClusterKit/CKClusterManager.h>
 #import <ClusterKit/CKQuadTree.h>
+#import <ClusterKit/CKQuadTreeSnapshot.h>
+#import <ClusterKit/CKHierarchicalDistanceBasedAlgorithm.h>
 #import <ClusterKit/CKMap.h>
+#import <stdatomic.h>
 
 const double kCKMarginFactorWorld = -1;
 
@@ -31,15 +34,387 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
             fabs(coordinate1.longitude - coordinate2.longitude) <= DBL_EPSILON);
 }
 
+#pragma mark - Tile Cache
+
+#define HB_TILE_MAXLEVELS 16    ///< Tile sizes cached at once
+#define HB_TILE_MAXCOUNT 256    ///< Tiles per request above which the cache is bypassed
+#define HB_TILE_BITS 28         ///< Bits of each tile coordinate in a key
+
+static inline uint64_t hb_tile_key(NSUInteger level, uint64_t x, uint64_t y) {
+    return ((uint64_t)level << (2 * HB_TILE_BITS)) | (x << HB_TILE_BITS) | y;
+}
+
+/// A cached tile, linked by order of use.
+@interface CKClusterTile : NSObject {
+@public
+    uint64_t _key;
+    NSUInteger _level;
+    NSUInteger _cost;
+    NSArray<CKCluster *> *_clusters;
+    __unsafe_unretained CKClusterTile *_prev;
+    __unsafe_unretained CKClusterTile *_next;
+}
+@end
+
+@implementation CKClusterTile
+@end
+
+/**
+ A cache of clusters by zoom level and tile, evicting the least recently used tiles above a memory budget.
+ A level stands for a tile size in use, each tile is keyed by its level and position.
+ */
+@interface CKClusterTileCache : NSObject
+@property (atomic) NSUInteger limit;
+@end
+
+@implementation CKClusterTileCache {
+    NSMutableDictionary<NSNumber *, CKClusterTile *> *_tiles;
+    __unsafe_unretained CKClusterTile *_head;   ///< Most recently used
+    __unsafe_unretained CKClusterTile *_tail;   ///< Least recently used
+    NSUInteger _cost;
+    
+    double _sizes[HB_TILE_MAXLEVELS];           ///< Tile size of each level
+    NSUInteger _counts[HB_TILE_MAXLEVELS];      ///< Number of tiles of each level, 0 when the level is free
+    
+    NSUInteger _epoch;                          ///< Incremented on each invalidation
+    __weak CKClusterAlgorithm *_algorithm;
+    
+    NSMapTable<CKCluster *, CKClusterTile *> *_owners;  ///< The tile each cached cluster was stored in
+}
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _tiles = [NSMutableDictionary dictionary];
+        _owners = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsWeakMemory | NSPointerFunctionsObjectPointerPersonality
+                                        valueOptions:NSPointerFunctionsWeakMemory];
+    }
+    return self;
+}
+
+- (nullable NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect
+                                         tileSize:(double)size
+                                        algorithm:(CKClusterAlgorithm *)algorithm
+                                          compute:(NSArray<CKCluster *> *(^)(MKMapRect rect))compute {
+    if (!self.limit || size <= 0) return nil;
+    
+    uint64_t n = (uint64_t)ceil(MKMapSizeWorld.width / size);
+    if (n >= (1ULL << HB_TILE_BITS)) return nil;
+    
+    // The tiles covering the rect, plus the ones covering its portion outside the world.
+    MKMapRect rects[2] = {
+        MKMapRectIntersection(rect, MKMapRectWorld),
+        MKMapRectSpans180thMeridian(rect) ? MKMapRectRemainder(rect) : MKMapRectNull
+    };
+    
+    uint64_t ranges[2][4];
+    uint64_t count = 0;
+    for (NSUInteger r = 0; r < 2; r++) {
+        if (MKMapRectIsNull(rects[r]) || MKMapRectIsEmpty(rects[r])) {
+            ranges[r][0] = ranges[r][2] = 1;
+            ranges[r][1] = ranges[r][3] = 0;
+            continue;
+        }
+        ranges[r][0] = (uint64_t)MAX(0, floor(MKMapRectGetMinX(rects[r]) / size));
+        ranges[r][1] = MIN(n - 1, (uint64_t)MAX(0, floor(MKMapRectGetMaxX(rects[r]) / size)));
+        ranges[r][2] = (uint64_t)MAX(0, floor(MKMapRectGetMinY(rects[r]) / size));
+        ranges[r][3] = MIN(n - 1, (uint64_t)MAX(0, floor(MKMapRectGetMaxY(rects[r]) / size)));
+        count += (ranges[r][1] - ranges[r][0] + 1) * (ranges[r][3] - ranges[r][2] + 1);
+    }
+    if (count > HB_TILE_MAXCOUNT) return nil;
+    
+    NSMutableOrderedSet<NSNumber *> *positions = [NSMutableOrderedSet orderedSetWithCapacity:(NSUInteger)count];
+    for (NSUInteger r = 0; r < 2; r++) {
+        for (uint64_t y = ranges[r][2]; y <= ranges[r][3]; y++) {
+            for (uint64_t x = ranges[r][0]; x <= ranges[r][1]; x++) {
+                [positions addObject:@(hb_tile_key(0, x, y))];
+            }
+        }
+    }
+    
+    NSMutableArray<CKCluster *> *clusters = [NSMutableArray array];
+    uint64_t mask = (1ULL << HB_TILE_BITS) - 1;
+    
+    for (NSNumber *position in positions) {
+        uint64_t x = (position.unsignedLongLongValue >> HB_TILE_BITS) & mask;
+        uint64_t y = position.unsignedLongLongValue & mask;
+        
+        NSArray<CKCluster *> *tileClusters = nil;
+        NSUInteger epoch;
+        
+        @synchronized(self) {
+            if (algorithm != _algorithm) {
+                [self removeAllTiles];
+                _algorithm = algorithm;
+            }
+            
+            NSUInteger level = [self levelForSize:size];
+            CKClusterTile *tile = (level != NSNotFound) ? _tiles[@(hb_tile_key(level, x, y))] : nil;
+            if (tile) {
+                [self unlink:tile];
+                [self link:tile];
+                tileClusters = tile->_clusters;
+            }
+            epoch = _epoch;
+        }
+        
+        if (!tileClusters) {
+            MKMapRect tileRect = MKMapRectIntersection(MKMapRectMake(x * size, y * size, size, size), MKMapRectWorld);
+            tileClusters = compute(tileRect);
+            
+            // Tiles computed while anything got invalidated may be stale, they are not kept.
+            @synchronized(self) {
+                if (epoch == _epoch) [self storeClusters:tileClusters size:size x:x y:y];
+            }
+        }
+        
+        [clusters addObjectsFromArray:tileClusters];
+    }
+    
+    return clusters;
+}
+
+- (void)invalidatePoint:(MKMapPoint)point {
+    [self invalidatePoints:&point count:1];
+}
+
+- (void)invalidatePoints:(const MKMapPoint *)points count:(NSUInteger)count {
+    if (!count) return;
+    
+    @synchronized(self) {
+        _epoch++;
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            MKMapPoint point = points[i];
+            if (!isfinite(point.x) || !isfinite(point.y)) continue;
+            
+            for (NSUInteger level = 0; level < HB_TILE_MAXLEVELS; level++) {
+                if (!_counts[level]) continue;
+                
+                double x = floor(point.x / _sizes[level]), y = floor(point.y / _sizes[level]);
+                if (x < 0 || y < 0 || x >= (1ULL << HB_TILE_BITS) || y >= (1ULL << HB_TILE_BITS)) continue;
+                
+                CKClusterTile *tile = _tiles[@(hb_tile_key(level, (uint64_t)x, (uint64_t)y))];
+                if (tile) [self evict:tile];
+            }
+        }
+    }
+}
+
+- (void)evictTileOfCluster:(CKCluster *)cluster {
+    @synchronized(self) {
+        
+        // The tile may have been replaced by a newer one at the same position, which is kept.
+        CKClusterTile *tile = [_owners objectForKey:cluster];
+        if (tile && _tiles[@(tile->_key)] == tile) [self evict:tile];
+    }
+}
+
+- (void)removeAllTiles {
+    @synchronized(self) {
+        _epoch++;
+        
+        [_tiles removeAllObjects];
+        _head = _tail = nil;
+        _cost = 0;
+        memset(_counts, 0, sizeof(_counts));
+    }
+}
+
+#pragma mark Private
+
+- (NSUInteger)levelForSize:(double)size {
+    for (NSUInteger level = 0; level < HB_TILE_MAXLEVELS; level++) {
+        if (_counts[level] && _sizes[level] == size) return level;
+    }
+    return NSNotFound;
+}
+
+- (void)storeClusters:(NSArray<CKCluster *> *)clusters size:(double)size x:(uint64_t)x y:(uint64_t)y {
+    NSUInteger level = [self levelForSize:size];
+    
+    // Least recently used tiles make room for a new level.
+    while (level == NSNotFound) {
+        for (NSUInteger l = 0; l < HB_TILE_MAXLEVELS && level == NSNotFound; l++) {
+            if (!_counts[l]) level = l;
+        }
+        if (level == NSNotFound) [self evict:_tail];
+    }
+    _sizes[level] = size;
+    
+    NSUInteger cost = 64 + clusters.count * 128;
+    for (CKCluster *cluster in clusters) cost += cluster.count * 16;
+    
+    CKClusterTile *tile = [CKClusterTile new];
+    tile->_key = hb_tile_key(level, x, y);
+    tile->_level = level;
+    tile->_cost = cost;
+    tile->_clusters = clusters;
+    for (CKCluster *cluster in clusters) [_owners setObject:tile forKey:cluster];
+    
+    CKClusterTile *previous = _tiles[@(tile->_key)];
+    if (previous) [self evict:previous];
+    
+    _tiles[@(tile->_key)] = tile;
+    [self link:tile];
+    _counts[level]++;
+    _cost += cost;
+    
+    NSUInteger limit = self.limit;
+    while (_cost > limit && _tail) {
+        [self evict:_tail];
+    }
+}
+
+- (void)evict:(CKClusterTile *)tile {
+    [self unlink:tile];
+    _counts[tile->_level]--;
+    _cost -= tile->_cost;
+    [_tiles removeObjectForKey:@(tile->_key)];
+}
+
+- (void)link:(CKClusterTile *)tile {
+    tile->_prev = nil;
+    tile->_next = _head;
+    if (_head) _head->_prev = tile;
+    _head = tile;
+    if (!_tail) _tail = tile;
+}
+
+- (void)unlink:(CKClusterTile *)tile {
+    if (tile->_prev) tile->_prev->_next = tile->_next;
+    else _head = tile->_next;
+    
+    if (tile->_next) tile->_next->_prev = tile->_prev;
+    else _tail = tile->_prev;
+    
+    tile->_prev = tile->_next = nil;
+}
+
+@end
+
+#pragma mark - Cluster Manager
+
 @interface CKClusterManager () <CKAnnotationTreeDelegate>
 @property (nonatomic,strong) id<CKAnnotationTree> tree;
 @property (nonatomic,strong) CKCluster *selectedCluster;
+@property (atomic,strong) id<MKAnnotation> extractionSelection;    ///< The selected annotation when the running update started, read off the main thread
 @property (nonatomic) MKMapRect visibleMapRect;
 @end
 
+typedef struct hb_cslot {
+    uint64_t key;       ///< Cluster identifier, 0 for an empty slot
+    NSUInteger index;   ///< Position of the cluster in the displayed array
+} hb_cslot_t;
+
+static inline NSUInteger hb_cslot_hash(uint64_t key, NSUInteger mask) {
+    return (NSUInteger)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+/**
+ Pairs clusters for the zoom animations, through a temporary flat grid over the clusters to animate.
+ A cluster is paired with the closest target cluster whose bounds, edges included, contain its coordinate. Pairs entirely
+ outside the visible rect are ignored.
+ 
+ @param clusters The clusters to animate.
+ @param targets The clusters to pair with.
+ @param rect The visible map rect.
+ @param match On return, the index in targets paired with each cluster, or NSNotFound.
+ */
+static void hb_match_clusters(NSArray<CKCluster *> *clusters, NSArray<CKCluster *> *targets, MKMapRect rect, NSUInteger *match) {
+    NSUInteger count = clusters.count;
+    if (!count) return;
+    
+    MKMapPoint *points = malloc(count * sizeof(MKMapPoint));
+    double *distances = malloc(count * sizeof(double));
+    
+    double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    for (NSUInteger i = 0; i < count; i++) {
+        MKMapPoint point = MKMapPointForCoordinate(clusters[i].coordinate);
+        points[i] = point;
+        match[i] = NSNotFound;
+        minX = MIN(minX, point.x); maxX = MAX(maxX, point.x);
+        minY = MIN(minY, point.y); maxY = MAX(maxY, point.y);
+    }
+    
+    // Counting sort of the clusters into about one cell per cluster.
+    NSUInteger side = MAX(1, (NSUInteger)ceil(sqrt(count)));
+    double width = (maxX - minX) / side, height = (maxY - minY) / side;
+    if (width <= 0) width = 1;
+    if (height <= 0) height = 1;
+    
+    NSUInteger *offsets = calloc(side * side + 1, sizeof(NSUInteger));
+    NSUInteger *cells = malloc(count * sizeof(NSUInteger));
+    NSUInteger *items = malloc(count * sizeof(NSUInteger));
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        NSUInteger col = MIN(side - 1, (NSUInteger)((points[i].x - minX) / width));
+        NSUInteger row = MIN(side - 1, (NSUInteger)((points[i].y - minY) / height));
+        cells[i] = row * side + col;
+        offsets[cells[i] + 1]++;
+    }
+    for (NSUInteger c = 0; c < side * side; c++) offsets[c + 1] += offsets[c];
+    for (NSUInteger i = 0; i < count; i++) items[offsets[cells[i]]++] = i;
+    for (NSUInteger c = side * side; c > 0; c--) offsets[c] = offsets[c - 1];
+    offsets[0] = 0;
+    
+    for (NSUInteger index = 0; index < targets.count; index++) {
+        CKCluster *target = targets[index];
+        MKMapPoint targetPoint = MKMapPointForCoordinate(target.coordinate);
+        BOOL visible = MKMapRectContainsPoint(rect, targetPoint);
+        
+        MKMapRect bounds = target.bounds;
+        double x0 = MKMapRectGetMinX(bounds), x1 = MKMapRectGetMaxX(bounds);
+        double y0 = MKMapRectGetMinY(bounds), y1 = MKMapRectGetMaxY(bounds);
+        
+        if (MKMapRectIsNull(bounds) || x1 < minX || x0 > maxX || y1 < minY || y0 > maxY) continue;
+        
+        NSUInteger col0 = x0 <= minX ? 0 : MIN(side - 1, (NSUInteger)((x0 - minX) / width));
+        NSUInteger col1 = MIN(side - 1, (NSUInteger)((x1 - minX) / width));
+        NSUInteger row0 = y0 <= minY ? 0 : MIN(side - 1, (NSUInteger)((y0 - minY) / height));
+        NSUInteger row1 = MIN(side - 1, (NSUInteger)((y1 - minY) / height));
+        
+        for (NSUInteger row = row0; row <= row1; row++) {
+            for (NSUInteger c = row * side + col0; c <= row * side + col1; c++) {
+                for (NSUInteger k = offsets[c]; k < offsets[c + 1]; k++) {
+                    NSUInteger i = items[k];
+                    MKMapPoint point = points[i];
+                    
+                    if (point.x < x0 || point.x > x1 || point.y < y0 || point.y > y1) continue;
+                    if (!visible && !MKMapRectContainsPoint(rect, point)) continue;
+                    
+                    double distance = CKMapPointDistance(point, targetPoint);
+                    if (match[i] == NSNotFound || distance < distances[i]) {
+                        match[i] = index;
+                        distances[i] = distance;
+                    }
+                }
+            }
+        }
+    }
+    
+    free(items);
+    free(cells);
+    free(offsets);
+    free(distances);
+    free(points);
+}
+
 @implementation CKClusterManager {
     NSMutableSet<CKCluster *> *_clusters;
+    CKClusterTileCache *_tileCache;
     dispatch_queue_t _queue;
+    atomic_ulong _generation;
+    
+    CFAbsoluteTime _lastUpdate;
+    BOOL _updating;
+    BOOL _scheduled;
+    BOOL _pending;
+    
+    NSUInteger _running;    ///< Updates started and not completed yet
+    NSMutableData *_dirty;  ///< Points whose tiles wait to be clustered again
+    
+    unsigned long _replacements;
 }
 
 - (instancetype)init {
@@ -49,10 +424,15 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
         self.maxZoomLevel = 20;
         self.marginFactor = kCKMarginFactorWorld;
         self.animationDuration = .5;
+        self.minimumUpdateInterval = 1. / 15;
+        _observesAnnotationCoordinates = YES;
 #if __has_include(<UIKit/UIKit.h>)
         self.animationOptions = UIViewAnimationOptionCurveEaseOut;
 #endif
         _clusters = [NSMutableSet set];
+        _tileCache = [CKClusterTileCache new];
+        _tileCache.limit = 8 << 20;
+        _dirty = [NSMutableData data];
         
         _queue = dispatch_queue_create("com.hulab.cluster", DISPATCH_QUEUE_CONCURRENT);
     }
@@ -67,19 +447,35 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
 - (void)updateClustersIfNeeded {
     if (!self.map) return;
     
+    // While an update is computing or waiting for its budget, the request is coalesced into a single pending one.
+    if (_updating || _scheduled) {
+        _pending = YES;
+        return;
+    }
+    
+    NSTimeInterval delay = _lastUpdate + self.minimumUpdateInterval - CFAbsoluteTimeGetCurrent();
+    if (delay > 0) {
+        _scheduled = YES;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            self->_scheduled = NO;
+            self->_pending = NO;
+            [self updateClustersIfNeeded];
+        });
+        return;
+    }
+    
     MKMapRect visibleMapRect = self.map.visibleMapRect;
     
     // Zoom update
     if (fabs(self.visibleMapRect.size.width - visibleMapRect.size.width) > 0.1f) {
-        [self updateMapRect:visibleMapRect animated:(self.animationDuration > 0)];
+        [self coalescedUpdateMapRect:visibleMapRect animated:(self.animationDuration > 0)];
         
-    } else if (self.marginFactor != kCKMarginFactorWorld) {
+    } else if (self.marginFactor != kCKMarginFactorWorld &&
+               (fabs(self.visibleMapRect.origin.x - visibleMapRect.origin.x) > self.visibleMapRect.size.width * self.marginFactor / 2 ||
+                fabs(self.visibleMapRect.origin.y - visibleMapRect.origin.y) > self.visibleMapRect.size.height* self.marginFactor / 2)) {
         
         // Translation update
-        if (fabs(self.visibleMapRect.origin.x - visibleMapRect.origin.x) > self.visibleMapRect.size.width * self.marginFactor / 2 ||
-            fabs(self.visibleMapRect.origin.y - visibleMapRect.origin.y) > self.visibleMapRect.size.height* self.marginFactor / 2 ) {
-            [self updateMapRect:visibleMapRect animated:NO];
-        }
+        [self coalescedUpdateMapRect:visibleMapRect animated:NO];
     }
 }
 
@@ -92,6 +488,19 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
     [self updateMapRect:visibleMapRect animated:animated];
 }
 
+- (NSUInteger)tileCacheLimit {
+    return _tileCache.limit;
+}
+
+- (void)setTileCacheLimit:(NSUInteger)tileCacheLimit {
+    _tileCache.limit = tileCacheLimit;
+    if (!tileCacheLimit) [_tileCache removeAllTiles];
+}
+
+- (void)invalidateTileCache {
+    [_tileCache removeAllTiles];
+}
+
 - (NSArray<CKCluster *> *)clusters {
     if (self.selectedCluster) {
         return [_clusters setByAddingObject:self.selectedCluster].allObjects;
@@ -102,33 +511,123 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
 #pragma mark Manage Annotations
 
 - (void)setAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
-    self.tree = [[CKQuadTree alloc] initWithAnnotations:annotations];
+    _replacements++;
+    [_tileCache removeAllTiles];
+    self.tree = [[CKQuadTree alloc] initWithAnnotations:annotations observesCoordinates:self.observesAnnotationCoordinates];
     self.tree.delegate = self;
     [self updateClusters];
 }
 
+- (void)setAnnotations:(NSArray<id<MKAnnotation>> *)annotations completion:(void (^)(void))completion {
+    if (!self.isAsynchronous) {
+        self.annotations = annotations;
+        if (completion) completion();
+        return;
+    }
+    
+    // The tree is built on the cluster queue, a newer replacement supersedes this one.
+    annotations = [annotations copy];
+    BOOL observesCoordinates = self.observesAnnotationCoordinates;
+    unsigned long replacement = ++_replacements;
+    
+    dispatch_async(_queue, ^{
+        CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:annotations observesCoordinates:observesCoordinates];
+        
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (self->_replacements == replacement) {
+                self.annotationTree = tree;
+            }
+            if (completion) completion();
+        });
+    });
+}
+
+- (void)setCoordinates:(const CLLocationCoordinate2D *)coordinates identifiers:(const uint64_t *)identifiers count:(NSUInteger)count {
+    CKAnnotationResolver resolver = nil;
+    
+    if ([self.delegate respondsToSelector:@selector(clusterManager:annotationWithIdentifier:)]) {
+        __weak typeof(self) weakSelf = self;
+        resolver = ^id<MKAnnotation>(uint64_t identifier) {
+            __strong typeof(weakSelf) self = weakSelf;
+            return [self.delegate clusterManager:self annotationWithIdentifier:identifier];
+        };
+    }
+    
+    self.annotationTree = [[CKQuadTreeSnapshot alloc] initWithCoordinates:coordinates identifiers:identifiers count:count resolver:resolver];
+}
+
+- (id<MKAnnotation>)annotationWithIdentifier:(uint64_t)identifier {
+    if (![self.tree isKindOfClass:[CKQuadTreeSnapshot class]]) return nil;
+    return [(CKQuadTreeSnapshot *)self.tree annotationWithIdentifier:identifier];
+}
+
+- (void)setAnnotationTree:(id<CKAnnotationTree>)tree {
+    _replacements++;
+    [_tileCache removeAllTiles];
+    self.tree = tree;
+    self.tree.delegate = self;
+    [self updateClusters];
+}
+
+- (void)setObservesAnnotationCoordinates:(BOOL)observesAnnotationCoordinates {
+    if (_observesAnnotationCoordinates == observesAnnotationCoordinates) return;
+    _observesAnnotationCoordinates = observesAnnotationCoordinates;
+    
+    // Other trees, snapshots included, are not replaced by a quadtree. The value applies to the next annotations set.
+    if ([self.tree isKindOfClass:[CKQuadTree class]]) self.annotations = self.tree.annotations;
+}
+
+// Snapshot trees resolve all their points here, the cluster manager itself only reads the annotations of trees it rebuilds.
 - (NSArray<id<MKAnnotation>> *)annotations {
     return self.tree ? self.tree.annotations : @[];
 }
 
 - (void)addAnnotation:(id<MKAnnotation>)annotation {
-    self.annotations = [self.annotations arrayByAddingObject:annotation];
+    [self addAnnotations:@[annotation]];
 }
 
 - (void)addAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
-    self.annotations = [self.annotations arrayByAddingObjectsFromArray:annotations];
+    if (!self.tree) {
+        self.annotations = annotations;
+        return;
+    }
+    
+    // Trees without incremental changes are rebuilt.
+    if (![self.tree respondsToSelector:@selector(insertAnnotations:)]) {
+        NSMutableOrderedSet<id<MKAnnotation>> *set = [NSMutableOrderedSet orderedSetWithArray:self.tree.annotations];
+        [set addObjectsFromArray:annotations];
+        self.annotationTree = [[(id)self.tree.class alloc] initWithAnnotations:set.array];
+        return;
+    }
+    
+    [self.tree insertAnnotations:annotations];
+    [self invalidateTilesForAnnotations:annotations];
+    [self updateClustersAffectedByAnnotations:annotations];
 }
 
 - (void)removeAnnotation:(id<MKAnnotation>)annotation {
-    NSMutableArray *annotations = [self.annotations mutableCopy];
-    [annotations removeObject:annotation];
-    self.annotations = annotations;
+    [self removeAnnotations:@[annotation]];
 }
 
 - (void)removeAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
-    NSMutableArray *_annotations = [self.annotations mutableCopy];
-    [_annotations removeObjectsInArray:annotations];
-    self.annotations = _annotations;
+    if (!self.tree) return;
+    
+    if (![self.tree respondsToSelector:@selector(removeAnnotations:)]) {
+        NSMutableOrderedSet<id<MKAnnotation>> *set = [NSMutableOrderedSet orderedSetWithArray:self.tree.annotations];
+        [set minusSet:[NSSet setWithArray:annotations]];
+        self.annotationTree = [[(id)self.tree.class alloc] initWithAnnotations:set.array];
+        return;
+    }
+    
+    [self.tree removeAnnotations:annotations];
+    [self invalidateTilesForAnnotations:annotations];
+    [self updateClustersAffectedByAnnotations:annotations];
+}
+
+- (void)updateCoordinates:(const CLLocationCoordinate2D *)coordinates forAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    if ([self.tree respondsToSelector:@selector(updateCoordinates:forAnnotations:)]) {
+        [self.tree updateCoordinates:coordinates forAnnotations:annotations];
+    }
 }
 
 - (void)selectAnnotation:(id<MKAnnotation>)annotation animated:(BOOL)animated {
@@ -137,7 +636,13 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
         CKCluster *cluster = [self clusterForAnnotation:annotation];
         
         if (!cluster || cluster.count > 1) {
+            
+            // The cluster hash depends on its membership, it leaves the set while being mutated.
+            BOOL displayed = cluster && [_clusters containsObject:cluster];
+            if (displayed) [_clusters removeObject:cluster];
+            if (cluster) [_tileCache evictTileOfCluster:cluster];
             [cluster removeAnnotation:annotation];
+            if (displayed) [_clusters addObject:cluster];
             
             cluster = [self.algorithm clusterWithCoordinate:annotation.coordinate];
             [cluster addAnnotation:annotation];
@@ -161,48 +666,372 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
 
 #pragma mark - Private
 
+- (MKMapRect)clusterMapRectForVisibleMapRect:(MKMapRect)visibleMapRect {
+    if (self.marginFactor == kCKMarginFactorWorld) {
+        return MKMapRectWorld;
+    }
+    return MKMapRectInset(visibleMapRect,
+                          -self.marginFactor * visibleMapRect.size.width,
+                          -self.marginFactor * visibleMapRect.size.height);
+}
+
+- (void)invalidateTilesForAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    for (id<MKAnnotation> annotation in annotations) {
+        [_tileCache invalidatePoint:MKMapPointForCoordinate(annotation.coordinate)];
+    }
+}
+
+- (void)updateClustersAffectedByAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    if (!self.map) return;
+    
+    for (id<MKAnnotation> annotation in annotations) {
+        MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+        [_dirty appendBytes:&point length:sizeof(MKMapPoint)];
+    }
+    [self updateDirtyTiles];
+}
+
+- (void)updateClustersAffectedByPoints:(const MKMapPoint *)points count:(NSUInteger)count {
+    if (!self.map) return;
+    
+    // Moves may come at a high rate, those received during an update are served at once when it completes.
+    [_dirty appendBytes:points length:count * sizeof(MKMapPoint)];
+    [self updateDirtyTiles];
+}
+
+- (void)updateDirtyTiles {
+    
+    // Changes made during an update are served once it completes.
+    if (_running || !_dirty.length) return;
+    
+    const MKMapPoint *points = _dirty.bytes;
+    NSUInteger count = _dirty.length / sizeof(MKMapPoint);
+    
+    MKMapRect visibleMapRect = _visibleMapRect;
+    MKMapRect clusterMapRect = [self clusterMapRectForVisibleMapRect:visibleMapRect];
+    MKMapRect remainder = MKMapRectSpans180thMeridian(clusterMapRect) ? MKMapRectRemainder(clusterMapRect) : MKMapRectNull;
+    
+    double zoom = self.map.zoom;
+    CKClusterAlgorithm *algorithm = (zoom < self.maxZoomLevel)? self.algorithm : [CKClusterAlgorithm new];
+    double size = [algorithm tileSizeAtZoom:zoom];
+    
+    // Only clusters computed by tiles are updated piecewise, and only at the zoom they are displayed at.
+    BOOL piecewise = self.tree && size > 0 && ceil(MKMapSizeWorld.width / size) < (1ULL << HB_TILE_BITS) &&
+                     fabs(self.map.visibleMapRect.size.width - visibleMapRect.size.width) <= 0.1f;
+    
+    NSMutableOrderedSet<NSNumber *> *tiles = [NSMutableOrderedSet orderedSet];
+    BOOL affected = NO;
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        MKMapPoint point = points[i];
+        if (!MKMapRectContainsPoint(clusterMapRect, point) && !MKMapRectContainsPoint(remainder, point)) continue;
+        
+        affected = YES;
+        if (piecewise) [tiles addObject:@(hb_tile_key(0, (uint64_t)floor(point.x / size), (uint64_t)floor(point.y / size)))];
+    }
+    [_dirty setLength:0];
+    
+    if (!affected) return;
+    if (!piecewise || tiles.count > HB_TILE_MAXCOUNT) {
+        [self updateClusters];
+        return;
+    }
+    
+    NSMutableData *rects = [NSMutableData dataWithLength:tiles.count * sizeof(MKMapRect)];
+    MKMapRect *next = rects.mutableBytes;
+    uint64_t mask = (1ULL << HB_TILE_BITS) - 1;
+    for (NSNumber *tile in tiles) {
+        uint64_t x = (tile.unsignedLongLongValue >> HB_TILE_BITS) & mask;
+        uint64_t y = tile.unsignedLongLongValue & mask;
+        *next++ = MKMapRectIntersection(MKMapRectMake(x * size, y * size, size, size), MKMapRectWorld);
+    }
+    
+    id<CKAnnotationTree> tree = self.tree;
+    CKClusterTileCache *tileCache = _tileCache;
+    BOOL asynchronous = self.isAsynchronous;
+    
+    // No update is running, a newer one supersedes this one.
+    _running++;
+    self.extractionSelection = self.selectedAnnotation;
+    unsigned long generation = atomic_fetch_add(&_generation, 1) + 1;
+    BOOL (^isCancelled)(void) = ^BOOL{
+        return atomic_load(&self->_generation) != generation;
+    };
+    
+    void (^update)(void) = ^{
+        const MKMapRect *tileRects = rects.bytes;
+        NSUInteger tileCount = rects.length / sizeof(MKMapRect);
+        NSMutableArray<CKCluster *> *clusters = [NSMutableArray array];
+        
+        for (NSUInteger i = 0; i < tileCount && !isCancelled(); i++) {
+            
+            // Half a tile from its origin only covers that tile.
+            MKMapRect rect = MKMapRectMake(tileRects[i].origin.x, tileRects[i].origin.y, tileRects[i].size.width / 2, tileRects[i].size.height / 2);
+            NSArray<CKCluster *> *tileClusters = [tileCache clustersInRect:rect
+                                                                  tileSize:size
+                                                                 algorithm:algorithm
+                                                                   compute:^NSArray<CKCluster *> *(MKMapRect tileRect) {
+                                                                       return [algorithm clustersInRect:tileRect zoom:zoom tree:tree];
+                                                                   }];
+            [clusters addObjectsFromArray:tileClusters ?: [algorithm clustersInRect:tileRects[i] zoom:zoom tree:tree]];
+        }
+        
+        void (^apply)(void) = ^{
+            if (!isCancelled()) {
+                
+                // Each displayed cluster lies within the tile it was computed in.
+                NSMutableArray<CKCluster *> *displayedClusters = [NSMutableArray array];
+                for (CKCluster *cluster in self->_clusters) {
+                    MKMapPoint center = MKMapPointMake(MKMapRectGetMidX(cluster.bounds), MKMapRectGetMidY(cluster.bounds));
+                    for (NSUInteger i = 0; i < tileCount; i++) {
+                        if (MKMapRectContainsPoint(tileRects[i], center)) {
+                            [displayedClusters addObject:cluster];
+                            break;
+                        }
+                    }
+                }
+                [self applyClusters:clusters replacing:displayedClusters visibleMapRect:visibleMapRect];
+            }
+            
+            self->_running--;
+            [self updateDirtyTiles];
+        };
+        
+        if (asynchronous) {
+            dispatch_async(dispatch_get_main_queue(), apply);
+        } else {
+            apply();
+        }
+    };
+    
+    if (asynchronous) {
+        dispatch_async(_queue, update);
+    } else {
+        update();
+    }
+}
+
+- (void)coalescedUpdateMapRect:(MKMapRect)visibleMapRect animated:(BOOL)animated {
+    _updating = YES;
+    _lastUpdate = CFAbsoluteTimeGetCurrent();
+    
+    [self updateMapRect:visibleMapRect animated:animated completion:^{
+        self->_updating = NO;
+        
+        // Serve the requests received meanwhile, so that the clusters match the map once it settles.
+        if (self->_pending) {
+            self->_pending = NO;
+            [self updateClustersIfNeeded];
+        }
+    }];
+}
+
 - (void)updateMapRect:(MKMapRect)visibleMapRect animated:(BOOL)animated {
+    [self updateMapRect:visibleMapRect animated:animated completion:nil];
+}
+
+- (void)updateMapRect:(MKMapRect)visibleMapRect animated:(BOOL)animated completion:(void (^)(void))completion {
     if (!self.tree || MKMapRectIsNull(visibleMapRect) || MKMapRectIsEmpty(visibleMapRect)) {
+        if (completion) completion();
         return;
     }
     
-    MKMapRect clusterMapRect = MKMapRectWorld;
-    if (self.marginFactor != kCKMarginFactorWorld) {
-        clusterMapRect = MKMapRectInset(visibleMapRect,
-                                        -self.marginFactor * visibleMapRect.size.width,
-                                        -self.marginFactor * visibleMapRect.size.height);
-    }
+    // The tree is read once the update runs, it covers the changes made so far.
+    _running++;
+    [_dirty setLength:0];
+    
+    // The selection is read by the tree delegate methods, possibly on the cluster queue.
+    self.extractionSelection = self.selectedAnnotation;
+    
+    MKMapRect clusterMapRect = [self clusterMapRectForVisibleMapRect:visibleMapRect];
     
     double zoom = self.map.zoom;
     CKClusterAlgorithm *algorithm = (zoom < self.maxZoomLevel)? self.algorithm : [CKClusterAlgorithm new];
-    NSArray *clusters = [algorithm clustersInRect:clusterMapRect zoom:zoom tree:self.tree];
+    id<CKAnnotationTree> tree = self.tree;
+    CKClusterTileCache *tileCache = _tileCache;
+    BOOL asynchronous = self.isAsynchronous;
     
-    NSMutableSet *newClusters = [NSMutableSet setWithArray:clusters];
-    NSMutableSet *oldClusters = [NSMutableSet setWithSet:_clusters];
+    // Any newer request supersedes this one.
+    unsigned long generation = atomic_fetch_add(&_generation, 1) + 1;
+    BOOL (^isCancelled)(void) = ^BOOL{
+        return atomic_load(&self->_generation) != generation;
+    };
     
-    [oldClusters minusSet:newClusters];
-    [newClusters minusSet:_clusters];
+    void (^done)(void) = ^{
+        self->_running--;
+        [self updateDirtyTiles];
+        if (completion) completion();
+    };
+    
+    // The completion is always called on the main thread, whether the request is applied or abandoned.
+    void (^finish)(void) = ^{
+        if (asynchronous) {
+            dispatch_async(dispatch_get_main_queue(), done);
+        } else {
+            done();
+        }
+    };
+    
+    void (^update)(void) = ^{
+        if (isCancelled()) {
+            finish();
+            return;
+        }
+        
+        // Algorithms computing clusters by tiles only cluster the tiles not in the cache.
+        NSArray *clusters = [tileCache clustersInRect:clusterMapRect
+                                             tileSize:[algorithm tileSizeAtZoom:zoom]
+                                            algorithm:algorithm
+                                              compute:^NSArray<CKCluster *> *(MKMapRect rect) {
+                                                  return [algorithm clustersInRect:rect zoom:zoom tree:tree];
+                                              }];
+        if (!clusters) {
+            clusters = [algorithm clustersInRect:clusterMapRect zoom:zoom tree:tree];
+        }
+        if (isCancelled()) {
+            finish();
+            return;
+        }
+        
+        // The diff runs along with the apply, on the main thread, as displayed clusters may be updated in place.
+        void (^apply)(void) = ^{
+            if (!isCancelled()) {
+                [self applyClusters:clusters replacing:self->_clusters.allObjects visibleMapRect:visibleMapRect];
+            }
+            done();
+        };
+        
+        if (asynchronous) {
+            dispatch_async(dispatch_get_main_queue(), apply);
+        } else {
+            apply();
+        }
+    };
+    
+    if (asynchronous) {
+        dispatch_async(_queue, update);
+    } else {
+        update();
+    }
+}
+
+- (void)diffClusters:(NSArray<CKCluster *> *)clusters
+             against:(NSArray<CKCluster *> *)displayedClusters
+               added:(NSMutableArray<CKCluster *> *)addedClusters
+             removed:(NSMutableArray<CKCluster *> *)removedClusters
+             updated:(nullable NSMapTable<CKCluster *, CKCluster *> *)updatedClusters {
+    
+    NSUInteger count = displayedClusters.count;
+    NSUInteger capacity = 8;
+    while (capacity < count * 2) capacity <<= 1;
+    NSUInteger mask = capacity - 1;
+    
+    hb_cslot_t *slots = calloc(capacity, sizeof(hb_cslot_t));
+    BOOL *matched = calloc(count + 1, sizeof(BOOL));
+    
+    // Index the displayed clusters by identifier. Members are disjoint, so identifiers are unique.
+    NSUInteger index = 0;
+    for (CKCluster *cluster in displayedClusters) {
+        uint64_t key = cluster.identifier;
+        if (key) {
+            NSUInteger slot = hb_cslot_hash(key, mask);
+            while (slots[slot].key && slots[slot].key != key) slot = (slot + 1) & mask;
+            if (!slots[slot].key) slots[slot] = (hb_cslot_t){ .key = key, .index = index };
+        }
+        index++;
+    }
+    
+    for (CKCluster *cluster in clusters) {
+        uint64_t key = cluster.identifier;
+        CKCluster *match = nil;
+        
+        if (key) {
+            NSUInteger slot = hb_cslot_hash(key, mask);
+            while (slots[slot].key && slots[slot].key != key) slot = (slot + 1) & mask;
+            if (slots[slot].key && !matched[slots[slot].index]) {
+                matched[slots[slot].index] = YES;
+                match = displayedClusters[slots[slot].index];
+            }
+        }
+        
+        if (!match) {
+            [addedClusters addObject:cluster];
+        } else if (match.class != cluster.class || !updatedClusters) {
+            [removedClusters addObject:match];
+            [addedClusters addObject:cluster];
+        } else if (match.fingerprint != cluster.fingerprint || match.count != cluster.count ||
+                   !CLLocationCoordinateEqual(match.coordinate, cluster.coordinate)) {
+            
+            // Without updates, changed clusters are replaced.
+            if (updatedClusters) {
+                [updatedClusters setObject:cluster forKey:match];
+            } else {
+                [removedClusters addObject:match];
+                [addedClusters addObject:cluster];
+            }
+        }
+    }
+    
+    for (index = 0; index < count; index++) {
+        if (!matched[index]) [removedClusters addObject:displayedClusters[index]];
+    }
+    
+    free(matched);
+    free(slots);
+}
+
+- (void)applyClusters:(NSArray<CKCluster *> *)clusters replacing:(NSArray<CKCluster *> *)displayedClusters visibleMapRect:(MKMapRect)visibleMapRect {
+    NSMutableArray<CKCluster *> *newClusters = [NSMutableArray array];
+    NSMutableArray<CKCluster *> *oldClusters = [NSMutableArray array];
+    NSMapTable<CKCluster *, CKCluster *> *updatedClusters = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                                                                   valueOptions:NSPointerFunctionsStrongMemory];
     
     NSComparisonResult zoomOrder = MKMapSizeCompare(_visibleMapRect.size, visibleMapRect.size);
     _visibleMapRect = visibleMapRect;
     
+    // Across zoom levels, changed clusters are replaced so that the zoom animations pair them with their parent or children.
+    [self diffClusters:clusters
+               against:displayedClusters
+                 added:newClusters
+               removed:oldClusters
+               updated:zoomOrder == NSOrderedSame ? updatedClusters : nil];
+    
+    // Clusters updated in place stay on the map and move to their new coordinate.
+    NSMutableArray<CKClusterAnimation *> *moves = [NSMutableArray arrayWithCapacity:updatedClusters.count];
+    for (CKCluster *cluster in updatedClusters) {
+        CLLocationCoordinate2D from = cluster.coordinate;
+        CKCluster *update = [updatedClusters objectForKey:cluster];
+        
+        // A cached cluster changing members no longer matches its tile, which is evicted. Tiles computed since then hold
+        // the update and are kept, and so is the tile of a cluster only moving with its members.
+        if (update.fingerprint != cluster.fingerprint) [_tileCache evictTileOfCluster:cluster];
+        
+        [_clusters removeObject:cluster];
+        [cluster updateWithCluster:update];
+        [_clusters addObject:cluster];
+        
+        [moves addObject:[CKClusterAnimation animateCluster:cluster from:from to:cluster.coordinate]];
+    }
+    
+    for (CKCluster *cluster in oldClusters) {
+        [_clusters removeObject:cluster];
+    }
+    [_clusters addObjectsFromArray:newClusters];
+    
     switch (zoomOrder) {
         case NSOrderedAscending:
-            [self collapse:oldClusters.allObjects to:newClusters.allObjects in:visibleMapRect];
+            [self collapse:oldClusters to:newClusters moving:moves in:visibleMapRect];
             break;
             
         case NSOrderedDescending:
-            [self expand:newClusters.allObjects from:oldClusters.allObjects in:visibleMapRect];
+            [self expand:newClusters from:oldClusters moving:moves in:visibleMapRect];
             break;
             
         default:
-            [self.map addClusters:newClusters.allObjects];
-            [self.map removeClusters:oldClusters.allObjects];
+            [self.map addClusters:newClusters];
+            [self.map removeClusters:oldClusters];
             break;
     }
-    
-    [_clusters minusSet:oldClusters];
-    [_clusters unionSet:newClusters];
 }
 
 - (void)setSelectedCluster:(CKCluster *)selectedCluster animated:(BOOL)animated {
@@ -211,6 +1040,10 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
     CKCluster *prev = self.selectedCluster;
     self.selectedCluster = selectedCluster;
     
+    // Selection changes what clusters are made of, around the selected annotations.
+    if (prev.firstAnnotation) [self invalidateTilesForAnnotations:@[prev.firstAnnotation]];
+    if (selectedCluster.firstAnnotation) [self invalidateTilesForAnnotations:@[selectedCluster.firstAnnotation]];
+    
     if (prev) {
         [_clusters addObject:prev];
         [self.map deselectCluster:prev animated:animated];
@@ -236,83 +1069,149 @@ BOOL CLLocationCoordinateEqual(CLLocationCoordinate2D coordinate1, CLLocationCoo
     return nil;
 }
 
-- (void)expand:(NSArray<CKCluster *> *)newClusters from:(NSArray<CKCluster *> *)oldClusters in:(MKMapRect)rect {
-    id<CKAnnotationTree> tree = [[CKQuadTree alloc] initWithAnnotations:newClusters];
-    
+- (void)expand:(NSArray<CKCluster *> *)newClusters from:(NSArray<CKCluster *> *)oldClusters moving:(NSArray<CKClusterAnimation *> *)moves in:(MKMapRect)rect {
     [self.map addClusters:newClusters];
     
-    NSMutableSet *animations = [NSMutableSet set];
+    // Each new cluster comes from the old cluster it was split from.
+    NSUInteger *match = malloc(MAX(newClusters.count, 1) * sizeof(NSUInteger));
+    [self matchClusters:newClusters withAncestors:oldClusters in:rect match:match];
     
-    for (CKCluster *oldCluster in oldClusters) {
+    NSMutableArray<CKClusterAnimation *> *animations = [NSMutableArray arrayWithArray:moves];
+    for (NSUInteger i = 0; i < newClusters.count; i++) {
+        if (match[i] == NSNotFound) continue;
         
-        NSArray *neighbors = [tree annotationsInRect:oldCluster.bounds];
-        for (CKCluster *neighbor in neighbors) {
-            
-            if (!MKMapRectContainsPoint(rect, MKMapPointForCoordinate(oldCluster.coordinate)) &&
-                !MKMapRectContainsPoint(rect, MKMapPointForCoordinate(neighbor.coordinate))) {
-                continue;
-            }
-            
-            CKClusterAnimation *animation = [animations member:neighbor];
-            
-            if (!animation) {
-                animation = [CKClusterAnimation animateCluster:neighbor from:oldCluster.coordinate to:neighbor.coordinate];
-                [animations addObject:animation];
-                continue;
-            }
-            
-            if (CKDistance(animation.from, animation.to) > CKDistance(oldCluster.coordinate, neighbor.coordinate)) {
-                animation.from = oldCluster.coordinate;
-                animation.to = neighbor.coordinate;
-            }
-        }
+        CKCluster *cluster = newClusters[i];
+        [animations addObject:[CKClusterAnimation animateCluster:cluster from:oldClusters[match[i]].coordinate to:cluster.coordinate]];
     }
+    free(match);
     
-    [self.map performAnimations:animations.allObjects completion:nil];
+    [self.map performAnimations:animations completion:nil];
     [self.map removeClusters:oldClusters];
 }
 
-- (void)collapse:(NSArray<CKCluster *> *)oldClusters to:(NSArray<CKCluster *> *)newClusters in:(MKMapRect)rect {
-    id<CKAnnotationTree> tree = [[CKQuadTree alloc] initWithAnnotations:oldClusters];
-    
+- (void)collapse:(NSArray<CKCluster *> *)oldClusters to:(NSArray<CKCluster *> *)newClusters moving:(NSArray<CKClusterAnimation *> *)moves in:(MKMapRect)rect {
     [self.map addClusters:newClusters];
     
-     NSMutableSet *animations = [NSMutableSet set];
+    // Each old cluster goes to the new cluster it was merged into.
+    NSUInteger *match = malloc(MAX(oldClusters.count, 1) * sizeof(NSUInteger));
+    [self matchClusters:oldClusters withAncestors:newClusters in:rect match:match];
     
-    for (CKCluster *newCluster in newClusters) {
+    NSMutableArray<CKClusterAnimation *> *animations = [NSMutableArray array];
+    for (NSUInteger i = 0; i < oldClusters.count; i++) {
+        if (match[i] == NSNotFound) continue;
         
-        NSArray *neighbors = [tree annotationsInRect:newCluster.bounds];
-        for (CKCluster *neighbor in neighbors) {
-            
-            if (!MKMapRectContainsPoint(rect, MKMapPointForCoordinate(newCluster.coordinate)) &&
-                !MKMapRectContainsPoint(rect, MKMapPointForCoordinate(neighbor.coordinate))) {
-                continue;
-            }
-            
-            CKClusterAnimation *animation = [animations member:neighbor];
-            
-            if (!animation) {
-                animation = [CKClusterAnimation animateCluster:neighbor from:neighbor.coordinate to:newCluster.coordinate];
-                [animations addObject:animation];
-                continue;
-            }
-            
-            if (CKDistance(animation.from, animation.to) > CKDistance(neighbor.coordinate, newCluster.coordinate)) {
-                animation.from = neighbor.coordinate;
-                animation.to = newCluster.coordinate;
+        CKCluster *cluster = oldClusters[i];
+        [animations addObject:[CKClusterAnimation animateCluster:cluster from:cluster.coordinate to:newClusters[match[i]].coordinate]];
+    }
+    free(match);
+    
+    [self.map performAnimations:[animations arrayByAddingObjectsFromArray:moves] completion:^(BOOL finished) {
+        
+        // Old clusters may be cached and displayed again later, they get their coordinate back.
+        for (CKClusterAnimation *animation in animations) {
+            animation.cluster.coordinate = animation.from;
+        }
+        
+        NSMutableArray<CKCluster *> *clusters = [NSMutableArray arrayWithCapacity:oldClusters.count];
+        for (CKCluster *cluster in oldClusters) {
+            if ([self->_clusters member:cluster] != cluster) [clusters addObject:cluster];
+        }
+        [self.map removeClusters:clusters];
+    }];
+}
+
+/**
+ Pairs clusters with their ancestor at a coarser zoom level. A hierarchical algorithm links them through its hierarchy,
+ the clusters it does not know are paired spatially {@see hb_match_clusters}.
+ */
+- (void)matchClusters:(NSArray<CKCluster *> *)clusters withAncestors:(NSArray<CKCluster *> *)ancestors in:(MKMapRect)rect match:(NSUInteger *)match {
+    CKClusterAlgorithm *algorithm = self.algorithm;
+    if (![algorithm isKindOfClass:[CKHierarchicalDistanceBasedAlgorithm class]]) {
+        hb_match_clusters(clusters, ancestors, rect, match);
+        return;
+    }
+    
+    CKHierarchicalDistanceBasedAlgorithm *hierarchy = (CKHierarchicalDistanceBasedAlgorithm *)algorithm;
+    
+    // Clusters are equal when they have the same annotations, so parents are found among the ancestors by content.
+    NSMapTable<CKCluster *, NSNumber *> *indexes = [NSMapTable strongToStrongObjectsMapTable];
+    for (NSUInteger i = 0; i < ancestors.count; i++) {
+        [indexes setObject:@(i) forKey:ancestors[i]];
+    }
+    
+    NSMutableArray<CKCluster *> *unlinked = [NSMutableArray array];
+    NSMutableIndexSet *positions = [NSMutableIndexSet indexSet];
+    
+    for (NSUInteger i = 0; i < clusters.count; i++) {
+        CKCluster *cluster = clusters[i];
+        NSNumber *index = nil;
+        
+        // Parents hold strictly more annotations, which bounds the walk up the hierarchy.
+        CKCluster *parent = cluster;
+        NSUInteger count = cluster.count;
+        while (!index && (parent = [hierarchy parentOfCluster:parent]) && parent.count > count) {
+            index = [indexes objectForKey:parent];
+            count = parent.count;
+        }
+        
+        match[i] = NSNotFound;
+        if (index) {
+            // Like spatial pairs, pairs entirely outside the visible rect are ignored.
+            CKCluster *ancestor = ancestors[index.unsignedIntegerValue];
+            if (MKMapRectContainsPoint(rect, MKMapPointForCoordinate(cluster.coordinate)) ||
+                MKMapRectContainsPoint(rect, MKMapPointForCoordinate(ancestor.coordinate))) {
+                match[i] = index.unsignedIntegerValue;
             }
+        } else {
+            [unlinked addObject:cluster];
+            [positions addIndex:i];
         }
     }
     
-    [self.map performAnimations:animations.allObjects completion:^(BOOL finished) {
-        [self.map removeClusters:oldClusters];
+    if (!unlinked.count) return;
+    
+    NSUInteger *spatial = malloc(unlinked.count * sizeof(NSUInteger));
+    hb_match_clusters(unlinked, ancestors, rect, spatial);
+    
+    __block NSUInteger k = 0;
+    [positions enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        match[i] = spatial[k++];
     }];
+    free(spatial);
 }
 
 #pragma mark <KPAnnotationTreeDelegate>
 
+- (void)annotationTree:(id<CKAnnotationTree>)annotationTree didMoveAnnotation:(id<MKAnnotation>)annotation from:(MKMapPoint)from to:(MKMapPoint)to {
+    [_tileCache invalidatePoint:from];
+    [_tileCache invalidatePoint:to];
+}
+
+- (void)annotationTree:(id<CKAnnotationTree>)annotationTree didMoveAnnotations:(NSArray<id<MKAnnotation>> *)annotations from:(const MKMapPoint *)from to:(const MKMapPoint *)to {
+    NSUInteger count = annotations.count;
+    [_tileCache invalidatePoints:from count:count];
+    [_tileCache invalidatePoints:to count:count];
+    
+    if ([NSThread isMainThread]) {
+        [self updateClustersAffectedByPoints:from count:count];
+        [self updateClustersAffectedByPoints:to count:count];
+        return;
+    }
+    
+    NSMutableData *points = [NSMutableData dataWithBytes:from length:count * sizeof(MKMapPoint)];
+    [points appendBytes:to length:count * sizeof(MKMapPoint)];
+    
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self updateClustersAffectedByPoints:points.bytes count:2 * count];
+    });
+}
+
+- (BOOL)annotationTreeFiltersAnnotations:(id<CKAnnotationTree>)annotationTree {
+    return self.extractionSelection || [self.delegate respondsToSelector:@selector(clusterManager:shouldClusterAnnotation:)];
+}
+
 - (BOOL)annotationTree:(id<CKAnnotationTree>)annotationTree shouldExtractAnnotation:(id<MKAnnotation>)annotation {
-    if (annotation == self.selectedAnnotation) {
+    if (annotation == self.extractionSelection) {
         return NO;
     }
 
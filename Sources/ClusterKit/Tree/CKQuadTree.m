@@ -21,87 +21,481 @@
 // THE SOFTWARE.
 
 #import <ClusterKit/CKQuadTree.h>
+#import <stdatomic.h>
+#import <Block.h>
 
-/// Quadtree point
-typedef struct hb_qpoint {
-    MKMapPoint point;
-    __unsafe_unretained id<MKAnnotation> annotation;
-    struct hb_qpoint *next;
-} hb_qpoint_t;
+/// Number of elements allocated at once by a pool
+#define HB_QPOOL_CHUNK 1024
+
+/// Maximum depth of the tree, deeper nodes keep their points beyond capacity (e.g. duplicated coordinates)
+#define HB_QNODE_MAXDEPTH 40
+
+/// Number of points tested at once by the range kernel
+#define HB_QLANES 4
+
+/// Minimum number of annotations for a bulk load to be spread over the cores
+#define HB_QLOAD_PARALLEL 32768
+
+/// Depth of the subtrees loaded concurrently by a bulk load, at most 4^HB_QLOAD_DEPTH of them
+#define HB_QLOAD_DEPTH 3
+
+/// Vector of HB_QLANES coordinates, compiled to SSE/AVX or NEON instructions
+typedef double hb_qvec_t __attribute__((vector_size(HB_QLANES * sizeof(double)), aligned(sizeof(double))));
 
-/// Quadtree node
+/// Vector of HB_QLANES comparison results
+typedef int64_t hb_qmask_t __attribute__((vector_size(HB_QLANES * sizeof(int64_t))));
+
+/// Pool chunk
+typedef struct hb_qchunk {
+    struct hb_qchunk *next; ///< Previously allocated chunk
+    double data[];          ///< Chunk elements
+} hb_qchunk_t;
+
+/// Fixed-size element pool
+typedef struct hb_qpool {
+    size_t size;            ///< Size of an element
+    size_t used;            ///< Number of elements used in the current chunk
+    hb_qchunk_t *chunks;    ///< Chained list of chunks, the current one first
+    void *free;             ///< Free-list of released elements
+} hb_qpool_t;
+
+/// Quadtree points bucket, stored as a structure of arrays padded to a multiple of HB_QLANES.
+/// Unused lanes hold NAN coordinates so they never pass a range test.
+typedef struct hb_qbucket {
+    struct hb_qbucket *next;    ///< Next full bucket, only chained on nodes at maximum depth
+    NSUInteger cnt;             ///< Number of points in the bucket
+    double *x;                  ///< Points x coordinates
+    double *y;                  ///< Points y coordinates
+    __unsafe_unretained id<MKAnnotation> *annotations; ///< Points annotations
+    double *v;                  ///< Points reducer values, the values of a reducer are contiguous
+} hb_qbucket_t;
+
+/// Quadtree node, followed by the reduced value of each reducer over its subtree
 typedef struct hb_qnode {
     NSUInteger cap;         ///< Capacity of the node
     NSUInteger cnt;         ///< Number of point in the node
     MKMapRect bound;        ///< Area covered by the node
-    hb_qpoint_t *points;    ///< Chained list of node's points
+    hb_qbucket_t *points;   ///< Node's points, the bucket with free lanes first
+    struct hb_qnode *parent;///< Parent node, NULL for the root
     struct hb_qnode *nw;    ///< NW quadrant of the node
     struct hb_qnode *ne;    ///< NE quadrant of the node
     struct hb_qnode *sw;    ///< SW quadrant of the node
     struct hb_qnode *se;    ///< SE quadrant of the node
+    NSUInteger total;       ///< Number of points in the subtree
+    double sx, sy;          ///< Sums of the subtree points coordinates
+    double x0, y0, x1, y1;  ///< Tight bounding box of the subtree points, inverted when empty
 } hb_qnode_t;
 
+/// Numeric reducer aggregated by the nodes
+typedef struct hb_qreducer {
+    CKReducer kind;
+    __unsafe_unretained double(^value)(id<MKAnnotation> annotation);
+} hb_qreducer_t;
+
+/// Annotation index entry
+typedef struct hb_qref {
+    __unsafe_unretained id<MKAnnotation> annotation;
+    hb_qnode_t *node;       ///< Node owning the annotation
+} hb_qref_t;
+
+/// Open-addressing hash of nodes by annotation
+typedef struct hb_qindex {
+    NSUInteger cap;         ///< Number of slots, a power of two
+    NSUInteger cnt;         ///< Number of indexed annotations
+    hb_qref_t *slots;       ///< Linear probing slots
+} hb_qindex_t;
+
 /// Quadtree container
 typedef struct hb_qtree {
-    hb_qnode_t *root;   ///< Root node
+    hb_qnode_t *root;       ///< Root node
+    NSUInteger lanes;       ///< Number of lanes of a bucket
+    NSUInteger nred;        ///< Number of reducers
+    hb_qreducer_t *reducers;///< Reducers, values are copied
+    hb_qpool_t nodes;       ///< Node pool
+    hb_qpool_t buckets;     ///< Bucket pool
+    hb_qindex_t index;      ///< Annotation index
 } hb_qtree_t;
 
-static hb_qnode_t *hb_qnode_new(MKMapRect bound, NSUInteger capacity) {
-    hb_qnode_t *n = malloc(sizeof(hb_qnode_t));
-    memset(n, 0, sizeof(hb_qnode_t));
+static void hb_qpool_init(hb_qpool_t *p, size_t size) {
+    p->size = size;
+    p->used = HB_QPOOL_CHUNK;
+    p->chunks = NULL;
+    p->free = NULL;
+}
+
+static void *hb_qpool_alloc(hb_qpool_t *p) {
+    if (p->free) {
+        void *e = p->free;
+        p->free = *(void **)e;
+        return e;
+    }
     
-    n->bound = bound;
-    n->cap = capacity;
-    return n;
+    if (p->used == HB_QPOOL_CHUNK) {
+        hb_qchunk_t *c = malloc(sizeof(hb_qchunk_t) + p->size * HB_QPOOL_CHUNK);
+        c->next = p->chunks;
+        p->chunks = c;
+        p->used = 0;
+    }
+    
+    return (char *)p->chunks->data + p->size * p->used++;
+}
+
+static void hb_qpool_release(hb_qpool_t *p, void *e) {
+    *(void **)e = p->free;
+    p->free = e;
+}
+
+/// Moves the elements of a pool to another pool of the same element size, leaving it empty.
+static void hb_qpool_merge(hb_qpool_t *p, hb_qpool_t *from) {
+    if (!from->chunks) return;
+    
+    if (!p->chunks) {
+        p->chunks = from->chunks;
+        p->used = from->used;
+    } else {
+        // Chunks are inserted after the current chunk of the pool, the free tail of the current chunk of the other pool is lost.
+        hb_qchunk_t *last = from->chunks;
+        while (last->next) last = last->next;
+        last->next = p->chunks->next;
+        p->chunks->next = from->chunks;
+    }
+    
+    if (from->free) {
+        void *last = from->free;
+        while (*(void **)last) last = *(void **)last;
+        *(void **)last = p->free;
+        p->free = from->free;
+    }
+    hb_qpool_init(from, from->size);
+}
+
+static void hb_qpool_drain(hb_qpool_t *p) {
+    hb_qchunk_t *c = p->chunks;
+    while (c) {
+        hb_qchunk_t *next = c->next;
+        free(c);
+        c = next;
+    }
+    hb_qpool_init(p, p->size);
+}
+
+#define HB_QINDEX_MINCAP 64
+
+static inline NSUInteger hash_(__unsafe_unretained id a) {
+    uintptr_t h = (uintptr_t)(__bridge void *)a;
+    return (NSUInteger)((h >> 4) * 0x9E3779B97F4A7C15ULL);
+}
+
+static void hb_qindex_init(hb_qindex_t *x, NSUInteger cap) {
+    x->cap = cap;
+    x->cnt = 0;
+    x->slots = calloc(cap, sizeof(hb_qref_t));
 }
 
-static void hb_qpoint_free(hb_qpoint_t *p) {
-    if (p) {
-        hb_qpoint_free(p->next);
-        free(p);
+static hb_qref_t *hb_qindex_get(hb_qindex_t *x, __unsafe_unretained id a) {
+    NSUInteger mask = x->cap - 1;
+    for (NSUInteger i = hash_(a) & mask; x->slots[i].annotation; i = (i + 1) & mask) {
+        if (x->slots[i].annotation == a) return &x->slots[i];
     }
+    return NULL;
 }
 
-static void hb_qnode_free(hb_qnode_t *n) {
-    hb_qpoint_free(n->points);
-    n->cnt = 0;
+static void hb_qindex_put(hb_qindex_t *x, id<MKAnnotation> a, hb_qnode_t *n) {
+    if (2 * (x->cnt + 1) > x->cap) {
+        hb_qref_t *slots = x->slots;
+        NSUInteger cap = x->cap;
+        
+        hb_qindex_init(x, cap * 2);
+        for (NSUInteger i = 0; i < cap; i++) {
+            if (slots[i].annotation) hb_qindex_put(x, slots[i].annotation, slots[i].node);
+        }
+        free(slots);
+    }
     
-    if(n->nw) {
-        hb_qnode_free(n->nw);
-        hb_qnode_free(n->ne);
-        hb_qnode_free(n->sw);
-        hb_qnode_free(n->se);
+    NSUInteger mask = x->cap - 1;
+    NSUInteger i = hash_(a) & mask;
+    while (x->slots[i].annotation) i = (i + 1) & mask;
+    x->slots[i].annotation = a;
+    x->slots[i].node = n;
+    x->cnt++;
+}
+
+/// Indexes an annotation unless it already is, in which case NULL is returned. The node of the entry is left to the caller.
+/// May be called concurrently, as long as the index is large enough to never grow.
+static hb_qref_t *hb_qindex_claim(hb_qindex_t *x, __unsafe_unretained id a) {
+    NSUInteger mask = x->cap - 1;
+    for (NSUInteger i = hash_(a) & mask; ; i = (i + 1) & mask) {
+        void *expected = NULL;
+        void **slot = (void **)(void *)&x->slots[i].annotation;
+        
+        if (__atomic_compare_exchange_n(slot, &expected, (__bridge void *)a, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return &x->slots[i];
+        }
+        if (expected == (__bridge void *)a) return NULL;
     }
-    free(n);
 }
 
-static void add_(hb_qnode_t *n, hb_qpoint_t *p) {
-    p->next = n->points;
-    n->points = p;
-    n->cnt++;
+static void hb_qindex_del(hb_qindex_t *x, hb_qref_t *ref) {
+    NSUInteger mask = x->cap - 1;
+    NSUInteger i = ref - x->slots;
+    
+    // Backward shift deletion, so that probing sequences never contain holes.
+    for (NSUInteger j = (i + 1) & mask; x->slots[j].annotation; j = (j + 1) & mask) {
+        NSUInteger k = hash_(x->slots[j].annotation) & mask;
+        if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+            x->slots[i] = x->slots[j];
+            i = j;
+        }
+    }
+    x->slots[i].annotation = nil;
+    x->slots[i].node = NULL;
+    x->cnt--;
+}
+
+static hb_qbucket_t *hb_qbucket_new(hb_qtree_t *t) {
+    hb_qbucket_t *b = hb_qpool_alloc(&t->buckets);
+    b->next = NULL;
+    b->cnt = 0;
+    b->x = (double *)(b + 1);
+    b->y = b->x + t->lanes;
+    b->annotations = (__unsafe_unretained id<MKAnnotation> *)(void *)(b->y + t->lanes);
+    b->v = (double *)(void *)(b->annotations + t->lanes);
+    
+    for (NSUInteger i = 0; i < t->lanes; i++) {
+        b->x[i] = NAN;
+        b->y[i] = NAN;
+        b->annotations[i] = nil;
+    }
+    for (NSUInteger i = 0; i < t->nred * t->lanes; i++) {
+        b->v[i] = NAN;
+    }
+    return b;
+}
+
+/// Reduced values of a node, stored right after it.
+static inline double *red_(hb_qnode_t *n) {
+    return (double *)(void *)(n + 1);
+}
+
+static inline double identity_(CKReducer kind) {
+    switch (kind) {
+        case CKReducerMin: return INFINITY;
+        case CKReducerMax: return -INFINITY;
+        default: return 0;
+    }
+}
+
+static inline double reduce_(CKReducer kind, double a, double b) {
+    switch (kind) {
+        case CKReducerMin: return fmin(a, b);
+        case CKReducerMax: return fmax(a, b);
+        default: return a + b;
+    }
+}
+
+/// Whether a value is the extremum of a min or max reduction, so that removing it requires a refresh.
+static inline bool extreme_(CKReducer kind, double value, double reduced) {
+    switch (kind) {
+        case CKReducerMin: return value <= reduced;
+        case CKReducerMax: return value >= reduced;
+        default: return false;
+    }
+}
+
+/// Evaluates the reducers on an annotation.
+static void values_(hb_qtree_t *t, id<MKAnnotation> a, double *v) {
+    for (NSUInteger r = 0; r < t->nred; r++) {
+        v[r] = t->reducers[r].value(a);
+    }
+}
+
+static void empty_(hb_qtree_t *t, hb_qnode_t *n) {
+    n->total = 0;
+    n->sx = n->sy = 0;
+    n->x0 = n->y0 = INFINITY;
+    n->x1 = n->y1 = -INFINITY;
+    
+    double *red = red_(n);
+    for (NSUInteger r = 0; r < t->nred; r++) red[r] = identity_(t->reducers[r].kind);
+}
+
+/// Merges a point in the aggregates of a node.
+static inline void merge_point_(hb_qtree_t *t, hb_qnode_t *n, double x, double y, const double *v, NSUInteger stride) {
+    n->total++;
+    n->sx += x;
+    n->sy += y;
+    n->x0 = fmin(n->x0, x); n->x1 = fmax(n->x1, x);
+    n->y0 = fmin(n->y0, y); n->y1 = fmax(n->y1, y);
+    
+    double *red = red_(n);
+    for (NSUInteger r = 0; r < t->nred; r++) red[r] = reduce_(t->reducers[r].kind, red[r], v[r * stride]);
+}
+
+/// Merges the aggregates of a child in the aggregates of a node.
+static inline void merge_node_(hb_qtree_t *t, hb_qnode_t *n, hb_qnode_t *c) {
+    if (!c->total) return;
+    
+    n->total += c->total;
+    n->sx += c->sx;
+    n->sy += c->sy;
+    n->x0 = fmin(n->x0, c->x0); n->x1 = fmax(n->x1, c->x1);
+    n->y0 = fmin(n->y0, c->y0); n->y1 = fmax(n->y1, c->y1);
+    
+    double *red = red_(n), *cred = red_(c);
+    for (NSUInteger r = 0; r < t->nred; r++) red[r] = reduce_(t->reducers[r].kind, red[r], cred[r]);
+}
+
+/// Recomputes the aggregates of a node from its own points and its children aggregates.
+static void refresh_(hb_qtree_t *t, hb_qnode_t *n) {
+    empty_(t, n);
+    
+    for (hb_qbucket_t *b = n->points; b; b = b->next) {
+        for (NSUInteger i = 0; i < b->cnt; i++) merge_point_(t, n, b->x[i], b->y[i], b->v + i, t->lanes);
+    }
+    
+    if (n->nw) {
+        merge_node_(t, n, n->nw);
+        merge_node_(t, n, n->ne);
+        merge_node_(t, n, n->sw);
+        merge_node_(t, n, n->se);
+    }
 }
 
-static bool drop_(hb_qnode_t *n, id<MKAnnotation> a) {
+/// Whether removing the point changes the bounding box or a min/max reduction of the node.
+static inline bool on_edge_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint p, const double *v) {
+    if (p.x <= n->x0 || p.x >= n->x1 || p.y <= n->y0 || p.y >= n->y1) return true;
     
-    for (hb_qpoint_t *cur = n->points, *prev = NULL;
-         cur != NULL;
-         prev = cur, cur = cur->next) {
+    double *red = red_(n);
+    for (NSUInteger r = 0; r < t->nred; r++) {
+        if (extreme_(t->reducers[r].kind, v[r], red[r])) return true;
+    }
+    return false;
+}
+
+/// Adds a point to the aggregates of a node and its ancestors.
+static void grow_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint p, const double *v) {
+    for (; n; n = n->parent) merge_point_(t, n, p.x, p.y, v, 1);
+}
+
+/// Removes a point, no longer in the node, from the aggregates of the node and its ancestors.
+static void shrink_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint p, const double *v) {
+    for (; n; n = n->parent) {
+        if (on_edge_(t, n, p, v)) {
+            refresh_(t, n);
+            continue;
+        }
+        
+        n->total--;
+        n->sx -= p.x;
+        n->sy -= p.y;
         
-        if (cur->annotation == a) {
-            if (prev == NULL) {
-                n->points = cur->next;
-            } else {
-                prev->next = cur->next;
+        double *red = red_(n);
+        for (NSUInteger r = 0; r < t->nred; r++) {
+            if (t->reducers[r].kind == CKReducerSum) red[r] -= v[r];
+        }
+    }
+}
+
+/// Replaces a point, already updated in the node, in the aggregates of the node and its ancestors.
+static void move_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint from, const double *u, MKMapPoint to, const double *v) {
+    for (; n; n = n->parent) {
+        if (on_edge_(t, n, from, u)) {
+            refresh_(t, n);
+            continue;
+        }
+        
+        n->total--;
+        n->sx -= from.x;
+        n->sy -= from.y;
+        
+        double *red = red_(n);
+        for (NSUInteger r = 0; r < t->nred; r++) {
+            if (t->reducers[r].kind == CKReducerSum) red[r] -= u[r];
+        }
+        merge_point_(t, n, to.x, to.y, v, 1);
+    }
+}
+
+static hb_qnode_t *hb_qnode_new(hb_qtree_t *t, MKMapRect bound, NSUInteger capacity) {
+    hb_qnode_t *n = hb_qpool_alloc(&t->nodes);
+    memset(n, 0, sizeof(hb_qnode_t));
+    
+    n->bound = bound;
+    n->cap = capacity;
+    empty_(t, n);
+    return n;
+}
+
+/// Appends a point to the buckets of a node, without indexing it.
+static void append_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint point, id<MKAnnotation> a, const double *v) {
+    hb_qbucket_t *b = n->points;
+    
+    if (!b || b->cnt == t->lanes) {
+        b = hb_qbucket_new(t);
+        b->next = n->points;
+        n->points = b;
+    }
+    
+    b->x[b->cnt] = point.x;
+    b->y[b->cnt] = point.y;
+    b->annotations[b->cnt] = a;
+    for (NSUInteger r = 0; r < t->nred; r++) b->v[r * t->lanes + b->cnt] = v[r];
+    b->cnt++;
+    n->cnt++;
+}
+
+static void add_(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint point, id<MKAnnotation> a, const double *v) {
+    append_(t, n, point, a, v);
+    hb_qindex_put(&t->index, a, n);
+}
+
+/// Finds the bucket and lane of an annotation in a node.
+static hb_qbucket_t *find_(hb_qnode_t *n, id<MKAnnotation> a, NSUInteger *lane) {
+    for (hb_qbucket_t *b = n->points; b; b = b->next) {
+        for (NSUInteger i = 0; i < b->cnt; i++) {
+            if (b->annotations[i] == a) {
+                *lane = i;
+                return b;
             }
-            free(cur);
-            n->cnt--;
-            return true;
         }
     }
-    return false;
+    return NULL;
+}
+
+static void drop_(hb_qtree_t *t, hb_qref_t *ref) {
+    hb_qnode_t *n = ref->node;
+    NSUInteger i = 0;
+    hb_qbucket_t *b = find_(n, ref->annotation, &i);
+    
+    MKMapPoint point = MKMapPointMake(b->x[i], b->y[i]);
+    double v[t->nred + 1];
+    for (NSUInteger r = 0; r < t->nred; r++) v[r] = b->v[r * t->lanes + i];
+    
+    // Fill the lane with the last point of the first bucket.
+    hb_qbucket_t *h = n->points;
+    NSUInteger last = --h->cnt;
+    b->x[i] = h->x[last];
+    b->y[i] = h->y[last];
+    b->annotations[i] = h->annotations[last];
+    h->x[last] = NAN;
+    h->y[last] = NAN;
+    h->annotations[last] = nil;
+    for (NSUInteger r = 0; r < t->nred; r++) {
+        b->v[r * t->lanes + i] = h->v[r * t->lanes + last];
+        h->v[r * t->lanes + last] = NAN;
+    }
+    n->cnt--;
+    
+    if (!h->cnt) {
+        n->points = h->next;
+        hb_qpool_release(&t->buckets, h);
+    }
+    
+    hb_qindex_del(&t->index, ref);
+    shrink_(t, n, point, v);
 }
 
-static void subdivide_(hb_qnode_t *n) {
+static void subdivide_(hb_qtree_t *t, hb_qnode_t *n) {
     MKMapRect bd = n->bound;
     MKMapRect nw;
     MKMapRect ne;
@@ -112,162 +506,914 @@ static void subdivide_(hb_qnode_t *n) {
     MKMapRectDivide(nw, &nw, &sw, MKMapRectGetHeight(nw) / 2, CGRectMaxYEdge);
     MKMapRectDivide(ne, &ne, &se, MKMapRectGetHeight(ne) / 2, CGRectMaxYEdge);
     
-    n->nw = hb_qnode_new(nw, n->cap);
-    n->ne = hb_qnode_new(ne, n->cap);
-    n->sw = hb_qnode_new(sw, n->cap);
-    n->se = hb_qnode_new(se, n->cap);
+    n->nw = hb_qnode_new(t, nw, n->cap);
+    n->ne = hb_qnode_new(t, ne, n->cap);
+    n->sw = hb_qnode_new(t, sw, n->cap);
+    n->se = hb_qnode_new(t, se, n->cap);
+    n->nw->parent = n->ne->parent = n->sw->parent = n->se->parent = n;
 }
 
-static bool hb_qnode_insert(hb_qnode_t *n, id<MKAnnotation> a) {
-    MKMapPoint point = MKMapPointForCoordinate(a.coordinate);
-
+static bool hb_qnode_insert(hb_qtree_t *t, hb_qnode_t *n, MKMapPoint point, id<MKAnnotation> a, const double *v, unsigned depth) {
     if(!MKMapRectContainsPoint(n->bound, point)) return false;
     
-    if(n->cnt < n->cap) {
-        hb_qpoint_t *p = malloc(sizeof(hb_qpoint_t));
-        p->annotation = a;
-        p->point = point;
-        add_(n, p);
+    if(n->cnt < n->cap || depth == HB_QNODE_MAXDEPTH) {
+        add_(t, n, point, a, v);
+        grow_(t, n, point, v);
         return true;
     }
     
     if(!n->nw) {
-        subdivide_(n);
+        subdivide_(t, n);
     }
     
-    if(hb_qnode_insert(n->nw, a)) return true;
-    if(hb_qnode_insert(n->ne, a)) return true;
-    if(hb_qnode_insert(n->sw, a)) return true;
-    if(hb_qnode_insert(n->se, a)) return true;
+    if(hb_qnode_insert(t, n->nw, point, a, v, depth + 1)) return true;
+    if(hb_qnode_insert(t, n->ne, point, a, v, depth + 1)) return true;
+    if(hb_qnode_insert(t, n->sw, point, a, v, depth + 1)) return true;
+    if(hb_qnode_insert(t, n->se, point, a, v, depth + 1)) return true;
     
     return false;
 }
 
-static bool hb_qnode_remove(hb_qnode_t *n, id<MKAnnotation> a) {
-    if(drop_(n, a)) return true;
+/// Query output, hits are appended to a buffer and/or reported to a block
+typedef struct hb_qsink {
+    __unsafe_unretained id<MKAnnotation> *buffer;  ///< Output buffer, may be NULL
+    MKMapPoint *points;                            ///< Output points, may be NULL
+    NSUInteger size;                               ///< Capacity of the output buffer
+    NSUInteger cnt;                                ///< Number of hits, may exceed the buffer size
+    CKAnnotationBuffer *growable;                  ///< Buffer to grow when the output is full, may be NULL
+    __unsafe_unretained void(^find)(id<MKAnnotation>annotation); ///< Hit callback, may be nil
+} hb_qsink_t;
+
+static void reserve_(hb_qsink_t *s, NSUInteger cnt) {
+    if (!s->growable || s->cnt + cnt <= s->size) return;
+    
+    CKAnnotationBufferReserve(s->growable, s->cnt + cnt);
+    s->buffer = s->growable->annotations;
+    s->points = s->growable->points;
+    s->size = s->growable->capacity;
+}
+
+static inline void emit_(hb_qsink_t *s, hb_qbucket_t *b, NSUInteger i) {
+    if (s->find) s->find(b->annotations[i]);
+    
+    reserve_(s, 1);
+    if (s->cnt < s->size) {
+        s->buffer[s->cnt] = b->annotations[i];
+        if (s->points) s->points[s->cnt] = MKMapPointMake(b->x[i], b->y[i]);
+    }
+    s->cnt++;
+}
+
+static inline void emit_all_(hb_qsink_t *s, hb_qbucket_t *b) {
+    NSUInteger cnt = b->cnt;
+    
+    if (s->find) {
+        for (NSUInteger i = 0; i < cnt; i++) s->find(b->annotations[i]);
+    }
+    
+    reserve_(s, cnt);
+    if (s->cnt < s->size) {
+        cnt = MIN(cnt, s->size - s->cnt);
+        memcpy(s->buffer + s->cnt, b->annotations, cnt * sizeof(id));
+        
+        if (s->points) {
+            MKMapPoint *p = s->points + s->cnt;
+            for (NSUInteger i = 0; i < cnt; i++) p[i] = MKMapPointMake(b->x[i], b->y[i]);
+        }
+    }
+    s->cnt += b->cnt;
+}
+
+/// Reports every point of the node and its subtree, without any range test.
+static void hb_qnode_get_all(hb_qnode_t *n, hb_qsink_t *s) {
+    
+    if (!s->find && s->cnt >= s->size && !s->growable) {
+        // Counting only
+        s->cnt += n->total;
+        return;
+    } else {
+        for (hb_qbucket_t *b = n->points; b; b = b->next) emit_all_(s, b);
+    }
     
     if(n->nw) {
-        if(hb_qnode_remove(n->nw, a)) return true;
-        if(hb_qnode_remove(n->ne, a)) return true;
-        if(hb_qnode_remove(n->sw, a)) return true;
-        if(hb_qnode_remove(n->se, a)) return true;
+        hb_qnode_get_all(n->nw, s);
+        hb_qnode_get_all(n->ne, s);
+        hb_qnode_get_all(n->sw, s);
+        hb_qnode_get_all(n->se, s);
     }
+}
 
-    return false;
+/// Whether the range may contain points of the node, according to its tight bounding box.
+static inline bool overlaps_(hb_qnode_t *n, double minX, double minY, double maxX, double maxY) {
+    return n->total && n->x1 >= minX && n->x0 < maxX && n->y1 >= minY && n->y0 < maxY;
+}
+
+/// Whether the range contains every point of the node, according to its tight bounding box.
+static inline bool covers_(hb_qnode_t *n, double minX, double minY, double maxX, double maxY) {
+    return n->x0 >= minX && n->x1 < maxX && n->y0 >= minY && n->y1 < maxY;
 }
 
-static void hb_qnode_get_in_range(hb_qnode_t *n, MKMapRect range, void(^find)(id<MKAnnotation>annotation)) {
+static void hb_qnode_get_in_range(hb_qtree_t *t, hb_qnode_t *n, MKMapRect range, hb_qsink_t *s) {
+    double minX = MKMapRectGetMinX(range), maxX = MKMapRectGetMaxX(range);
+    double minY = MKMapRectGetMinY(range), maxY = MKMapRectGetMaxY(range);
+    
+    if(!overlaps_(n, minX, minY, maxX, maxY)) return;
+    
+    if(covers_(n, minX, minY, maxX, maxY)) {
+        hb_qnode_get_all(n, s);
+        return;
+    }
     
     if(n->cnt) {
-        if(!MKMapRectIntersectsRect(n->bound, range)) return;
+        for (hb_qbucket_t *b = n->points; b; b = b->next) {
+            for (NSUInteger i = 0; i < t->lanes; i += HB_QLANES) {
+                hb_qvec_t x = *(hb_qvec_t *)(b->x + i);
+                hb_qvec_t y = *(hb_qvec_t *)(b->y + i);
+                hb_qmask_t in = (x >= minX) & (x < maxX) & (y >= minY) & (y < maxY);
+                
+                // Unrolled by the compiler, whatever the lane count.
+                int64_t any = 0;
+                for (NSUInteger l = 0; l < HB_QLANES; l++) any |= in[l];
+                if (!any) continue;
+                
+                for (NSUInteger l = 0; l < HB_QLANES; l++) {
+                    if (in[l]) emit_(s, b, i + l);
+                }
+            }
+        }
+    }
+    
+    if(n->nw) {
+        hb_qnode_get_in_range(t, n->nw, range, s);
+        hb_qnode_get_in_range(t, n->ne, range, s);
+        hb_qnode_get_in_range(t, n->sw, range, s);
+        hb_qnode_get_in_range(t, n->se, range, s);
+    }
+}
+
+/// Aggregate query output
+typedef struct hb_qaggr {
+    NSUInteger cnt;         ///< Number of points
+    double sx, sy;          ///< Sums of the points coordinates
+    double x0, y0, x1, y1;  ///< Bounding box of the points
+    double *red;            ///< Reduced values, may be NULL
+} hb_qaggr_t;
+
+static void hb_qnode_aggregate(hb_qtree_t *t, hb_qnode_t *n, MKMapRect range, hb_qaggr_t *a) {
+    double minX = MKMapRectGetMinX(range), maxX = MKMapRectGetMaxX(range);
+    double minY = MKMapRectGetMinY(range), maxY = MKMapRectGetMaxY(range);
+    
+    if(!overlaps_(n, minX, minY, maxX, maxY)) return;
+    
+    // The whole subtree is in range, its aggregates are read at once.
+    if(covers_(n, minX, minY, maxX, maxY)) {
+        a->cnt += n->total;
+        a->sx += n->sx;
+        a->sy += n->sy;
+        a->x0 = fmin(a->x0, n->x0); a->x1 = fmax(a->x1, n->x1);
+        a->y0 = fmin(a->y0, n->y0); a->y1 = fmax(a->y1, n->y1);
         
-        hb_qpoint_t *p = n->points;
-        while (p) {
-            if(MKMapRectContainsPoint(range, p->point)) {
-                find(p->annotation);
+        double *red = red_(n);
+        for (NSUInteger r = 0; a->red && r < t->nred; r++) a->red[r] = reduce_(t->reducers[r].kind, a->red[r], red[r]);
+        return;
+    }
+    
+    for (hb_qbucket_t *b = n->points; b; b = b->next) {
+        for (NSUInteger i = 0; i < b->cnt; i++) {
+            double x = b->x[i], y = b->y[i];
+            if (x < minX || x >= maxX || y < minY || y >= maxY) continue;
+            
+            a->cnt++;
+            a->sx += x;
+            a->sy += y;
+            a->x0 = fmin(a->x0, x); a->x1 = fmax(a->x1, x);
+            a->y0 = fmin(a->y0, y); a->y1 = fmax(a->y1, y);
+            
+            for (NSUInteger r = 0; a->red && r < t->nred; r++) {
+                a->red[r] = reduce_(t->reducers[r].kind, a->red[r], b->v[r * t->lanes + i]);
             }
-            p = p->next;
         }
     }
     
     if(n->nw) {
-        hb_qnode_get_in_range(n->nw, range, find);
-        hb_qnode_get_in_range(n->ne, range, find);
-        hb_qnode_get_in_range(n->sw, range, find);
-        hb_qnode_get_in_range(n->se, range, find);
+        hb_qnode_aggregate(t, n->nw, range, a);
+        hb_qnode_aggregate(t, n->ne, range, a);
+        hb_qnode_aggregate(t, n->sw, range, a);
+        hb_qnode_aggregate(t, n->se, range, a);
+    }
+}
+
+/// Bulk loading entry
+typedef struct hb_qentry {
+    uint64_t key;           ///< Morton code of the point within the root bound
+    MKMapPoint point;       ///< Projected annotation coordinate
+    __unsafe_unretained id<MKAnnotation> annotation;
+} hb_qentry_t;
+
+/// Spreads the 32 bits of v over the even bits of a 64 bits integer.
+static inline uint64_t spread_(uint64_t v) {
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8))  & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2))  & 0x3333333333333333ULL;
+    v = (v | (v << 1))  & 0x5555555555555555ULL;
+    return v;
+}
+
+/// Quantizes a coordinate on 31 bits relatively to [min, min + len).
+static inline uint64_t quantize_(double v, double min, double len) {
+    double q = (v - min) / len * 0x80000000;
+    if (q <= 0) return 0;
+    if (q >= 0x7FFFFFFF) return 0x7FFFFFFF;
+    return (uint64_t)q;
+}
+
+/// Computes the Z-order key of a point, the y bit being the most significant one of each level
+/// so that keys are sorted in the NW, NE, SW, SE quadrant order.
+static inline uint64_t morton_(MKMapRect bound, MKMapPoint p) {
+    uint64_t x = quantize_(p.x, bound.origin.x, bound.size.width);
+    uint64_t y = quantize_(p.y, bound.origin.y, bound.size.height);
+    return spread_(x) | (spread_(y) << 1);
+}
+
+/// LSD radix sort of entries by key, using tmp as a buffer of the same size.
+/// Each pass counts then scatters the digits by chunks of entries, one per worker, in chunk order to keep the sort stable.
+static void sort_(hb_qentry_t *e, hb_qentry_t *tmp, NSUInteger cnt, NSUInteger workers, dispatch_queue_t queue) {
+    NSUInteger (*count)[256] = malloc(workers * sizeof(*count));
+    hb_qentry_t *sorted = e;
+    
+    for (unsigned shift = 0; shift < 64; shift += 8) {
+        dispatch_apply(workers, queue, ^(size_t w) {
+            memset(count[w], 0, sizeof(count[w]));
+            for (NSUInteger i = cnt * w / workers; i < cnt * (w + 1) / workers; i++) {
+                count[w][(sorted[i].key >> shift) & 0xFF]++;
+            }
+        });
+        
+        // Skip the pass when every key shares the same digit.
+        NSUInteger digit = (sorted[0].key >> shift) & 0xFF, same = 0;
+        for (NSUInteger w = 0; w < workers; w++) same += count[w][digit];
+        if (same == cnt) continue;
+        
+        for (NSUInteger d = 0, sum = 0; d < 256; d++) {
+            for (NSUInteger w = 0; w < workers; w++) {
+                NSUInteger c = count[w][d];
+                count[w][d] = sum;
+                sum += c;
+            }
+        }
+        
+        hb_qentry_t *from = sorted, *to = sorted == e ? tmp : e;
+        dispatch_apply(workers, queue, ^(size_t w) {
+            for (NSUInteger i = cnt * w / workers; i < cnt * (w + 1) / workers; i++) {
+                to[count[w][(from[i].key >> shift) & 0xFF]++] = from[i];
+            }
+        });
+        sorted = to;
+    }
+    
+    if (sorted != e) memcpy(e, sorted, cnt * sizeof(hb_qentry_t));
+    free(count);
+}
+
+/// Quadrant index of a point in the node, following the NW, NE, SW, SE order.
+static inline unsigned quadrant_(hb_qnode_t *n, MKMapPoint p) {
+    return (p.x >= n->ne->bound.origin.x) | ((p.y >= n->sw->bound.origin.y) << 1);
+}
+
+/// Splits sorted entries in four ranges, one per quadrant of the node.
+static void split_(hb_qnode_t *n, hb_qentry_t *e, hb_qentry_t *tmp, NSUInteger cnt, NSUInteger offsets[5]) {
+    NSUInteger count[4] = {0, 0, 0, 0};
+    bool sorted = true;
+    unsigned last = 0;
+    
+    for (NSUInteger i = 0; i < cnt; i++) {
+        unsigned q = quadrant_(n, e[i].point);
+        sorted &= (q >= last);
+        last = q;
+        count[q]++;
+    }
+    
+    offsets[0] = 0;
+    for (unsigned q = 0; q < 4; q++) {
+        offsets[q + 1] = offsets[q] + count[q];
+    }
+    
+    if (sorted) return;
+    
+    // Quantization rounding may misplace points lying on a quadrant edge, partition them again.
+    NSUInteger cursor[4] = {offsets[0], offsets[1], offsets[2], offsets[3]};
+    for (NSUInteger i = 0; i < cnt; i++) {
+        tmp[cursor[quadrant_(n, e[i].point)]++] = e[i];
+    }
+    memcpy(e, tmp, cnt * sizeof(hb_qentry_t));
+}
+
+static void hb_qnode_load(hb_qtree_t *t, hb_qnode_t *n, hb_qentry_t *e, hb_qentry_t *tmp, NSUInteger cnt, unsigned depth) {
+    if (!cnt) return;
+    
+    if (cnt <= n->cap || depth == HB_QNODE_MAXDEPTH) {
+        double v[t->nred + 1];
+        
+        for (NSUInteger i = 0; i < cnt; i++) {
+            if (!MKMapRectContainsPoint(n->bound, e[i].point)) continue;
+            
+            // Duplicated annotations share a point, so the first one claiming the index is loaded in this very leaf.
+            hb_qref_t *ref = hb_qindex_claim(&t->index, e[i].annotation);
+            if (!ref) continue;
+            
+            values_(t, e[i].annotation, v);
+            append_(t, n, e[i].point, e[i].annotation, v);
+            ref->node = n;
+            t->index.cnt++;
+        }
+        refresh_(t, n);
+        return;
+    }
+    
+    if(!n->nw) {
+        subdivide_(t, n);
+    }
+    
+    NSUInteger o[5];
+    split_(n, e, tmp, cnt, o);
+    
+    hb_qnode_load(t, n->nw, e + o[0], tmp + o[0], o[1] - o[0], depth + 1);
+    hb_qnode_load(t, n->ne, e + o[1], tmp + o[1], o[2] - o[1], depth + 1);
+    hb_qnode_load(t, n->sw, e + o[2], tmp + o[2], o[3] - o[2], depth + 1);
+    hb_qnode_load(t, n->se, e + o[3], tmp + o[3], o[4] - o[3], depth + 1);
+    
+    // Aggregates are computed bottom-up, once the children are loaded.
+    refresh_(t, n);
+}
+
+/// Subtree of a bulk load, loaded by any of the workers
+typedef struct hb_qtask {
+    hb_qnode_t *node;
+    hb_qentry_t *e;
+    hb_qentry_t *tmp;
+    NSUInteger cnt;
+    unsigned depth;
+} hb_qtask_t;
+
+/// Splits the top levels of the tree like hb_qnode_load, down to HB_QLOAD_DEPTH, and lists the subtrees left to load.
+static void hb_qnode_plan(hb_qtree_t *t, hb_qnode_t *n, hb_qentry_t *e, hb_qentry_t *tmp, NSUInteger cnt, unsigned depth, hb_qtask_t *tasks, NSUInteger *ntasks) {
+    if (!cnt) return;
+    
+    if (cnt <= n->cap || depth == HB_QLOAD_DEPTH) {
+        tasks[(*ntasks)++] = (hb_qtask_t){ .node = n, .e = e, .tmp = tmp, .cnt = cnt, .depth = depth };
+        return;
+    }
+    
+    if(!n->nw) {
+        subdivide_(t, n);
+    }
+    
+    NSUInteger o[5];
+    split_(n, e, tmp, cnt, o);
+    
+    hb_qnode_plan(t, n->nw, e + o[0], tmp + o[0], o[1] - o[0], depth + 1, tasks, ntasks);
+    hb_qnode_plan(t, n->ne, e + o[1], tmp + o[1], o[2] - o[1], depth + 1, tasks, ntasks);
+    hb_qnode_plan(t, n->sw, e + o[2], tmp + o[2], o[3] - o[2], depth + 1, tasks, ntasks);
+    hb_qnode_plan(t, n->se, e + o[3], tmp + o[3], o[4] - o[3], depth + 1, tasks, ntasks);
+}
+
+/// Computes the aggregates of the nodes split by hb_qnode_plan, once their subtrees are loaded.
+static void hb_qnode_stitch(hb_qtree_t *t, hb_qnode_t *n, unsigned depth) {
+    if (depth == HB_QLOAD_DEPTH || !n->nw) return;
+    
+    hb_qnode_stitch(t, n->nw, depth + 1);
+    hb_qnode_stitch(t, n->ne, depth + 1);
+    hb_qnode_stitch(t, n->sw, depth + 1);
+    hb_qnode_stitch(t, n->se, depth + 1);
+    refresh_(t, n);
+}
+
+/// Loads the subtrees below HB_QLOAD_DEPTH concurrently. Each worker allocates from its own pools, merged into the tree
+/// pools afterwards, and annotations are claimed in the shared index.
+static void load_(hb_qtree_t *t, hb_qentry_t *e, hb_qentry_t *tmp, NSUInteger cnt, NSUInteger workers, dispatch_queue_t queue) {
+    hb_qtask_t *tasks = malloc((1 << (2 * HB_QLOAD_DEPTH)) * sizeof(hb_qtask_t));
+    NSUInteger ntasks = 0;
+    hb_qnode_plan(t, t->root, e, tmp, cnt, 0, tasks, &ntasks);
+    
+    workers = MIN(workers, ntasks);
+    hb_qtree_t *trees = malloc(workers * sizeof(hb_qtree_t));
+    atomic_ulong next;
+    atomic_init(&next, 0);
+    atomic_ulong *cursor = &next;
+    
+    dispatch_apply(workers, queue, ^(size_t w) {
+        hb_qtree_t *s = &trees[w];
+        *s = *t;
+        hb_qpool_init(&s->nodes, t->nodes.size);
+        hb_qpool_init(&s->buckets, t->buckets.size);
+        s->index.cnt = 0;
+        
+        for (NSUInteger k = atomic_fetch_add(cursor, 1); k < ntasks; k = atomic_fetch_add(cursor, 1)) {
+            hb_qnode_load(s, tasks[k].node, tasks[k].e, tasks[k].tmp, tasks[k].cnt, tasks[k].depth);
+        }
+    });
+    
+    for (NSUInteger w = 0; w < workers; w++) {
+        hb_qpool_merge(&t->nodes, &trees[w].nodes);
+        hb_qpool_merge(&t->buckets, &trees[w].buckets);
+        t->index.cnt += trees[w].index.cnt;
     }
+    hb_qnode_stitch(t, t->root, 0);
+    
+    free(trees);
+    free(tasks);
 }
 
 /* publics */
 
+void CKAnnotationBufferReserve(CKAnnotationBuffer *buffer, NSUInteger capacity) {
+    if (capacity <= buffer->capacity) return;
+    
+    capacity = MAX(MAX(capacity, 2 * buffer->capacity), 64);
+    buffer->annotations = (__unsafe_unretained id<MKAnnotation> *)realloc(buffer->annotations, capacity * sizeof(id));
+    buffer->points = realloc(buffer->points, capacity * sizeof(MKMapPoint));
+    buffer->capacity = capacity;
+}
+
+void CKAnnotationBufferFree(CKAnnotationBuffer *buffer) {
+    free(buffer->annotations);
+    free(buffer->points);
+    buffer->annotations = NULL;
+    buffer->points = NULL;
+    buffer->count = 0;
+    buffer->capacity = 0;
+}
+
 hb_qtree_t *hb_qtree_new(MKMapRect rect, NSUInteger cap) {
     hb_qtree_t *t = malloc(sizeof(hb_qtree_t));
-    t->root = hb_qnode_new(rect, cap);
+    t->lanes = MAX((cap + HB_QLANES - 1) / HB_QLANES, 1) * HB_QLANES;
+    t->nred = 0;
+    t->reducers = NULL;
+    hb_qpool_init(&t->nodes, sizeof(hb_qnode_t));
+    hb_qpool_init(&t->buckets, sizeof(hb_qbucket_t) + t->lanes * (2 * sizeof(double) + sizeof(id)));
+    hb_qindex_init(&t->index, HB_QINDEX_MINCAP);
+    t->root = hb_qnode_new(t, rect, cap);
     return t;
 }
 
 void hb_qtree_free(hb_qtree_t *t) {
-    if(t->root) hb_qnode_free(t->root);
+    hb_qpool_drain(&t->nodes);
+    hb_qpool_drain(&t->buckets);
+    free(t->index.slots);
+    for (NSUInteger r = 0; r < t->nred; r++) Block_release((__bridge void *)t->reducers[r].value);
+    free(t->reducers);
     free(t);
 }
 
 void hb_qtree_insert(hb_qtree_t *t, id<MKAnnotation> annotation) {
-    hb_qnode_insert(t->root, annotation);
+    if (hb_qindex_get(&t->index, annotation)) return;
+    
+    double v[t->nred + 1];
+    values_(t, annotation, v);
+    hb_qnode_insert(t, t->root, MKMapPointForCoordinate(annotation.coordinate), annotation, v, 0);
 }
 
 void hb_qtree_remove(hb_qtree_t *t, id<MKAnnotation> annotation) {
-    hb_qnode_remove(t->root, annotation);
+    hb_qref_t *ref = hb_qindex_get(&t->index, annotation);
+    if (ref) drop_(t, ref);
+}
+
+void hb_qtree_update(hb_qtree_t *t, id<MKAnnotation> annotation, MKMapPoint point) {
+    hb_qref_t *ref = hb_qindex_get(&t->index, annotation);
+    
+    double v[t->nred + 1];
+    values_(t, annotation, v);
+    
+    // The point remains in its node, no need to relocate it.
+    if (ref && MKMapRectContainsPoint(ref->node->bound, point)) {
+        NSUInteger i = 0;
+        hb_qbucket_t *b = find_(ref->node, annotation, &i);
+        
+        MKMapPoint from = MKMapPointMake(b->x[i], b->y[i]);
+        double u[t->nred + 1];
+        for (NSUInteger r = 0; r < t->nred; r++) {
+            u[r] = b->v[r * t->lanes + i];
+            b->v[r * t->lanes + i] = v[r];
+        }
+        b->x[i] = point.x;
+        b->y[i] = point.y;
+        
+        move_(t, ref->node, from, u, point, v);
+        return;
+    }
+    
+    // Otherwise it is inserted again from the nearest ancestor containing it, rather than from the root.
+    hb_qnode_t *n = t->root;
+    if (ref) {
+        n = ref->node;
+        drop_(t, ref);
+        while (n->parent && !MKMapRectContainsPoint(n->bound, point)) n = n->parent;
+    }
+    
+    unsigned depth = 0;
+    for (hb_qnode_t *p = n->parent; p; p = p->parent) depth++;
+    hb_qnode_insert(t, n, point, annotation, v, depth);
+}
+
+BOOL hb_qtree_get_point(hb_qtree_t *t, id<MKAnnotation> annotation, MKMapPoint *point) {
+    hb_qref_t *ref = hb_qindex_get(&t->index, annotation);
+    if (!ref) return NO;
+    
+    NSUInteger i = 0;
+    hb_qbucket_t *b = find_(ref->node, annotation, &i);
+    *point = MKMapPointMake(b->x[i], b->y[i]);
+    return YES;
 }
 
 void hb_qtree_clear(hb_qtree_t *t) {
     MKMapRect bound = t->root->bound;
     NSUInteger cap  = t->root->cap;
-    hb_qnode_free(t->root);
-    t->root = hb_qnode_new(bound, cap);
+    hb_qpool_drain(&t->nodes);
+    hb_qpool_drain(&t->buckets);
+    free(t->index.slots);
+    hb_qindex_init(&t->index, HB_QINDEX_MINCAP);
+    t->root = hb_qnode_new(t, bound, cap);
 }
 
 void hb_qtree_find_in_range(hb_qtree_t *t, MKMapRect range , void(^find)(id<MKAnnotation>annotation)) {
-    hb_qnode_get_in_range(t->root, range, find);
+    hb_qsink_t s = { .find = find };
+    hb_qnode_get_in_range(t, t->root, range, &s);
+}
+
+NSUInteger hb_qtree_get_in_range(hb_qtree_t *t, MKMapRect range, __unsafe_unretained id<MKAnnotation> *buffer, NSUInteger size) {
+    hb_qsink_t s = { .buffer = buffer, .size = size };
+    hb_qnode_get_in_range(t, t->root, range, &s);
+    return s.cnt;
+}
+
+NSUInteger hb_qtree_fill_in_range(hb_qtree_t *t, MKMapRect range, CKAnnotationBuffer *buffer) {
+    hb_qsink_t s = {
+        .buffer = buffer->annotations,
+        .points = buffer->points,
+        .size = buffer->capacity,
+        .cnt = buffer->count,
+        .growable = buffer
+    };
+    hb_qnode_get_in_range(t, t->root, range, &s);
+    
+    NSUInteger cnt = s.cnt - buffer->count;
+    buffer->count = s.cnt;
+    return cnt;
+}
+
+void hb_qtree_aggregate_init(hb_qtree_t *t, CKAnnotationAggregate *aggregate, double *reduced) {
+    *aggregate = (CKAnnotationAggregate){ .count = 0, .sum = MKMapPointMake(0, 0), .bounds = MKMapRectNull };
+    for (NSUInteger r = 0; reduced && r < t->nred; r++) reduced[r] = identity_(t->reducers[r].kind);
+}
+
+NSUInteger hb_qtree_aggregate_in_range(hb_qtree_t *t, MKMapRect range, CKAnnotationAggregate *aggregate, double *reduced) {
+    MKMapRect bounds = aggregate->bounds;
+    hb_qaggr_t a = {
+        .cnt = aggregate->count,
+        .sx = aggregate->sum.x,
+        .sy = aggregate->sum.y,
+        .x0 = MKMapRectIsNull(bounds) ? INFINITY : MKMapRectGetMinX(bounds),
+        .y0 = MKMapRectIsNull(bounds) ? INFINITY : MKMapRectGetMinY(bounds),
+        .x1 = MKMapRectIsNull(bounds) ? -INFINITY : MKMapRectGetMaxX(bounds),
+        .y1 = MKMapRectIsNull(bounds) ? -INFINITY : MKMapRectGetMaxY(bounds),
+        .red = reduced
+    };
+    
+    hb_qnode_aggregate(t, t->root, range, &a);
+    
+    NSUInteger cnt = a.cnt - aggregate->count;
+    aggregate->count = a.cnt;
+    aggregate->sum = MKMapPointMake(a.sx, a.sy);
+    aggregate->bounds = a.cnt ? MKMapRectMake(a.x0, a.y0, a.x1 - a.x0, a.y1 - a.y0) : MKMapRectNull;
+    return cnt;
+}
+
+/// Loads annotations at the given points, or at their projected coordinate when points is NULL.
+static void bulk_load_(hb_qtree_t *t, __unsafe_unretained id<MKAnnotation> const *annotations, const MKMapPoint *points, NSUInteger count) {
+    hb_qtree_clear(t);
+    if (!count) return;
+    
+    // Size the index upfront to avoid rehashing while loading.
+    NSUInteger cap = HB_QINDEX_MINCAP;
+    while (cap < 2 * count) cap <<= 1;
+    free(t->index.slots);
+    hb_qindex_init(&t->index, cap);
+    
+    MKMapRect bound = t->root->bound;
+    hb_qentry_t *e = malloc(2 * count * sizeof(hb_qentry_t));
+    hb_qentry_t *tmp = e + count;
+    
+    // Large loads project, sort and load the points on every core, the result being the same tree.
+    NSUInteger workers = count < HB_QLOAD_PARALLEL ? 1 : [NSProcessInfo processInfo].activeProcessorCount;
+    dispatch_queue_t queue = dispatch_get_global_queue(qos_class_self(), 0);
+    
+    // Points outside of the root get the largest key, valid keys being 62 bits long, so that they are sorted last and left out.
+    dispatch_apply(workers, queue, ^(size_t w) {
+        for (NSUInteger i = count * w / workers; i < count * (w + 1) / workers; i++) {
+            MKMapPoint point = points ? points[i] : MKMapPointForCoordinate(annotations[i].coordinate);
+            e[i].key = MKMapRectContainsPoint(bound, point) ? morton_(bound, point) : UINT64_MAX;
+            e[i].point = point;
+            e[i].annotation = annotations[i];
+        }
+    });
+    
+    sort_(e, tmp, count, workers, queue);
+    
+    NSUInteger cnt = count;
+    while (cnt && e[cnt - 1].key == UINT64_MAX) cnt--;
+    
+    if (workers > 1 && cnt) {
+        load_(t, e, tmp, cnt, workers, queue);
+    } else if (cnt) {
+        hb_qnode_load(t, t->root, e, tmp, cnt, 0);
+    }
+    
+    free(e);
+}
+
+NSUInteger hb_qtree_add_reducer(hb_qtree_t *t, CKReducer kind, double(^value)(id<MKAnnotation> annotation)) {
+    
+    // Nodes and buckets grow to hold the new values, the tree is loaded again at the points it holds.
+    NSUInteger count = 0;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(MAX(t->index.cnt, 1) * sizeof(id));
+    MKMapPoint *points = malloc(MAX(t->index.cnt, 1) * sizeof(MKMapPoint));
+    for (NSUInteger i = 0; i < t->index.cap; i++) {
+        hb_qref_t *ref = &t->index.slots[i];
+        if (!ref->annotation) continue;
+        
+        NSUInteger k = 0;
+        hb_qbucket_t *b = find_(ref->node, ref->annotation, &k);
+        points[count] = MKMapPointMake(b->x[k], b->y[k]);
+        annotations[count++] = ref->annotation;
+    }
+    
+    t->reducers = realloc(t->reducers, (t->nred + 1) * sizeof(hb_qreducer_t));
+    t->reducers[t->nred] = (hb_qreducer_t){ .kind = kind, .value = (__bridge double(^)(id<MKAnnotation>))Block_copy((__bridge void *)value) };
+    t->nred++;
+    
+    MKMapRect bound = t->root->bound;
+    NSUInteger cap = t->root->cap;
+    
+    hb_qpool_drain(&t->nodes);
+    hb_qpool_drain(&t->buckets);
+    hb_qpool_init(&t->nodes, sizeof(hb_qnode_t) + t->nred * sizeof(double));
+    hb_qpool_init(&t->buckets, sizeof(hb_qbucket_t) + t->lanes * ((2 + t->nred) * sizeof(double) + sizeof(id)));
+    t->root = hb_qnode_new(t, bound, cap);
+    
+    bulk_load_(t, annotations, points, count);
+    free(annotations);
+    free(points);
+    
+    return t->nred - 1;
+}
+
+NSUInteger hb_qtree_count_in_range(hb_qtree_t *t, MKMapRect range) {
+    hb_qsink_t s = { 0 };
+    hb_qnode_get_in_range(t, t->root, range, &s);
+    return s.cnt;
+}
+
+void hb_qtree_bulk_load(hb_qtree_t *t, __unsafe_unretained id<MKAnnotation> const *annotations, NSUInteger count) {
+    bulk_load_(t, annotations, NULL, count);
 }
 
 @interface CKQuadTree ()
-@property (nonatomic, copy) NSArray *annotations;
 @property (nonatomic, assign) hb_qtree_t *tree;
 @end
 
 @implementation CKQuadTree {
+    NSMutableOrderedSet<id<MKAnnotation>> *_annotations;
+    CKAnnotationBuffer _scratch;
     BOOL _delegate_responds;
+    BOOL _batching;
 }
 
 static void * const CKQuadTreeKVOContext = (void *)&CKQuadTreeKVOContext;
 
 @synthesize delegate = _delegate;
+@synthesize version = _version;
 
 - (instancetype)init {
     return [self initWithAnnotations:[NSArray array]];
 }
 
 - (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    return [self initWithAnnotations:annotations observesCoordinates:YES];
+}
+
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations observesCoordinates:(BOOL)observesCoordinates {
     self = [super init];
     if (self) {
-        self.annotations = annotations;
+        _observesCoordinates = observesCoordinates;
+        _annotations = [NSMutableOrderedSet orderedSetWithArray:annotations];
         
         self.tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
         
+        NSUInteger count = _annotations.count;
+        __unsafe_unretained id<MKAnnotation> *objects = (__unsafe_unretained id<MKAnnotation> *)malloc(count * sizeof(id));
+        [_annotations getObjects:objects range:NSMakeRange(0, count)];
+        hb_qtree_bulk_load(self.tree, objects, count);
+        free(objects);
+        
+        for (NSObject<MKAnnotation> *annotation in _annotations) {
+            if (!_observesCoordinates) break;
+            [annotation addObserver:self
+                         forKeyPath:NSStringFromSelector(@selector(coordinate))
+                            options:NSKeyValueObservingOptionNew
+                            context:CKQuadTreeKVOContext];
+        }
+    }
+    return self;
+}
+
+- (NSUInteger)version {
+    @synchronized(self) {
+        return _version;
+    }
+}
+
+- (NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        return _annotations.array.copy;
+    }
+}
+
+- (void)insertAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
         for (NSObject<MKAnnotation> *annotation in annotations) {
+            if ([_annotations containsObject:annotation]) continue;
+            
+            [_annotations addObject:annotation];
             hb_qtree_insert(self.tree, annotation);
+            _version++;
             
+            if (!_observesCoordinates) continue;
             [annotation addObserver:self
                          forKeyPath:NSStringFromSelector(@selector(coordinate))
                             options:NSKeyValueObservingOptionNew
                             context:CKQuadTreeKVOContext];
         }
     }
-    return self;
+}
+
+- (void)removeAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        for (NSObject<MKAnnotation> *annotation in annotations) {
+            if (![_annotations containsObject:annotation]) continue;
+            
+            if (_observesCoordinates) {
+                [annotation removeObserver:self
+                                forKeyPath:NSStringFromSelector(@selector(coordinate))
+                                   context:CKQuadTreeKVOContext];
+            }
+            
+            hb_qtree_remove(self.tree, annotation);
+            [_annotations removeObject:annotation];
+            _version++;
+        }
+    }
+}
+
+- (void)updateCoordinates:(const CLLocationCoordinate2D *)coordinates forAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    NSUInteger count = annotations.count;
+    NSMutableArray<id<MKAnnotation>> *moved = [NSMutableArray arrayWithCapacity:count];
+    MKMapPoint *from = malloc(2 * MAX(count, 1) * sizeof(MKMapPoint));
+    MKMapPoint *to = from + count;
+    
+    @synchronized(self) {
+        _batching = YES;
+        
+        NSUInteger i = 0;
+        for (id<MKAnnotation> annotation in annotations) {
+            CLLocationCoordinate2D coordinate = coordinates[i++];
+            
+            NSUInteger k = moved.count;
+            if (!hb_qtree_get_point(self.tree, annotation, &from[k])) continue;
+            
+            if ([annotation respondsToSelector:@selector(setCoordinate:)]) {
+                [annotation setCoordinate:coordinate];
+            }
+            
+            // Read-only annotations must already return the new coordinate, the tree stores it as given.
+            to[k] = MKMapPointForCoordinate(coordinate);
+            hb_qtree_update(self.tree, annotation, to[k]);
+            [moved addObject:annotation];
+        }
+        
+        _batching = NO;
+        if (moved.count) _version++;
+    }
+    
+    if (!moved.count) {
+        free(from);
+        return;
+    }
+    
+    // The moves are reported at once, outside the lock.
+    id<CKAnnotationTreeDelegate> delegate = self.delegate;
+    if ([delegate respondsToSelector:@selector(annotationTree:didMoveAnnotations:from:to:)]) {
+        [delegate annotationTree:self didMoveAnnotations:moved from:from to:to];
+    } else if ([delegate respondsToSelector:@selector(annotationTree:didMoveAnnotation:from:to:)]) {
+        for (NSUInteger k = 0; k < moved.count; k++) {
+            [delegate annotationTree:self didMoveAnnotation:moved[k] from:from[k] to:to[k]];
+        }
+    }
+    
+    free(from);
 }
 
 - (NSArray<id<MKAnnotation>> *)annotationsInRect:(MKMapRect)rect {
     NSMutableArray *results = [NSMutableArray new];
     
-    // For map rects that span the 180th meridian, we get the portion outside the world.
-    if (MKMapRectSpans180thMeridian(rect)) {
+    @synchronized(self) {
         
-        hb_qtree_find_in_range(self.tree, MKMapRectRemainder(rect), ^(id<MKAnnotation> annotation) {
+        // For map rects that span the 180th meridian, we get the portion outside the world.
+        if (MKMapRectSpans180thMeridian(rect)) {
+            
+            hb_qtree_find_in_range(self.tree, MKMapRectRemainder(rect), ^(id<MKAnnotation> annotation) {
+                if (!self->_delegate_responds || [self.delegate annotationTree:self shouldExtractAnnotation:annotation]) {
+                    [results addObject:annotation];
+                }
+            });
+            
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        }
+        
+        hb_qtree_find_in_range(self.tree, rect, ^(id<MKAnnotation> annotation) {
             if (!self->_delegate_responds || [self.delegate annotationTree:self shouldExtractAnnotation:annotation]) {
                 [results addObject:annotation];
             }
         });
+    }
+    
+    return results;
+}
+
+- (NSUInteger)annotationsInRect:(MKMapRect)rect buffer:(CKAnnotationBuffer *)buffer {
+    buffer->count = 0;
+    
+    @synchronized(self) {
+        
+        // For map rects that span the 180th meridian, we get the portion outside the world.
+        if (MKMapRectSpans180thMeridian(rect)) {
+            hb_qtree_fill_in_range(self.tree, MKMapRectRemainder(rect), buffer);
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        }
         
-        rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        hb_qtree_fill_in_range(self.tree, rect, buffer);
+        
+        if (_delegate_responds) {
+            NSUInteger count = 0;
+            for (NSUInteger i = 0; i < buffer->count; i++) {
+                id<MKAnnotation> annotation = buffer->annotations[i];
+                if ([self.delegate annotationTree:self shouldExtractAnnotation:annotation]) {
+                    buffer->points[count] = buffer->points[i];
+                    buffer->annotations[count++] = annotation;
+                }
+            }
+            buffer->count = count;
+        }
+    }
+    
+    return buffer->count;
+}
+
+- (NSUInteger)registerReducer:(CKReducer)reducer value:(double (^)(id<MKAnnotation> annotation))value {
+    @synchronized(self) {
+        return hb_qtree_add_reducer(self.tree, reducer, value);
     }
+}
+
+- (CKAnnotationAggregate)aggregateAnnotationsInRect:(MKMapRect)rect reduced:(double *)reduced {
+    CKAnnotationAggregate aggregate;
     
-    hb_qtree_find_in_range(self.tree, rect, ^(id<MKAnnotation> annotation) {
-        if (!self->_delegate_responds || [self.delegate annotationTree:self shouldExtractAnnotation:annotation]) {
-            [results addObject:annotation];
+    @synchronized(self) {
+        hb_qtree_aggregate_init(self.tree, &aggregate, reduced);
+        
+        if (MKMapRectSpans180thMeridian(rect)) {
+            hb_qtree_aggregate_in_range(self.tree, MKMapRectRemainder(rect), &aggregate, reduced);
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
         }
-    });
+        hb_qtree_aggregate_in_range(self.tree, rect, &aggregate, reduced);
+    }
     
-    return results;
+    return aggregate;
+}
+
+- (NSUInteger)countAnnotationsInRect:(MKMapRect)rect {
+    @synchronized(self) {
+        if (_delegate_responds) {
+            return [self annotationsInRect:rect buffer:&_scratch];
+        }
+        
+        NSUInteger count = 0;
+        if (MKMapRectSpans180thMeridian(rect)) {
+            count += hb_qtree_count_in_range(self.tree, MKMapRectRemainder(rect));
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        }
+        return count + hb_qtree_count_in_range(self.tree, rect);
+    }
 }
 
 - (void)setDelegate:(id<CKAnnotationTreeDelegate>)delegate {
@@ -278,13 +1424,15 @@ static void * const CKQuadTreeKVOContext = (void *)&CKQuadTreeKVOContext;
 }
 
 - (void)dealloc {
-    for (NSObject<MKAnnotation> *annotation in self.annotations) {
+    for (NSObject<MKAnnotation> *annotation in _annotations) {
+        if (!_observesCoordinates) break;
         [annotation removeObserver:self
                         forKeyPath:NSStringFromSelector(@selector(coordinate))
                            context:CKQuadTreeKVOContext];
     }
     
     hb_qtree_free(self.tree);
+    CKAnnotationBufferFree(&_scratch);
 }
 
 - (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary<NSKeyValueChangeKey,id> *)change context:(void *)context {
@@ -292,8 +1440,22 @@ static void * const CKQuadTreeKVOContext = (void *)&CKQuadTreeKVOContext;
     if (context == CKQuadTreeKVOContext) {
         
         if ([keyPath isEqualToString:NSStringFromSelector(@selector(coordinate))]) {
-            hb_qtree_remove(self.tree, object);
-            hb_qtree_insert(self.tree, object);
+            MKMapPoint from = MKMapPointMake(NAN, NAN), to = from;
+            
+            @synchronized(self) {
+                
+                // Batch updates move the annotations they set the coordinate of themselves.
+                if (_batching) return;
+                hb_qtree_get_point(self.tree, object, &from);
+                hb_qtree_update(self.tree, object, MKMapPointForCoordinate([object coordinate]));
+                hb_qtree_get_point(self.tree, object, &to);
+                _version++;
+            }
+            
+            id<CKAnnotationTreeDelegate> delegate = self.delegate;
+            if ([delegate respondsToSelector:@selector(annotationTree:didMoveAnnotation:from:to:)]) {
+                [delegate annotationTree:self didMoveAnnotation:object from:from to:to];
+            }
         }
         
     } else {
@@ -0,0 +1,703 @@
+// CKQuadTreeSnapshot.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <ClusterKit/CKQuadTreeSnapshot.h>
+#import <ClusterKit/CKQuadTree.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// File signature, "CKQTSNAP" in file order
+#define HB_QSNAP_MAGIC 0x50414E5354514B43ULL
+
+/// Leaf capacity, larger than the one of CKQuadTree since leaves are scanned contiguously
+#define HB_QSNAP_CAP 16
+
+/// Maximum depth of the snapshot tree, deeper nodes keep their points beyond capacity (e.g. duplicated coordinates)
+#define HB_QSNAP_MAXDEPTH 40
+
+/// Snapshot header. Every field of the file is a 64 bits little-endian word.
+typedef struct hb_qshead {
+    uint64_t magic;         ///< HB_QSNAP_MAGIC
+    uint64_t version;       ///< CK_QSNAP_VERSION
+    uint64_t nodes;         ///< Number of nodes, the root first
+    uint64_t points;        ///< Number of points
+} hb_qshead_t;
+
+/// Snapshot node. Nodes are stored in depth-first order, so that the points of a subtree are contiguous.
+typedef struct hb_qsnode {
+    uint64_t first;         ///< Index of the first point of the subtree
+    uint64_t own;           ///< Number of points of the node itself, stored before the points of its children
+    uint64_t total;         ///< Number of points in the subtree
+    uint64_t child[4];      ///< NW, NE, SW, SE children indexes, 0 when the quadrant is empty
+    double sx, sy;          ///< Sums of the subtree points coordinates
+    double x0, y0, x1, y1;  ///< Tight bounding box of the subtree points
+} hb_qsnode_t;
+
+/// Snapshot sections, the nodes are followed by the points x coordinates, y coordinates and identifiers
+typedef struct hb_qsnap {
+    const hb_qsnode_t *nodes;
+    const double *x;
+    const double *y;
+    const uint64_t *ids;
+    uint64_t nnodes;
+    uint64_t npoints;
+} hb_qsnap_t;
+
+/// Converts words between the host and the little-endian order, in place.
+static void swap_(uint64_t *words, NSUInteger count) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    for (NSUInteger i = 0; i < count; i++) words[i] = CFSwapInt64(words[i]);
+#endif
+}
+
+static NSError *hb_qsnap_error(NSInteger code, NSString *path, int err) {
+    NSMutableDictionary *info = [NSMutableDictionary dictionaryWithObject:path forKey:NSFilePathErrorKey];
+    if (err) info[NSUnderlyingErrorKey] = [NSError errorWithDomain:NSPOSIXErrorDomain code:err userInfo:nil];
+    return [NSError errorWithDomain:NSCocoaErrorDomain code:code userInfo:info];
+}
+
+/* writing */
+
+/// Writing entry
+typedef struct hb_qsentry {
+    MKMapPoint point;       ///< Projected annotation coordinate
+    uint64_t identifier;    ///< Stable annotation identifier
+} hb_qsentry_t;
+
+/// Snapshot being written
+typedef struct hb_qswriter {
+    NSMutableData *nodes;   ///< Nodes written so far
+    double *x;              ///< Points x coordinates, in node order
+    double *y;              ///< Points y coordinates, in node order
+    uint64_t *ids;          ///< Points identifiers, in node order
+    NSUInteger cnt;         ///< Number of points written
+} hb_qswriter_t;
+
+/// Quadrant index of a point, following the NW, NE, SW, SE order of CKQuadTree.
+static inline unsigned quadrant_(MKMapRect bound, MKMapPoint p) {
+    return (p.x >= bound.origin.x + bound.size.width / 2) | ((p.y >= bound.origin.y + bound.size.height / 2) << 1);
+}
+
+static uint64_t hb_qsnap_write_node(hb_qswriter_t *w, MKMapRect bound, hb_qsentry_t *e, hb_qsentry_t *tmp, NSUInteger cnt, unsigned depth) {
+    hb_qsnode_t n = {
+        .first = w->cnt,
+        .total = cnt,
+        .x0 = INFINITY, .y0 = INFINITY,
+        .x1 = -INFINITY, .y1 = -INFINITY
+    };
+    
+    for (NSUInteger i = 0; i < cnt; i++) {
+        MKMapPoint p = e[i].point;
+        n.sx += p.x;
+        n.sy += p.y;
+        n.x0 = fmin(n.x0, p.x); n.x1 = fmax(n.x1, p.x);
+        n.y0 = fmin(n.y0, p.y); n.y1 = fmax(n.y1, p.y);
+    }
+    
+    // The node is reserved first, its children follow it.
+    uint64_t index = w->nodes.length / sizeof(hb_qsnode_t);
+    [w->nodes increaseLengthBy:sizeof(hb_qsnode_t)];
+    
+    if (cnt <= HB_QSNAP_CAP || depth == HB_QSNAP_MAXDEPTH) {
+        n.own = cnt;
+        for (NSUInteger i = 0; i < cnt; i++, w->cnt++) {
+            w->x[w->cnt] = e[i].point.x;
+            w->y[w->cnt] = e[i].point.y;
+            w->ids[w->cnt] = e[i].identifier;
+        }
+        
+    } else {
+        NSUInteger count[4] = {0, 0, 0, 0}, offsets[5] = {0};
+        for (NSUInteger i = 0; i < cnt; i++) count[quadrant_(bound, e[i].point)]++;
+        for (unsigned q = 0; q < 4; q++) offsets[q + 1] = offsets[q] + count[q];
+        
+        NSUInteger cursor[4] = {offsets[0], offsets[1], offsets[2], offsets[3]};
+        for (NSUInteger i = 0; i < cnt; i++) tmp[cursor[quadrant_(bound, e[i].point)]++] = e[i];
+        memcpy(e, tmp, cnt * sizeof(hb_qsentry_t));
+        
+        MKMapRect quadrants[4];
+        MKMapRectDivide(bound, &quadrants[0], &quadrants[1], MKMapRectGetWidth(bound) / 2, CGRectMaxXEdge);
+        MKMapRectDivide(quadrants[0], &quadrants[0], &quadrants[2], MKMapRectGetHeight(quadrants[0]) / 2, CGRectMaxYEdge);
+        MKMapRectDivide(quadrants[1], &quadrants[1], &quadrants[3], MKMapRectGetHeight(quadrants[1]) / 2, CGRectMaxYEdge);
+        
+        for (unsigned q = 0; q < 4; q++) {
+            if (!count[q]) continue;
+            n.child[q] = hb_qsnap_write_node(w, quadrants[q], e + offsets[q], tmp + offsets[q], count[q], depth + 1);
+        }
+    }
+    
+    ((hb_qsnode_t *)w->nodes.mutableBytes)[index] = n;
+    return index;
+}
+
+/// Builds a snapshot in host order from entries, which are reordered.
+static NSMutableData *hb_qsnap_build(hb_qsentry_t *e, NSUInteger count) {
+    hb_qsentry_t *tmp = malloc(MAX(count, 1) * sizeof(hb_qsentry_t));
+    NSMutableData *points = [NSMutableData dataWithLength:3 * count * sizeof(uint64_t)];
+    hb_qswriter_t w = {
+        .nodes = [NSMutableData data],
+        .x = points.mutableBytes,
+        .y = (double *)points.mutableBytes + count,
+        .ids = (uint64_t *)points.mutableBytes + 2 * count
+    };
+    hb_qsnap_write_node(&w, MKMapRectWorld, e, tmp, count, 0);
+    free(tmp);
+    
+    hb_qshead_t head = {
+        .magic = HB_QSNAP_MAGIC,
+        .version = CK_QSNAP_VERSION,
+        .nodes = w.nodes.length / sizeof(hb_qsnode_t),
+        .points = count
+    };
+    
+    NSMutableData *data = [NSMutableData dataWithBytes:&head length:sizeof(head)];
+    [data appendData:w.nodes];
+    [data appendData:points];
+    return data;
+}
+
+@implementation CKAnnotationProxy
+
+- (instancetype)initWithIdentifier:(uint64_t)identifier coordinate:(CLLocationCoordinate2D)coordinate {
+    self = [super init];
+    if (self) {
+        _identifier = identifier;
+        _coordinate = coordinate;
+    }
+    return self;
+}
+
+@end
+
+/* reading */
+
+/// Snapshot query context
+typedef struct hb_qsquery {
+    const hb_qsnap_t *snap;
+    __unsafe_unretained id<MKAnnotation> *resolved;     ///< Resolved annotations by point
+    NSUInteger *nresolved;                              ///< Number of resolved annotations
+    __unsafe_unretained CKAnnotationResolver resolver;
+    CKAnnotationBuffer *buffer;                         ///< Output buffer, NULL when counting
+    NSUInteger cnt;                                     ///< Number of hits
+    double minX, minY, maxX, maxY;                      ///< Range
+} hb_qsquery_t;
+
+/// Resolves the annotation of a point once, points whose annotation no longer exists are marked with kCFNull.
+static inline id<MKAnnotation> resolve_(hb_qsquery_t *q, uint64_t i) {
+    if (!q->resolved[i]) {
+        id<MKAnnotation> annotation = nil;
+        if (q->resolver) {
+            annotation = q->resolver(q->snap->ids[i]);
+        } else {
+            CLLocationCoordinate2D coordinate = MKCoordinateForMapPoint(MKMapPointMake(q->snap->x[i], q->snap->y[i]));
+            annotation = [[CKAnnotationProxy alloc] initWithIdentifier:q->snap->ids[i] coordinate:coordinate];
+        }
+        CFTypeRef ref = annotation ? (__bridge CFTypeRef)annotation : kCFNull;
+        q->resolved[i] = (__bridge id<MKAnnotation>)CFRetain(ref);
+        if (annotation) (*q->nresolved)++;
+    }
+    return q->resolved[i] == (__bridge id)kCFNull ? nil : q->resolved[i];
+}
+
+static inline void emit_(hb_qsquery_t *q, uint64_t i) {
+    if (!q->buffer) {
+        q->cnt++;
+        return;
+    }
+    
+    id<MKAnnotation> annotation = resolve_(q, i);
+    if (!annotation) return;
+    
+    CKAnnotationBuffer *b = q->buffer;
+    CKAnnotationBufferReserve(b, b->count + 1);
+    b->annotations[b->count] = annotation;
+    b->points[b->count] = MKMapPointMake(q->snap->x[i], q->snap->y[i]);
+    b->count++;
+    q->cnt++;
+}
+
+/// Checks the node layout once, so that queries can trust it: the ranges of the nodes are within the points, each child
+/// has a single parent, follows it and lies within its range, and the tree is at most HB_QSNAP_MAXDEPTH deep.
+static BOOL hb_qsnap_validate(const hb_qsnap_t *s) {
+    
+    // Depth of each node plus one, 0 while no parent was seen. Children follow their parent, so parents are checked first.
+    uint8_t *depths = calloc(s->nnodes, sizeof(uint8_t));
+    depths[0] = 1;
+    
+    BOOL valid = YES;
+    for (uint64_t i = 0; valid && i < s->nnodes; i++) {
+        const hb_qsnode_t *n = &s->nodes[i];
+        valid = depths[i] && n->first <= s->npoints && n->total <= s->npoints - n->first && n->own <= n->total;
+        
+        for (unsigned q = 0; valid && q < 4; q++) {
+            uint64_t c = n->child[q];
+            if (!c) continue;
+            
+            valid = c > i && c < s->nnodes && !depths[c] && depths[i] <= HB_QSNAP_MAXDEPTH;
+            if (!valid) break;
+            
+            const hb_qsnode_t *child = &s->nodes[c];
+            valid = child->first >= n->first && child->first - n->first <= n->total &&
+                    child->total <= n->total - (child->first - n->first);
+            depths[c] = depths[i] + 1;
+        }
+    }
+    
+    free(depths);
+    return valid;
+}
+
+static void hb_qsnap_get_in_range(hb_qsquery_t *q, uint64_t index) {
+    const hb_qsnap_t *s = q->snap;
+    const hb_qsnode_t *n = &s->nodes[index];
+    
+    if (!n->total || n->x1 < q->minX || n->x0 >= q->maxX || n->y1 < q->minY || n->y0 >= q->maxY) return;
+    
+    // The whole subtree is in range, its points are contiguous.
+    if (n->x0 >= q->minX && n->x1 < q->maxX && n->y0 >= q->minY && n->y1 < q->maxY) {
+        if (!q->buffer) {
+            q->cnt += n->total;
+            return;
+        }
+        CKAnnotationBufferReserve(q->buffer, q->buffer->count + n->total);
+        for (uint64_t i = n->first; i < n->first + n->total; i++) emit_(q, i);
+        return;
+    }
+    
+    for (uint64_t i = n->first; i < n->first + n->own; i++) {
+        double x = s->x[i], y = s->y[i];
+        if (x >= q->minX && x < q->maxX && y >= q->minY && y < q->maxY) emit_(q, i);
+    }
+    
+    // The layout was validated on load, the recursion is bounded by HB_QSNAP_MAXDEPTH.
+    for (unsigned c = 0; c < 4; c++) {
+        if (n->child[c]) hb_qsnap_get_in_range(q, n->child[c]);
+    }
+}
+
+static inline uint64_t hash_(uint64_t identifier) {
+    uint64_t h = identifier * 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 32);
+}
+
+/// Indexes the points by identifier in an open-addressing hash, each slot holding a point index plus one, 0 when free.
+/// Points sharing an identifier are found by the first of them, like a scan would.
+static uint64_t *hb_qsnap_index_ids(const hb_qsnap_t *s, uint64_t *mask) {
+    uint64_t cap = 64;
+    while (cap < 2 * s->npoints) cap <<= 1;
+    uint64_t *slots = calloc(cap, sizeof(uint64_t));
+    
+    for (uint64_t i = 0; i < s->npoints; i++) {
+        uint64_t k = hash_(s->ids[i]) & (cap - 1);
+        while (slots[k] && s->ids[slots[k] - 1] != s->ids[i]) k = (k + 1) & (cap - 1);
+        if (!slots[k]) slots[k] = i + 1;
+    }
+    
+    *mask = cap - 1;
+    return slots;
+}
+
+@implementation CKQuadTreeSnapshot {
+    hb_qsnap_t _snap;
+    void *_data;            ///< Snapshot storage
+    size_t _size;           ///< Size of the storage
+    BOOL _mapped;           ///< Whether the storage is mapped, or allocated
+    NSMutableData *_storage;///< Storage of a snapshot built in memory
+    
+    __unsafe_unretained id<MKAnnotation> *_resolved; ///< Retained annotations by point, nil until resolved
+    NSUInteger _resolvedCount;
+    CKAnnotationResolver _resolver;
+    
+    uint64_t *_ids;         ///< Points by identifier, built on the first lookup
+    uint64_t _idsMask;
+    
+    CKQuadTree *_tree;      ///< Tree the snapshot forwards to, once mutated
+    NSMutableDictionary<NSNumber *, id<MKAnnotation>> *_identified;     ///< Annotations of the tree by identifier
+    NSMapTable<id<MKAnnotation>, NSNumber *> *_identifiers;             ///< Identifiers of the annotations of the tree
+    CKAnnotationBuffer _scratch;
+    BOOL _delegate_responds;
+}
+
+@synthesize delegate = _delegate;
+
++ (BOOL)writeAnnotations:(NSArray<id<MKAnnotation>> *)annotations
+             identifiers:(uint64_t (^)(id<MKAnnotation> annotation))identifier
+                  toFile:(NSString *)path
+                   error:(NSError **)error {
+    
+    NSUInteger count = 0;
+    hb_qsentry_t *e = malloc(MAX(annotations.count, 1) * sizeof(hb_qsentry_t));
+    
+    for (id<MKAnnotation> annotation in annotations) {
+        MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+        if (!MKMapRectContainsPoint(MKMapRectWorld, point)) continue;
+        e[count++] = (hb_qsentry_t){ .point = point, .identifier = identifier(annotation) };
+    }
+    
+    NSMutableData *data = hb_qsnap_build(e, count);
+    free(e);
+    swap_(data.mutableBytes, data.length / sizeof(uint64_t));
+    
+    return [data writeToFile:path options:NSDataWritingAtomic error:error];
+}
+
+- (instancetype)initWithContentsOfFile:(NSString *)path resolver:(CKAnnotationResolver)resolver error:(NSError **)error {
+    self = [super init];
+    if (self) {
+        int fd = open(path.fileSystemRepresentation, O_RDONLY);
+        struct stat st;
+        
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (error) *error = hb_qsnap_error(errno == ENOENT ? NSFileReadNoSuchFileError : NSFileReadUnknownError, path, errno);
+            if (fd >= 0) close(fd);
+            return nil;
+        }
+        
+        _size = (size_t)st.st_size;
+        if (_size < sizeof(hb_qshead_t) || _size % sizeof(uint64_t)) {
+            if (error) *error = hb_qsnap_error(NSFileReadCorruptFileError, path, 0);
+            close(fd);
+            return nil;
+        }
+        
+        _data = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        
+        if (_data == MAP_FAILED) {
+            _data = NULL;
+            if (error) *error = hb_qsnap_error(NSFileReadUnknownError, path, errno);
+            return nil;
+        }
+        _mapped = YES;
+        
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        // The words are swapped once, in a copy of the file.
+        void *copy = malloc(_size);
+        memcpy(copy, _data, _size);
+        munmap(_data, _size);
+        _data = copy;
+        _mapped = NO;
+        swap_(_data, _size / sizeof(uint64_t));
+#endif
+        
+        if (![self load]) {
+            if (error) *error = hb_qsnap_error(NSFileReadCorruptFileError, path, 0);
+            return nil;
+        }
+        
+        _resolver = [resolver copy];
+    }
+    return self;
+}
+
+- (instancetype)initWithCoordinates:(const CLLocationCoordinate2D *)coordinates
+                        identifiers:(const uint64_t *)identifiers
+                              count:(NSUInteger)count
+                           resolver:(CKAnnotationResolver)resolver {
+    self = [super init];
+    if (self) {
+        NSUInteger cnt = 0;
+        hb_qsentry_t *e = malloc(MAX(count, 1) * sizeof(hb_qsentry_t));
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            MKMapPoint point = MKMapPointForCoordinate(coordinates[i]);
+            if (!MKMapRectContainsPoint(MKMapRectWorld, point)) continue;
+            e[cnt++] = (hb_qsentry_t){ .point = point, .identifier = identifiers ? identifiers[i] : i };
+        }
+        
+        // The snapshot is kept in host order, in memory.
+        _storage = hb_qsnap_build(e, cnt);
+        free(e);
+        _data = _storage.mutableBytes;
+        _size = _storage.length;
+        [self load];
+        
+        _resolver = [resolver copy];
+    }
+    return self;
+}
+
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    self = [super init];
+    if (self) {
+        _tree = [[CKQuadTree alloc] initWithAnnotations:annotations observesCoordinates:NO];
+        [self identifyProxies:annotations];
+    }
+    return self;
+}
+
+- (NSUInteger)count {
+    @synchronized(self) {
+        return _tree ? _tree.annotations.count : (NSUInteger)_snap.npoints;
+    }
+}
+
+- (NSUInteger)resolvedCount {
+    @synchronized(self) {
+        return _tree ? _tree.annotations.count : _resolvedCount;
+    }
+}
+
+- (NSUInteger)version {
+    @synchronized(self) {
+        return _tree.version;
+    }
+}
+
+- (NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        if (_tree) return _tree.annotations;
+        
+        hb_qsquery_t q = [self queryWithBuffer:NULL];
+        NSMutableArray *annotations = [NSMutableArray arrayWithCapacity:(NSUInteger)_snap.npoints];
+        for (uint64_t i = 0; i < _snap.npoints; i++) {
+            id<MKAnnotation> annotation = resolve_(&q, i);
+            if (annotation) [annotations addObject:annotation];
+        }
+        return annotations;
+    }
+}
+
+- (id<MKAnnotation>)annotationWithIdentifier:(uint64_t)identifier {
+    @synchronized(self) {
+        if (_tree) return _identified[@(identifier)];
+        
+        if (!_ids) _ids = hb_qsnap_index_ids(&_snap, &_idsMask);
+        for (uint64_t k = hash_(identifier) & _idsMask; _ids[k]; k = (k + 1) & _idsMask) {
+            if (_snap.ids[_ids[k] - 1] != identifier) continue;
+            
+            hb_qsquery_t q = [self queryWithBuffer:NULL];
+            return resolve_(&q, _ids[k] - 1);
+        }
+        return nil;
+    }
+}
+
+- (void)insertAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        [[self thaw] insertAnnotations:annotations];
+        [self identifyProxies:annotations];
+    }
+}
+
+- (void)removeAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        [[self thaw] removeAnnotations:annotations];
+        
+        for (id<MKAnnotation> annotation in annotations) {
+            NSNumber *identifier = [_identifiers objectForKey:annotation];
+            if (!identifier) continue;
+            
+            [_identifiers removeObjectForKey:annotation];
+            if (_identified[identifier] == annotation) [_identified removeObjectForKey:identifier];
+        }
+    }
+}
+
+- (void)updateCoordinates:(const CLLocationCoordinate2D *)coordinates forAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    @synchronized(self) {
+        
+        // Moves are not worth thawing the whole snapshot for, they only apply once it was thawed.
+        [_tree updateCoordinates:coordinates forAnnotations:annotations];
+    }
+}
+
+- (NSArray<id<MKAnnotation>> *)annotationsInRect:(MKMapRect)rect {
+    CKAnnotationBuffer buffer = {0};
+    [self annotationsInRect:rect buffer:&buffer];
+    NSArray *annotations = [NSArray arrayWithObjects:buffer.annotations count:buffer.count];
+    CKAnnotationBufferFree(&buffer);
+    return annotations;
+}
+
+- (NSUInteger)annotationsInRect:(MKMapRect)rect buffer:(CKAnnotationBuffer *)buffer {
+    buffer->count = 0;
+    
+    @synchronized(self) {
+        if (_tree) return [_tree annotationsInRect:rect buffer:buffer];
+        
+        hb_qsquery_t q = [self queryWithBuffer:buffer];
+        
+        // For map rects that span the 180th meridian, we get the portion outside the world.
+        if (MKMapRectSpans180thMeridian(rect)) {
+            [self query:&q inRange:MKMapRectRemainder(rect)];
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        }
+        [self query:&q inRange:rect];
+        
+        if (_delegate_responds) {
+            NSUInteger count = 0;
+            for (NSUInteger i = 0; i < buffer->count; i++) {
+                id<MKAnnotation> annotation = buffer->annotations[i];
+                if ([self.delegate annotationTree:self shouldExtractAnnotation:annotation]) {
+                    buffer->points[count] = buffer->points[i];
+                    buffer->annotations[count++] = annotation;
+                }
+            }
+            buffer->count = count;
+        }
+    }
+    
+    return buffer->count;
+}
+
+- (NSUInteger)countAnnotationsInRect:(MKMapRect)rect {
+    @synchronized(self) {
+        if (_tree) return [_tree countAnnotationsInRect:rect];
+        if (_delegate_responds) return [self annotationsInRect:rect buffer:&_scratch];
+        
+        hb_qsquery_t q = [self queryWithBuffer:NULL];
+        if (MKMapRectSpans180thMeridian(rect)) {
+            [self query:&q inRange:MKMapRectRemainder(rect)];
+            rect = MKMapRectIntersection(rect, MKMapRectWorld);
+        }
+        [self query:&q inRange:rect];
+        return q.cnt;
+    }
+}
+
+- (void)setDelegate:(id<CKAnnotationTreeDelegate>)delegate {
+    @synchronized(self) {
+        _delegate = delegate;
+        _tree.delegate = delegate;
+        
+        //Cache whether the delegate responds to a selector
+        _delegate_responds = [delegate respondsToSelector:@selector(annotationTree:shouldExtractAnnotation:)];
+    }
+}
+
+- (void)dealloc {
+    [self unmap];
+    CKAnnotationBufferFree(&_scratch);
+}
+
+#pragma mark Private
+
+/// Validates the storage and locates the snapshot sections.
+- (BOOL)load {
+    const hb_qshead_t *head = _data;
+    uint64_t words = (_size - sizeof(hb_qshead_t)) / sizeof(uint64_t);
+    uint64_t nodeWords = sizeof(hb_qsnode_t) / sizeof(uint64_t);
+    
+    if (head->magic != HB_QSNAP_MAGIC || head->version != CK_QSNAP_VERSION || !head->nodes ||
+        head->nodes > words / nodeWords || head->points > words / 3 ||
+        head->nodes * nodeWords + head->points * 3 != words) {
+        return NO;
+    }
+    
+    _snap.nnodes = head->nodes;
+    _snap.npoints = head->points;
+    _snap.nodes = (const hb_qsnode_t *)(head + 1);
+    _snap.x = (const double *)(_snap.nodes + _snap.nnodes);
+    _snap.y = _snap.x + _snap.npoints;
+    _snap.ids = (const uint64_t *)(_snap.y + _snap.npoints);
+    if (!hb_qsnap_validate(&_snap)) return NO;
+    
+    // Zeroed pages are only committed once annotations get resolved.
+    _resolved = (__unsafe_unretained id<MKAnnotation> *)calloc(MAX(_snap.npoints, 1), sizeof(id));
+    return YES;
+}
+
+- (hb_qsquery_t)queryWithBuffer:(CKAnnotationBuffer *)buffer {
+    return (hb_qsquery_t){
+        .snap = &_snap,
+        .resolved = _resolved,
+        .nresolved = &_resolvedCount,
+        .resolver = _resolver,
+        .buffer = buffer
+    };
+}
+
+- (void)query:(hb_qsquery_t *)query inRange:(MKMapRect)range {
+    query->minX = MKMapRectGetMinX(range);
+    query->minY = MKMapRectGetMinY(range);
+    query->maxX = MKMapRectGetMaxX(range);
+    query->maxY = MKMapRectGetMaxY(range);
+    hb_qsnap_get_in_range(query, 0);
+}
+
+/// Loads every annotation in a mutable tree, which takes over the snapshot. The annotations keep their identifier.
+- (CKQuadTree *)thaw {
+    if (!_tree) {
+        NSMutableArray<id<MKAnnotation>> *annotations = [NSMutableArray arrayWithCapacity:(NSUInteger)_snap.npoints];
+        hb_qsquery_t q = [self queryWithBuffer:NULL];
+        for (uint64_t i = 0; i < _snap.npoints; i++) {
+            id<MKAnnotation> annotation = resolve_(&q, i);
+            if (!annotation) continue;
+            
+            [annotations addObject:annotation];
+            [self identify:annotation as:_snap.ids[i]];
+        }
+        
+        _tree = [[CKQuadTree alloc] initWithAnnotations:annotations observesCoordinates:NO];
+        _tree.delegate = _delegate;
+        [self unmap];
+    }
+    return _tree;
+}
+
+/// Records the identifier of an annotation of the tree, the first annotation of an identifier is kept.
+- (void)identify:(id<MKAnnotation>)annotation as:(uint64_t)identifier {
+    if (!_identified) {
+        _identified = [NSMutableDictionary dictionary];
+        _identifiers = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                             valueOptions:NSPointerFunctionsStrongMemory];
+    }
+    
+    NSNumber *key = @(identifier);
+    if (_identified[key] || [_identifiers objectForKey:annotation]) return;
+    _identified[key] = annotation;
+    [_identifiers setObject:key forKey:annotation];
+}
+
+/// Annotations inserted in the tree are only known by identifier when they are proxies.
+- (void)identifyProxies:(NSArray<id<MKAnnotation>> *)annotations {
+    for (id<MKAnnotation> annotation in annotations) {
+        if ([annotation isKindOfClass:[CKAnnotationProxy class]]) [self identify:annotation as:[(CKAnnotationProxy *)annotation identifier]];
+    }
+}
+
+- (void)unmap {
+    for (uint64_t i = 0; _resolved && i < _snap.npoints; i++) {
+        if (_resolved[i]) CFRelease((__bridge CFTypeRef)_resolved[i]);
+    }
+    free(_resolved);
+    _resolved = NULL;
+    _resolvedCount = 0;
+    
+    free(_ids);
+    _ids = NULL;
+    
+    if (_mapped) {
+        munmap(_data, _size);
+    } else if (!_storage) {
+        free(_data);
+    }
+    _data = NULL;
+    _storage = nil;
+    _snap = (hb_qsnap_t){ 0 };
+}
+
+@end
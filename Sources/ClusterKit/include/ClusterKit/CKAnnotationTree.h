@@ -26,6 +26,36 @@
 
 NS_ASSUME_NONNULL_BEGIN
 
+/**
+ A reusable annotation buffer filled by annotation trees.
+ The buffer keeps its storage between queries, so that a warmed-up buffer is filled without any allocation.
+ Annotations are not retained by the buffer.
+ 
+ Trees fill the projected coordinate of each annotation along with it, so that consumers never need to call
+ MKMapPointForCoordinate on the annotations they get.
+ */
+typedef struct CKAnnotationBuffer {
+    __unsafe_unretained id<MKAnnotation> _Nonnull * _Nullable annotations; ///< The annotations storage.
+    MKMapPoint * _Nullable points;  ///< The projected coordinates of the annotations.
+    NSUInteger count;       ///< The number of annotations in the buffer.
+    NSUInteger capacity;    ///< The number of annotations the storage can hold.
+} CKAnnotationBuffer;
+
+/**
+ Ensures the buffer can hold at least the given number of annotations.
+ 
+ @param buffer   The buffer to grow.
+ @param capacity The minimum capacity.
+ */
+FOUNDATION_EXPORT void CKAnnotationBufferReserve(CKAnnotationBuffer *buffer, NSUInteger capacity);
+
+/**
+ Releases the buffer storage.
+ 
+ @param buffer The buffer to free.
+ */
+FOUNDATION_EXPORT void CKAnnotationBufferFree(CKAnnotationBuffer *buffer);
+
 @protocol CKAnnotationTree;
 
 /**
@@ -46,6 +76,38 @@ NS_ASSUME_NONNULL_BEGIN
  */
 - (BOOL)annotationTree:(id<CKAnnotationTree>)annotationTree shouldExtractAnnotation:(id<MKAnnotation>)annotation;
 
+/**
+ Asks the delegate if -annotationTree:shouldExtractAnnotation: may currently reject any annotation.
+ Algorithms extracting precomputed groups of annotations skip the per annotation calls when it returns NO.
+ 
+ @param annotationTree The annotation tree object requesting this information.
+ 
+ @return NO when every annotation would be extracted.
+ */
+- (BOOL)annotationTreeFiltersAnnotations:(id<CKAnnotationTree>)annotationTree;
+
+/**
+ Tells the delegate that an annotation moved within the tree, after its coordinate changed.
+ This method is called on the thread the coordinate changed on.
+ 
+ @param annotationTree The annotation tree object reporting the move.
+ @param annotation     The annotation that moved.
+ @param from           The previous projected coordinate of the annotation.
+ @param to             The new projected coordinate of the annotation.
+ */
+- (void)annotationTree:(id<CKAnnotationTree>)annotationTree didMoveAnnotation:(id<MKAnnotation>)annotation from:(MKMapPoint)from to:(MKMapPoint)to;
+
+/**
+ Tells the delegate that annotations moved within the tree in a batch update.
+ When not implemented, the delegate is told about each move with -annotationTree:didMoveAnnotation:from:to:.
+ 
+ @param annotationTree The annotation tree object reporting the moves.
+ @param annotations    The annotations that moved.
+ @param from           The previous projected coordinates of the annotations.
+ @param to             The new projected coordinates of the annotations.
+ */
+- (void)annotationTree:(id<CKAnnotationTree>)annotationTree didMoveAnnotations:(NSArray<id<MKAnnotation>> *)annotations from:(const MKMapPoint *)from to:(const MKMapPoint *)to;
+
 @end
 
 /**
@@ -78,6 +140,60 @@ NS_ASSUME_NONNULL_BEGIN
  */
 - (NSArray<id<MKAnnotation>> *)annotationsInRect:(MKMapRect)rect;
 
+@optional
+
+/**
+ Inserts annotations into the tree. Annotations already present in the tree are ignored.
+ Trees not implementing this method are rebuilt with -initWithAnnotations: instead.
+ 
+ @param annotations The annotations to insert.
+ */
+- (void)insertAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
+/**
+ Removes annotations from the tree. Annotations not present in the tree are ignored.
+ Trees not implementing this method are rebuilt with -initWithAnnotations: instead.
+ 
+ @param annotations The annotations to remove.
+ */
+- (void)removeAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
+/**
+ A counter incremented each time the tree content changes.
+ Algorithms caching data derived from the tree compare versions to know when to rebuild it.
+ */
+@property (nonatomic, readonly) NSUInteger version;
+
+/**
+ Extracts annotations from a rect into a reusable buffer.
+ The buffer is emptied before being filled.
+ 
+ @param rect   The map rect.
+ @param buffer The buffer to fill.
+ 
+ @return The number of annotations extracted.
+ */
+- (NSUInteger)annotationsInRect:(MKMapRect)rect buffer:(CKAnnotationBuffer *)buffer;
+
+/**
+ Counts annotations in a rect.
+ 
+ @param rect The map rect.
+ 
+ @return The number of annotations the rect contains.
+ */
+- (NSUInteger)countAnnotationsInRect:(MKMapRect)rect;
+
+/**
+ Moves annotations in a single batch, without relying on key-value observing.
+ Annotations responding to -setCoordinate: are given their new coordinate, the others must already return it.
+ Annotations not present in the tree are ignored.
+ 
+ @param coordinates The new coordinates, one per annotation.
+ @param annotations The annotations to move.
+ */
+- (void)updateCoordinates:(const CLLocationCoordinate2D *)coordinates forAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -22,6 +22,7 @@
 
 #import <Foundation/Foundation.h>
 #import <MapKit/MKAnnotation.h>
+#import <ClusterKit/CKAnnotationTree.h>
 
 NS_ASSUME_NONNULL_BEGIN
 
@@ -34,10 +35,29 @@ NS_ASSUME_NONNULL_BEGIN
  */
 MK_EXTERN double CKDistance(CLLocationCoordinate2D from, CLLocationCoordinate2D to);
 
+/**
+ Compute the square euclidean distance between two map points.
+ Prefer this variant in hot paths where the projected coordinates are already known.
+ 
+ @param from Distance from map point.
+ @param to Distance to map point.
+ @return Euclidean distance in MapKit projection.
+ */
+MK_EXTERN double CKMapPointDistance(MKMapPoint from, MKMapPoint to);
+
 MK_EXTERN MKMapRect MKMapRectByAddingPoint(MKMapRect rect, MKMapPoint point);
 
 MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
 
+typedef struct hb_cmembers hb_cmembers_t;
+
+/// :nodoc:
+FOUNDATION_EXPORT hb_cmembers_t *hb_cmembers_new(__unsafe_unretained id<MKAnnotation> _Nonnull const * _Nullable annotations, const MKMapPoint * _Nullable points, NSUInteger count);
+/// :nodoc:
+FOUNDATION_EXPORT hb_cmembers_t *hb_cmembers_take(CKAnnotationBuffer *buffer, NSUInteger count, id _Nullable owner);
+/// :nodoc:
+FOUNDATION_EXPORT void hb_cmembers_release(hb_cmembers_t * _Nullable members);
+
 @class CKCluster;
 
 #pragma mark - Cluster definitions
@@ -55,6 +75,17 @@ MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
  */
 + (__kindof CKCluster *)clusterWithCoordinate:(CLLocationCoordinate2D)coordinate;
 
+/**
+ Instantiates a cluster holding the given annotations.
+ Unlike adding the annotations one by one, the cluster coordinate, bounds and identity are computed in a single pass.
+ The annotations must be distinct.
+ 
+ @param annotations The cluster annotations.
+ @param count The number of annotations.
+ @return The newly-initialized cluster.
+ */
++ (__kindof CKCluster *)clusterWithAnnotations:(__unsafe_unretained id<MKAnnotation> _Nonnull const * _Nullable)annotations count:(NSUInteger)count;
+
 @end
 
 /**
@@ -69,6 +100,7 @@ MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
 
 /**
  Cluster annotation array.
+ The array is created on each access, prefer enumerating the cluster or annotationAtIndex: in hot paths.
  */
 @property (nonatomic, readonly, copy) NSArray<id<MKAnnotation>> *annotations;
 
@@ -94,6 +126,18 @@ MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
  */
 @property (nonatomic, readonly) MKMapRect bounds;
 
+/**
+ A stable identifier of the cluster, derived from its lowest member annotation address, 0 when empty.
+ A cluster whose membership slightly changes usually keeps its identifier, which lets the cluster manager update it in place.
+ */
+@property (nonatomic, readonly) uint64_t identifier;
+
+/**
+ An order-independent fingerprint of the cluster membership, maintained as annotations are added and removed.
+ Clusters with the same annotations have the same fingerprint.
+ */
+@property (nonatomic, readonly) uint64_t fingerprint;
+
 /**
  Adds a given annotation to the cluster, if it is not already a member.
  
@@ -108,6 +152,44 @@ MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
  */
 - (void)removeAnnotation:(id<MKAnnotation>)annotation;
 
+/**
+ Replaces the annotations and coordinate of the receiver by the ones of the given cluster.
+ Used to update a displayed cluster in place rather than replacing it.
+ 
+ @param cluster The cluster to copy the membership from.
+ */
+- (void)updateWithCluster:(CKCluster *)cluster;
+
+/**
+ Replaces the annotations of the receiver, computing its coordinate, bounds and identity in a single pass.
+ The annotations must be distinct.
+ 
+ @param annotations The cluster annotations.
+ */
+- (void)setAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
+/**
+ Sets the annotations of the receiver to a range of a members storage, without copying them.
+ The storage is shared with the other clusters built from it until the receiver is mutated.
+ Identifier, fingerprint and bounds are computed in a single pass, the first time one of them is needed.
+ Every bulk construction goes through this method, subclasses override it to set their coordinate.
+ 
+ @param members The members storage, created by hb_cmembers_new or hb_cmembers_take.
+ @param range   The range of the receiver annotations in the storage.
+ */
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range;
+
+/**
+ Sets the annotations of the receiver to a range of a members storage, along with a coordinate computed beforehand,
+ like the centroid of a precomputed hierarchy node. The range is not read until the cluster is used.
+ The range may overlap the ranges of other clusters, it is never reordered in place.
+ 
+ @param members    The members storage, created by hb_cmembers_new or hb_cmembers_take.
+ @param range      The range of the receiver annotations in the storage.
+ @param coordinate The cluster coordinate.
+ */
+- (void)setMembers:(hb_cmembers_t *)members range:(NSRange)range coordinate:(CLLocationCoordinate2D)coordinate;
+
 /**
  Returns the annotation at the given index.
  If index is beyond the end of the array (that is, if index is greater than or equal to the value returned by count), an NSRangeException is raised.
@@ -178,6 +260,7 @@ MK_EXTERN NSComparisonResult MKMapSizeCompare(MKMapSize size1, MKMapSize size2);
 
 /**
  Cluster with coordinate at the nearest annotation from centroid.
+ The nearest annotation is the first one, it is only searched again when the cluster is read after a change.
  */
 @interface CKNearestCentroidCluster : CKCentroidCluster
 
@@ -42,6 +42,17 @@ NS_ASSUME_NONNULL_BEGIN
  */
 - (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree;
 
+/**
+ Returns the size of the square tiles by which the clusters can be computed and cached at a certain zoom.
+ A positive size is a promise that the clusters of a tile only depend on the annotations within the tile, so that
+ the clusters of a rect are the union of the clusters of the tiles it covers.
+ 
+ @param zoom The zoom value at which the clusters will be computed.
+ 
+ @return The tile size in map points, 0 by default when the clusters cannot be computed by tiles.
+ */
+- (double)tileSizeAtZoom:(double)zoom;
+
 @end
 
 /**
@@ -65,6 +76,15 @@ NS_ASSUME_NONNULL_BEGIN
  */
 - (__kindof CKCluster *)clusterWithCoordinate:(CLLocationCoordinate2D)coordinate;
 
+/**
+ Instantiates a cluster holding the given annotations using the registered class.
+ 
+ @param annotations The cluster annotations, which must be distinct.
+ @param count The number of annotations.
+ @return The newly-initialized cluster.
+ */
+- (__kindof CKCluster *)clusterWithAnnotations:(__unsafe_unretained id<MKAnnotation> _Nonnull const * _Nullable)annotations count:(NSUInteger)count;
+
 @end
 
 NS_ASSUME_NONNULL_END
@@ -46,6 +46,7 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
 
 /**
  Asks the delegate if the cluster manager should clusterized the given annotation.
+ When the cluster manager is asynchronous, this method is called on a background queue.
  
  @param clusterManager The cluster manager object requesting this information.
  @param annotation     The annotation to clusterized.
@@ -54,6 +55,18 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
  */
 - (BOOL)clusterManager:(CKClusterManager *)clusterManager shouldClusterAnnotation:(id<MKAnnotation>)annotation;
 
+/**
+ Asks the delegate for the annotation of a point given with -setCoordinates:identifiers:count:, the first time it is clustered.
+ When not implemented, points are represented by CKAnnotationProxy objects. Points for which nil is returned are not clustered.
+ This method is called under the annotation tree lock, possibly on a background queue, and must not access the cluster manager.
+ 
+ @param clusterManager The cluster manager object requesting the annotation.
+ @param identifier     The identifier of the point.
+ 
+ @return The annotation of the point.
+ */
+- (nullable id<MKAnnotation>)clusterManager:(CKClusterManager *)clusterManager annotationWithIdentifier:(uint64_t)identifier;
+
 /**
  Tells the delegate to perform an animation.
  
@@ -116,11 +129,82 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
  */
 @property (nonatomic) double marginFactor;
 
+/**
+ Whether clusters are computed on a background queue, NO by default, clusters being computed and applied synchronously on the calling thread.
+ When set to YES, only the result of the most recent update is applied to the map, on the main thread, and updates superseded by a newer one
+ are abandoned. The clusters then reach the map after -updateClusters returns, and the algorithm and the -clusterManager:shouldClusterAnnotation:
+ delegate method run on a background queue.
+ */
+@property (nonatomic, getter=isAsynchronous) BOOL asynchronous;
+
+/**
+ The minimum time between two cluster updates triggered by updateClustersIfNeeded, measured in seconds. 1/15 by default.
+ While the camera moves, requests received during an update or before this interval has elapsed are coalesced into a single
+ pending update, performed once the current one completes. The last request is always served, so clusters match the map once it settles.
+ */
+@property (nonatomic) NSTimeInterval minimumUpdateInterval;
+
+/**
+ The memory budget of the cluster tile cache, in bytes, 8 MB by default. Set to 0 to disable the cache.
+ When the algorithm computes clusters by tiles {@see -[CKClusterAlgorithm tileSizeAtZoom:]}, clusters are cached per zoom level
+ and tile, so that panning only clusters the tiles not seen yet. Least recently used tiles are evicted first. Tiles are invalidated
+ when annotations within them are added, removed or moved.
+ */
+@property (nonatomic) NSUInteger tileCacheLimit;
+
+/**
+ Whether annotation coordinate changes are observed with key-value observing, YES by default.
+ Set to NO when moving many annotations at once, like a fleet of vehicles, and apply the moves with -updateCoordinates:forAnnotations:.
+ Changing this value rebuilds the annotation tree when it is a CKQuadTree. Other trees, like a CKQuadTreeSnapshot, are kept
+ and the value applies to the next annotations set.
+ */
+@property (nonatomic) BOOL observesAnnotationCoordinates;
+
 /**
  The annotations to clusterize.
+ With a CKQuadTreeSnapshot, reading them resolves every point into an annotation. Points given with
+ -setCoordinates:identifiers:count: are better reached one by one with -annotationWithIdentifier:.
  */
 @property (nonatomic, copy) NSArray<id<MKAnnotation>> *annotations;
 
+/**
+ Replaces the annotations, building the annotation tree on a background queue when the cluster manager is asynchronous,
+ so that large data sets are refreshed without blocking the main thread. The previous annotations stay clustered until the
+ tree is built, changes made to them meanwhile are discarded. Only the most recent replacement is applied.
+ 
+ @param annotations The annotations to clusterize.
+ @param completion  A block called on the main thread once the annotations are replaced, or superseded by a newer replacement. May be NULL.
+ */
+- (void)setAnnotations:(NSArray<id<MKAnnotation>> *)annotations completion:(void (^ __nullable)(void))completion;
+
+/**
+ Replaces the annotations with points given by their coordinate, without any annotation object.
+ The tree only stores the projected points and their identifiers, annotations are created on demand when the points get clustered,
+ {@see -[CKClusterManagerDelegate clusterManager:annotationWithIdentifier:]}. Coordinates are not observed.
+ 
+ @param coordinates The coordinates of the points, copied.
+ @param identifiers The identifiers of the points, their index when NULL.
+ @param count       The number of points.
+ */
+- (void)setCoordinates:(const CLLocationCoordinate2D *)coordinates identifiers:(nullable const uint64_t *)identifiers count:(NSUInteger)count;
+
+/**
+ Returns the annotation of a point given with -setCoordinates:identifiers:count:, creating it if needed, so that it can be selected.
+ 
+ @param identifier The identifier of the point.
+ 
+ @return The annotation of the point, nil when not found.
+ */
+- (nullable id<MKAnnotation>)annotationWithIdentifier:(uint64_t)identifier;
+
+/**
+ Replaces the annotations with the content of a prebuilt tree, like a CKQuadTreeSnapshot loaded from a file.
+ The cluster manager becomes the delegate of the tree.
+ 
+ @param tree The annotation tree to clusterize.
+ */
+- (void)setAnnotationTree:(id<CKAnnotationTree>)tree;
+
 /**
  Adds an annotation.
  
@@ -130,6 +214,8 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
 
 /**
  Adds annotations.
+ When the algorithm computes clusters by tiles, only the displayed tiles holding the annotations are clustered again,
+ otherwise the clusters are updated as a whole if any annotation lies in the clustered area.
  
  @param annotations Annotations to add.
  */
@@ -144,11 +230,22 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
 
 /**
  Removes annotations.
+ Like -addAnnotations:, only the displayed tiles holding the annotations are clustered again when possible.
  
  @param annotations Annotations to remove.
  */
 - (void)removeAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
 
+/**
+ Moves annotations in a single batch. Annotations responding to -setCoordinate: are given their new coordinate.
+ The tiles the annotations leave and enter are invalidated and, like -addAnnotations:, only the displayed tiles are clustered
+ again when possible. Moves received while clusters are being updated are applied at once when the update completes.
+ 
+ @param coordinates The new coordinates, one per annotation.
+ @param annotations The annotations to move.
+ */
+- (void)updateCoordinates:(const CLLocationCoordinate2D *)coordinates forAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
 /**
  Selects an annotation. Look for the annotation in clusters and extract it if necessary.
  
@@ -163,6 +260,13 @@ FOUNDATION_EXTERN const double kCKMarginFactorWorld;
  */
 - (void)deselectAnnotation:(nullable id<MKAnnotation>)annotation animated:(BOOL)animated;
 
+/**
+ Empties the cluster tile cache.
+ Call it when the clusters would change for another reason than annotations being added, removed or moved,
+ like a change of the delegate's clusterManager:shouldClusterAnnotation: answers.
+ */
+- (void)invalidateTileCache;
+
 /**
  Updates displayed clusters.
  */
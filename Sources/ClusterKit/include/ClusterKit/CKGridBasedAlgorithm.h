@@ -36,6 +36,10 @@
  2. Associate each annotation to a grid cell. The rect is partitioned in a finite number of cells using the cell
     size property at the given zoom level.
  3. Annotation are added to a centroid cluster {@see CKCentroidCluster} by default.
+ 
+ Large queries are split in stripes of whole cell columns, grouped concurrently on the available cores.
+ Clusters are then created on the calling thread, ordered by the first annotation of their cell, so the result is
+ the same as on a single thread.
  */
 @interface CKGridBasedAlgorithm : CKClusterAlgorithm
 
@@ -0,0 +1,100 @@
+// CKHierarchicalDistanceBasedAlgorithm.h
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <ClusterKit/CKClusterAlgorithm.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/**
+ A hierarchical distance-based clustering algorithm with O(n log n) preprocessing and O(k) queries,
+ k being the number of clusters in the queried rect.
+ 
+ Instead of clustering the annotations in the rect on every update, this algorithm builds once a hierarchy
+ of clusters for every zoom level between minZoomLevel and maxZoomLevel, each level having its own spatial index:
+ 
+ 1. Start from the annotations, at maxZoomLevel + 1.
+ 2. For each point not yet clusterized at the finer level, gather the points within half the cell size at the current zoom.
+ 3. Merge them into a cluster at their weighted centroid, which becomes a point of the current level.
+ 4. Repeat with the clusters of the current level for the next coarser level, down to minZoomLevel.
+ 
+ Querying a rect then reduces to a range search in the index of the requested zoom. Annotations are stored once,
+ ordered so that the ones below any node are contiguous, and each cluster references the range of its node along with
+ the node count and centroid, without copying the annotations.
+ 
+ Any change of the tree, be it a single annotation moving, rebuilds the whole hierarchy in O(n log n) the next time
+ clusters are requested. The algorithm suits annotation sets that rarely change, prefer CKGridBasedAlgorithm for
+ annotations moving live.
+ 
+ The parent and children of a cluster are retrieved from the hierarchy without any spatial matching,
+ {@see parentOfCluster:} and {@see childrenOfCluster:}. The cluster manager follows these links to animate zoom changes.
+ 
+ CKHierarchicalDistanceBasedAlgorithm is an objective-c implementation of the algorithm used by the supercluster library.
+ @see https://github.com/mapbox/supercluster
+ */
+@interface CKHierarchicalDistanceBasedAlgorithm : CKClusterAlgorithm
+
+/**
+ Cell size around a point, in screen points. Points closer than half the cell size are merged.
+ */
+@property (nonatomic) CGFloat cellSize;
+
+/**
+ The minimum zoom level of the hierarchy, 0 by default.
+ */
+@property (nonatomic) NSUInteger minZoomLevel;
+
+/**
+ The maximum zoom level of the hierarchy, 20 by default.
+ Above this level, every annotation is its own cluster.
+ */
+@property (nonatomic) NSUInteger maxZoomLevel;
+
+/**
+ Discards the hierarchy, it will be rebuilt the next time clusters are requested.
+ Trees that do not report their version need the algorithm to be invalidated whenever their content changes.
+ */
+- (void)invalidate;
+
+/**
+ Returns the cluster containing the given cluster at the next coarser zoom level.
+ The node of a cluster is found from its identifier and count, so a cluster updated in place by the cluster manager
+ links to the node of its new annotations. Clusters with the same annotations at consecutive levels are one node:
+ its parent is above the coarsest of them, its children below the finest.
+ 
+ @param cluster A cluster returned by the algorithm.
+ 
+ @return The parent cluster, nil if the cluster is at the minimum zoom level or has not been created by the algorithm.
+ */
+- (nullable CKCluster *)parentOfCluster:(CKCluster *)cluster;
+
+/**
+ Returns the clusters merged into the given cluster at the next finer zoom level.
+ 
+ @param cluster A cluster returned by the algorithm.
+ 
+ @return The child clusters, empty if the cluster is above maxZoomLevel or has not been created by the algorithm.
+ */
+- (NSArray<CKCluster *> *)childrenOfCluster:(CKCluster *)cluster;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -34,6 +34,9 @@
  3. Add all items that are within a certain distance to the cluster.
  4. Move any items out of an existing cluster if they are closer to another cluster.
  
+ Distances are measured to the cluster coordinate as annotations join, which moves with a registered
+ CKCentroidCluster and stays on the first annotation with CKCluster.
+ 
  CKNonHierarchicalDistanceBasedAlgorithm is an objective-c implementation of the non-hierarchical distance
  based clustering algorithm used by Google maps.
  @see https://github.com/googlemaps/android-maps-utils/blob/master/library/src/com/google/maps/android/clustering/algo/NonHierarchicalDistanceBasedAlgorithm.java
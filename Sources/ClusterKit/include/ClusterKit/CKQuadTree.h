@@ -27,6 +27,24 @@ NS_ASSUME_NONNULL_BEGIN
 /// Default node capacity
 #define CK_QTREE_STDCAP 4
 
+/**
+ The reductions a quadtree maintains over its nodes.
+ */
+typedef NS_ENUM(NSInteger, CKReducer) {
+    CKReducerSum,   ///< The sum of the values.
+    CKReducerMin,   ///< The minimum value, +INFINITY when empty.
+    CKReducerMax,   ///< The maximum value, -INFINITY when empty.
+};
+
+/**
+ Aggregated values of a group of annotations.
+ */
+typedef struct CKAnnotationAggregate {
+    NSUInteger count;   ///< The number of annotations.
+    MKMapPoint sum;     ///< The sum of the annotations projected coordinates, the centroid being sum / count.
+    MKMapRect bounds;   ///< The tight bounding box of the annotations, MKMapRectNull when empty.
+} CKAnnotationAggregate;
+
 typedef struct hb_qtree hb_qtree_t;
 
 /// :nodoc:
@@ -38,9 +56,27 @@ FOUNDATION_EXPORT void hb_qtree_insert(hb_qtree_t *tree, id<MKAnnotation> annota
 /// :nodoc:
 FOUNDATION_EXPORT void hb_qtree_remove(hb_qtree_t *tree, id<MKAnnotation> annotation);
 /// :nodoc:
+FOUNDATION_EXPORT void hb_qtree_update(hb_qtree_t *tree, id<MKAnnotation> annotation, MKMapPoint point);
+/// :nodoc:
+FOUNDATION_EXPORT BOOL hb_qtree_get_point(hb_qtree_t *tree, id<MKAnnotation> annotation, MKMapPoint *point);
+/// :nodoc:
 FOUNDATION_EXPORT void hb_qtree_clear(hb_qtree_t *tree);
 /// :nodoc:
+FOUNDATION_EXPORT void hb_qtree_bulk_load(hb_qtree_t *tree, __unsafe_unretained id<MKAnnotation> _Nonnull const * _Nullable annotations, NSUInteger count);
+/// :nodoc:
 FOUNDATION_EXPORT void hb_qtree_find_in_range(hb_qtree_t *tree, MKMapRect range, void(^find)(id<MKAnnotation>annotation));
+/// :nodoc:
+FOUNDATION_EXPORT NSUInteger hb_qtree_get_in_range(hb_qtree_t *tree, MKMapRect range, __unsafe_unretained id<MKAnnotation> _Nonnull * _Nullable buffer, NSUInteger size);
+/// :nodoc:
+FOUNDATION_EXPORT NSUInteger hb_qtree_fill_in_range(hb_qtree_t *tree, MKMapRect range, CKAnnotationBuffer *buffer);
+/// :nodoc:
+FOUNDATION_EXPORT NSUInteger hb_qtree_count_in_range(hb_qtree_t *tree, MKMapRect range);
+/// :nodoc:
+FOUNDATION_EXPORT void hb_qtree_aggregate_init(hb_qtree_t *tree, CKAnnotationAggregate *aggregate, double * _Nullable reduced);
+/// :nodoc:
+FOUNDATION_EXPORT NSUInteger hb_qtree_aggregate_in_range(hb_qtree_t *tree, MKMapRect range, CKAnnotationAggregate * _Nullable aggregate, double * _Nullable reduced);
+/// :nodoc:
+FOUNDATION_EXPORT NSUInteger hb_qtree_add_reducer(hb_qtree_t *tree, CKReducer kind, double(^value)(id<MKAnnotation> annotation));
 
 /**
  A quadtree is a tree data structure in which each internal node has exactly four children.
@@ -62,7 +98,48 @@ FOUNDATION_EXPORT void hb_qtree_find_in_range(hb_qtree_t *tree, MKMapRect range,
  
  @return An initialized CKQuadTree.
  */
-- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations NS_DESIGNATED_INITIALIZER;
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
+/**
+ Initializes a CKQuadTree with the given annotations.
+ 
+ @param annotations         An annotations array.
+ @param observesCoordinates Whether the tree observes the annotations coordinate with KVO.
+                            When NO, moves must be applied with -updateCoordinates:forAnnotations:.
+ 
+ @return An initialized CKQuadTree.
+ */
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations observesCoordinates:(BOOL)observesCoordinates NS_DESIGNATED_INITIALIZER;
+
+/**
+ Whether the tree observes the annotations coordinate with KVO.
+ */
+@property (nonatomic, readonly) BOOL observesCoordinates;
+
+/**
+ Registers a numeric reducer, maintained by every node over its subtree through inserts, removals and moves.
+ The value block is called under the tree lock when annotations are inserted or move, it must not access the tree.
+ Large trees are built on several threads, the block may then be called concurrently.
+ Nodes grow to hold the new value, registering a reducer releases the nodes and loads the annotations again:
+ register reducers before filling a large tree.
+ 
+ @param reducer The reduction to maintain.
+ @param value   The block returning the value of an annotation to reduce.
+ 
+ @return The index of the reducer in the reduced values.
+ */
+- (NSUInteger)registerReducer:(CKReducer)reducer value:(double (^)(id<MKAnnotation> annotation))value;
+
+/**
+ Aggregates the annotations in a rect. Nodes entirely within the rect are read in constant time, whatever their size.
+ The tree delegate is not asked whether to extract the annotations.
+ 
+ @param rect    The map rect.
+ @param reduced On return, the value of each registered reducer over the annotations in the rect. May be NULL.
+ 
+ @return The aggregate of the annotations in the rect.
+ */
+- (CKAnnotationAggregate)aggregateAnnotationsInRect:(MKMapRect)rect reduced:(nullable double *)reduced;
 
 @end
 
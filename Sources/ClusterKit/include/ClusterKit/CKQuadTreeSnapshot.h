@@ -0,0 +1,157 @@
+// CKQuadTreeSnapshot.h
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <ClusterKit/CKAnnotationTree.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+/// Current version of the snapshot file format
+#define CK_QSNAP_VERSION 1
+
+/**
+ Returns the annotation of a stable identifier, or nil when it no longer exists.
+ */
+typedef id<MKAnnotation> _Nullable (^CKAnnotationResolver)(uint64_t identifier);
+
+/**
+ A lightweight annotation standing for a point given by its coordinate and identifier.
+ */
+@interface CKAnnotationProxy : NSObject <MKAnnotation>
+
+/**
+ The identifier of the point.
+ */
+@property (nonatomic, readonly) uint64_t identifier;
+
+/**
+ The coordinate of the point.
+ */
+@property (nonatomic, readonly) CLLocationCoordinate2D coordinate;
+
+/**
+ Initializes a proxy.
+ 
+ @param identifier The identifier of the point.
+ @param coordinate The coordinate of the point.
+ 
+ @return An initialized CKAnnotationProxy.
+ */
+- (instancetype)initWithIdentifier:(uint64_t)identifier coordinate:(CLLocationCoordinate2D)coordinate NS_DESIGNATED_INITIALIZER;
+
+/// :nodoc:
+- (instancetype)init NS_UNAVAILABLE;
+
+@end
+
+/**
+ A read-only annotation tree loaded from a snapshot file, or built from coordinate arrays.
+ 
+ The file is mapped in memory and queried in place, without being parsed: it holds the projected points of the annotations,
+ their stable identifiers and the layout of the quadtree nodes with their aggregates. Annotation objects are only resolved by
+ identifier, once, the first time a query returns them.
+ 
+ Snapshots are written in little-endian order, on big-endian hosts the file is read in memory and swapped once.
+ The coordinate of the annotations is not observed. Inserting or removing annotations resolves every annotation and loads them
+ in a CKQuadTree, to which the snapshot forwards from then on. Moves are ignored until then: the points of a snapshot are fixed,
+ annotations moving must be removed and inserted again.
+ */
+@interface CKQuadTreeSnapshot : NSObject <CKAnnotationTree>
+
+/**
+ Writes annotations to a snapshot file.
+ 
+ @param annotations The annotations to write.
+ @param identifier  The block returning the stable identifier of an annotation.
+ @param path        The path of the file, replaced atomically.
+ @param error       On return, the error when the file could not be written. May be NULL.
+ 
+ @return YES when the file was written.
+ */
++ (BOOL)writeAnnotations:(NSArray<id<MKAnnotation>> *)annotations
+             identifiers:(uint64_t (^)(id<MKAnnotation> annotation))identifier
+                  toFile:(NSString *)path
+                   error:(NSError **)error;
+
+/**
+ Initializes a CKQuadTreeSnapshot by mapping a snapshot file.
+ 
+ @param path     The path of the snapshot file.
+ @param resolver The block returning the annotation of an identifier, called under the tree lock. It must not access the tree.
+ @param error    On return, the error when the file could not be mapped, or is not a valid snapshot. May be NULL.
+ 
+ @return An initialized CKQuadTreeSnapshot, or nil on failure.
+ */
+- (nullable instancetype)initWithContentsOfFile:(NSString *)path resolver:(CKAnnotationResolver)resolver error:(NSError **)error;
+
+/**
+ Initializes a CKQuadTreeSnapshot in memory from coordinates, without any annotation object.
+ Only the projected points, identifiers and node layout are stored, about 50 bytes per point.
+ 
+ @param coordinates The coordinates of the points.
+ @param identifiers The identifiers of the points, their index when NULL.
+ @param count       The number of points.
+ @param resolver    The block returning the annotation of an identifier, called under the tree lock. It must not access the tree.
+                    When nil, points resolve to CKAnnotationProxy objects.
+ 
+ @return An initialized CKQuadTreeSnapshot.
+ */
+- (instancetype)initWithCoordinates:(const CLLocationCoordinate2D *)coordinates
+                        identifiers:(nullable const uint64_t *)identifiers
+                              count:(NSUInteger)count
+                           resolver:(nullable CKAnnotationResolver)resolver;
+
+/**
+ Initializes a CKQuadTreeSnapshot holding the given annotations in a CKQuadTree, without any file.
+ 
+ @param annotations An annotations array.
+ 
+ @return An initialized CKQuadTreeSnapshot.
+ */
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations;
+
+/**
+ Resolves the annotation of an identifier. The identifiers are indexed on the first call, in about 16 bytes per point.
+ Once the snapshot forwards to a CKQuadTree, annotations keep the identifier they were resolved from, and inserted
+ CKAnnotationProxy objects are found by theirs.
+ 
+ @param identifier The identifier of the point.
+ 
+ @return The annotation of the point, nil when not found.
+ */
+- (nullable id<MKAnnotation>)annotationWithIdentifier:(uint64_t)identifier;
+
+/**
+ The number of annotations in the tree, known without resolving them.
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ The number of annotations resolved so far.
+ */
+@property (nonatomic, readonly) NSUInteger resolvedCount;
+
+/// :nodoc:
+- (instancetype)init NS_UNAVAILABLE;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -30,9 +30,11 @@ FOUNDATION_EXPORT const unsigned char ClusterKitVersionString[];
 
 #import <ClusterKit/CKClusterManager.h>
 #import <ClusterKit/CKAnnotationTree.h>
+#import <ClusterKit/CKQuadTreeSnapshot.h>
 #import <ClusterKit/CKClusterAlgorithm.h>
 #import <ClusterKit/CKNonHierarchicalDistanceBasedAlgorithm.h>
 #import <ClusterKit/CKGridBasedAlgorithm.h>
+#import <ClusterKit/CKHierarchicalDistanceBasedAlgorithm.h>
 #import <ClusterKit/CKMap.h>
 #import <ClusterKit/CKCluster.h>
 
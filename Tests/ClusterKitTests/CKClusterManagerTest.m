@@ -0,0 +1,530 @@
+// CKClusterManagerTest.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <XCTest/XCTest.h>
+#import <ClusterKit/ClusterKit.h>
+
+#import "CKAnnotation.h"
+
+@interface CKTestMap : NSObject <CKMap>
+@property (nonatomic, strong) CKClusterManager *clusterManager;
+@property (nonatomic) MKMapRect visibleMapRect;
+@property (nonatomic) double zoom;
+@property (nonatomic) NSUInteger updates;
+@property (nonatomic, copy) NSArray<CKClusterAnimation *> *animations;
+@property (nonatomic, copy) void (^didAddClusters)(NSArray<CKCluster *> *clusters);
+@end
+
+@implementation CKTestMap
+
+- (instancetype)init {
+    self = [super init];
+    if (self) {
+        _clusterManager = [CKClusterManager new];
+        _clusterManager.map = self;
+        _visibleMapRect = MKMapRectWorld;
+        _zoom = 2;
+    }
+    return self;
+}
+
+- (void)selectCluster:(CKCluster *)cluster animated:(BOOL)animated {}
+
+- (void)deselectCluster:(CKCluster *)cluster animated:(BOOL)animated {}
+
+- (void)addClusters:(NSArray<CKCluster *> *)clusters {
+    self.updates++;
+    if (self.didAddClusters) self.didAddClusters(clusters);
+}
+
+- (void)removeClusters:(NSArray<CKCluster *> *)clusters {}
+
+- (void)performAnimations:(NSArray<CKClusterAnimation *> *)animations completion:(void (^)(BOOL))completion {
+    self.animations = animations;
+    if (completion) completion(YES);
+}
+
+@end
+
+@interface CKCountingGridAlgorithm : CKGridBasedAlgorithm
+@property (nonatomic) NSUInteger calls;
+@end
+
+@implementation CKCountingGridAlgorithm
+
+- (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom tree:(id<CKAnnotationTree>)tree {
+    self.calls++;
+    return [super clustersInRect:rect zoom:zoom tree:tree];
+}
+
+@end
+
+/// A tree without incremental changes.
+@interface CKListTree : NSObject <CKAnnotationTree>
+@end
+
+@implementation CKListTree
+@synthesize delegate = _delegate;
+@synthesize annotations = _annotations;
+
+- (instancetype)initWithAnnotations:(NSArray<id<MKAnnotation>> *)annotations {
+    self = [super init];
+    if (self) {
+        _annotations = [annotations copy];
+    }
+    return self;
+}
+
+- (NSArray<id<MKAnnotation>> *)annotationsInRect:(MKMapRect)rect {
+    NSMutableArray<id<MKAnnotation>> *annotations = [NSMutableArray array];
+    for (id<MKAnnotation> annotation in _annotations) {
+        if (MKMapRectContainsPoint(rect, MKMapPointForCoordinate(annotation.coordinate))) [annotations addObject:annotation];
+    }
+    return annotations;
+}
+
+@end
+
+@interface CKClusterManagerTest : XCTestCase <CKClusterManagerDelegate>
+@property (nonatomic, strong) NSArray<id<MKAnnotation>> *annotations;
+@property (nonatomic, strong) CKTestMap *map;
+@property (nonatomic) NSUInteger materialized;
+@end
+
+@implementation CKClusterManagerTest
+
+- (void)setUp {
+    [super setUp];
+    
+    NSMutableArray *annotations = [NSMutableArray array];
+    
+    for (double x = 0; x < MKMapSizeWorld.width; x += MKMapSizeWorld.width / 100) {
+        for (double y = 0; y < MKMapSizeWorld.height; y += MKMapSizeWorld.height / 100) {
+            
+            MKMapPoint point = MKMapPointMake(x, y);
+            CKAnnotation *annotation = [CKAnnotation new];
+            annotation.coordinate = MKCoordinateForMapPoint(point);
+            [annotations addObject:annotation];
+        }
+    }
+    
+    self.annotations = annotations;
+    self.map = [CKTestMap new];
+    self.map.clusterManager.algorithm = [CKGridBasedAlgorithm new];
+}
+
+- (void)testSynchronousUpdate {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.asynchronous = NO;
+    manager.annotations = self.annotations;
+    
+    XCTAssertEqual(self.map.updates, 1);
+    XCTAssertTrue(manager.clusters.count, @"No cluster");
+    XCTAssertEqual([[manager.clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.annotations.count);
+}
+
+- (void)testCoalescedUpdates {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.asynchronous = NO;
+    manager.minimumUpdateInterval = 0.2;
+    manager.annotations = self.annotations;
+    XCTAssertEqual(self.map.updates, 1);
+    
+    // Simulates a pinch, the first tick updates and the following ones are coalesced.
+    for (NSUInteger i = 1; i <= 5; i++) {
+        self.map.visibleMapRect = MKMapRectInset(MKMapRectWorld, i * MKMapSizeWorld.width / 16, i * MKMapSizeWorld.height / 16);
+        self.map.zoom = 2 + i / 2.;
+        [manager updateClustersIfNeeded];
+    }
+    XCTAssertEqual(self.map.updates, 2);
+    
+    XCTestExpectation *settled = [self expectationWithDescription:@"Settled"];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.5 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        [settled fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    // The final camera position gets its update.
+    XCTAssertEqual(self.map.updates, 3);
+    
+    [manager updateClustersIfNeeded];
+    XCTAssertEqual(self.map.updates, 3);
+}
+
+- (void)testAsynchronousUpdate {
+    CKClusterManager *manager = self.map.clusterManager;
+    XCTAssertFalse(manager.isAsynchronous);
+    manager.asynchronous = YES;
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Clusters applied"];
+    self.map.didAddClusters = ^(NSArray<CKCluster *> *clusters) {
+        XCTAssertTrue([NSThread isMainThread]);
+        [expectation fulfill];
+    };
+    
+    // Superseded updates are abandoned, only the last one reaches the map.
+    manager.annotations = self.annotations;
+    [manager updateClusters];
+    [manager updateClusters];
+    XCTAssertEqual(self.map.updates, 0);
+    
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTestExpectation *settled = [self expectationWithDescription:@"Settled"];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(0.5 * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+        [settled fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    
+    XCTAssertEqual(self.map.updates, 1);
+    XCTAssertEqual([[manager.clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.annotations.count);
+}
+
+- (void)testAsynchronousAnnotations {
+    CKClusterManager *manager = self.map.clusterManager;
+    XCTAssertFalse(manager.isAsynchronous);
+    manager.asynchronous = YES;
+    
+    XCTestExpectation *expectation = [self expectationWithDescription:@"Annotations replaced"];
+    
+    // The first replacement is superseded by the second one.
+    [manager setAnnotations:[self.annotations subarrayWithRange:NSMakeRange(0, 10)] completion:nil];
+    [manager setAnnotations:self.annotations completion:^{
+        XCTAssertTrue([NSThread isMainThread]);
+        XCTAssertEqual(manager.annotations.count, self.annotations.count);
+        [expectation fulfill];
+    }];
+    XCTAssertEqual(manager.annotations.count, 0);
+    
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+}
+
+- (void)testInPlaceUpdate {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.asynchronous = NO;
+    manager.annotations = self.annotations;
+    
+    NSArray<CKCluster *> *clusters = manager.clusters;
+    CKCluster *cluster = nil;
+    for (CKCluster *candidate in clusters) {
+        if (candidate.count > 1) {
+            cluster = candidate;
+            break;
+        }
+    }
+    XCTAssertNotNil(cluster);
+    
+    // Removing any annotation but the lowest one keeps the cluster identifier.
+    id<MKAnnotation> annotation = cluster.firstAnnotation;
+    if ((uint64_t)(uintptr_t)(__bridge void *)annotation == cluster.identifier) {
+        annotation = [cluster annotationAtIndex:1];
+    }
+    uint64_t identifier = cluster.identifier;
+    uint64_t fingerprint = cluster.fingerprint;
+    NSUInteger count = cluster.count;
+    
+    [manager removeAnnotation:annotation];
+    
+    XCTAssertEqual(manager.clusters.count, clusters.count);
+    for (CKCluster *displayed in manager.clusters) {
+        XCTAssertNotEqual([clusters indexOfObjectIdenticalTo:displayed], NSNotFound, @"Cluster replaced instead of updated");
+    }
+    
+    XCTAssertEqual(cluster.identifier, identifier);
+    XCTAssertNotEqual(cluster.fingerprint, fingerprint);
+    XCTAssertEqual(cluster.count, count - 1);
+    XCTAssertFalse([cluster containsAnnotation:annotation]);
+}
+
+- (void)testZoomAnimations {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.asynchronous = NO;
+    manager.annotations = self.annotations;
+    
+    NSArray<CKCluster *> *parents = manager.clusters;
+    NSUInteger count = parents.count;
+    CLLocationCoordinate2D *coordinates = malloc(count * sizeof(CLLocationCoordinate2D));
+    MKMapRect *bounds = malloc(count * sizeof(MKMapRect));
+    for (NSUInteger i = 0; i < count; i++) {
+        coordinates[i] = parents[i].coordinate;
+        bounds[i] = parents[i].bounds;
+    }
+    
+    self.map.visibleMapRect = MKMapRectInset(MKMapRectWorld, MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4);
+    self.map.zoom = 4;
+    [manager updateClusters];
+    
+    XCTAssertTrue(self.map.animations.count, @"No animation");
+    
+    // Zooming in, parents are replaced rather than updated in place, only new clusters are animated.
+    for (CKClusterAnimation *animation in self.map.animations) {
+        XCTAssertEqual([parents indexOfObjectIdenticalTo:animation.cluster], NSNotFound);
+    }
+    
+    // Every visible new cluster off the position of its parent is animated from it.
+    for (CKCluster *cluster in manager.clusters) {
+        MKMapPoint point = MKMapPointForCoordinate(cluster.coordinate);
+        if (!MKMapRectContainsPoint(self.map.visibleMapRect, point)) continue;
+        if ([parents indexOfObjectIdenticalTo:cluster] != NSNotFound) continue;
+        
+        NSUInteger parent = NSNotFound;
+        for (NSUInteger i = 0; i < count && parent == NSNotFound; i++) {
+            if (point.x >= bounds[i].origin.x && point.x <= MKMapRectGetMaxX(bounds[i]) &&
+                point.y >= bounds[i].origin.y && point.y <= MKMapRectGetMaxY(bounds[i])) {
+                parent = i;
+            }
+        }
+        XCTAssertNotEqual(parent, NSNotFound, @"No parent");
+        if (parent == NSNotFound) continue;
+        if (coordinates[parent].latitude == cluster.coordinate.latitude && coordinates[parent].longitude == cluster.coordinate.longitude) continue;
+        
+        CKClusterAnimation *animation = nil;
+        for (CKClusterAnimation *candidate in self.map.animations) {
+            if (candidate.cluster == cluster) animation = candidate;
+        }
+        XCTAssertNotNil(animation, @"Cluster not animated");
+        if (!animation) continue;
+        
+        // The animation starts from a parent whose bounds contain the cluster.
+        NSUInteger from = NSNotFound;
+        for (NSUInteger i = 0; i < count && from == NSNotFound; i++) {
+            if (coordinates[i].latitude == animation.from.latitude && coordinates[i].longitude == animation.from.longitude &&
+                point.x >= bounds[i].origin.x && point.x <= MKMapRectGetMaxX(bounds[i]) &&
+                point.y >= bounds[i].origin.y && point.y <= MKMapRectGetMaxY(bounds[i])) {
+                from = i;
+            }
+        }
+        XCTAssertNotEqual(from, NSNotFound);
+        XCTAssertEqual(animation.to.latitude, cluster.coordinate.latitude);
+        XCTAssertEqual(animation.to.longitude, cluster.coordinate.longitude);
+    }
+    
+    free(bounds);
+    free(coordinates);
+}
+
+- (void)testHierarchicalZoomAnimations {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    manager.asynchronous = NO;
+    manager.annotations = self.annotations;
+    
+    // Zooming in, every new cluster comes from the parent it was split from.
+    NSArray<CKCluster *> *parents = manager.clusters;
+    self.map.visibleMapRect = MKMapRectInset(MKMapRectWorld, MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4);
+    self.map.zoom = 4;
+    [manager updateClusters];
+    
+    XCTAssertTrue(self.map.animations.count, @"No animation");
+    for (CKClusterAnimation *animation in self.map.animations) {
+        BOOL linked = NO;
+        for (CKCluster *parent in parents) {
+            if (parent.coordinate.latitude != animation.from.latitude || parent.coordinate.longitude != animation.from.longitude) continue;
+            linked = linked || [animation.cluster isSubsetOfCluster:parent];
+        }
+        XCTAssertTrue(linked);
+    }
+    
+    // Zooming out, every old cluster goes to the parent it was merged into.
+    NSArray<CKCluster *> *children = manager.clusters;
+    self.map.animations = nil;
+    self.map.visibleMapRect = MKMapRectWorld;
+    self.map.zoom = 2;
+    [manager updateClusters];
+    
+    XCTAssertTrue(self.map.animations.count, @"No animation");
+    for (CKClusterAnimation *animation in self.map.animations) {
+        XCTAssertNotEqual([children indexOfObjectIdenticalTo:animation.cluster], NSNotFound);
+        
+        BOOL linked = NO;
+        for (CKCluster *parent in manager.clusters) {
+            if (parent.coordinate.latitude != animation.to.latitude || parent.coordinate.longitude != animation.to.longitude) continue;
+            linked = linked || [animation.cluster isSubsetOfCluster:parent];
+        }
+        XCTAssertTrue(linked);
+    }
+}
+
+- (void)testTileCache {
+    CKCountingGridAlgorithm *algorithm = [CKCountingGridAlgorithm new];
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.algorithm = algorithm;
+    manager.asynchronous = NO;
+    manager.marginFactor = 0;
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 8, MKMapSizeWorld.height / 8);
+    self.map.visibleMapRect = rect;
+    self.map.zoom = 4;
+    manager.annotations = self.annotations;
+    
+    NSUInteger calls = algorithm.calls;
+    NSUInteger count = manager.clusters.count;
+    XCTAssertTrue(calls);
+    
+    self.map.visibleMapRect = MKMapRectOffset(rect, MKMapSizeWorld.width / 2, 0);
+    [manager updateClusters];
+    XCTAssertGreaterThan(algorithm.calls, calls);
+    
+    // Panning back only hits the cache.
+    calls = algorithm.calls;
+    self.map.visibleMapRect = rect;
+    [manager updateClusters];
+    XCTAssertEqual(algorithm.calls, calls);
+    XCTAssertEqual(manager.clusters.count, count);
+    
+    // Adding an annotation only clusters its tile again.
+    CKAnnotation *annotation = [CKAnnotation new];
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(MKMapRectGetMidX(rect), MKMapRectGetMidY(rect)));
+    [manager addAnnotation:annotation];
+    XCTAssertEqual(algorithm.calls, calls + 1);
+    
+    BOOL found = NO;
+    for (CKCluster *cluster in manager.clusters) {
+        found = found || [cluster containsAnnotation:annotation];
+    }
+    XCTAssertTrue(found);
+}
+
+- (void)testPartialUpdate {
+    CKCountingGridAlgorithm *algorithm = [CKCountingGridAlgorithm new];
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.algorithm = algorithm;
+    manager.asynchronous = NO;
+    manager.tileCacheLimit = 0;
+    manager.annotations = self.annotations;
+    
+    NSArray<CKCluster *> *clusters = manager.clusters;
+    NSUInteger calls = algorithm.calls;
+    
+    // Without the cache, removing an annotation still only clusters its tile again.
+    id<MKAnnotation> annotation = self.annotations[self.annotations.count / 2];
+    [manager removeAnnotation:annotation];
+    XCTAssertEqual(algorithm.calls, calls + 1);
+    
+    NSUInteger kept = 0;
+    for (CKCluster *cluster in manager.clusters) {
+        XCTAssertFalse([cluster containsAnnotation:annotation]);
+        if ([clusters indexOfObjectIdenticalTo:cluster] != NSNotFound) kept++;
+    }
+    XCTAssertGreaterThanOrEqual(kept + 1, clusters.count);
+    XCTAssertEqual([[manager.clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.annotations.count - 1);
+}
+
+- (void)testTreeWithoutIncrementalChanges {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.asynchronous = NO;
+    [manager setAnnotationTree:[[CKListTree alloc] initWithAnnotations:[self.annotations subarrayWithRange:NSMakeRange(1, self.annotations.count - 1)]]];
+    
+    // The tree is rebuilt with the annotations added or removed.
+    [manager addAnnotation:self.annotations.firstObject];
+    XCTAssertEqual(manager.annotations.count, self.annotations.count);
+    
+    [manager addAnnotation:self.annotations.firstObject];
+    XCTAssertEqual(manager.annotations.count, self.annotations.count);
+    
+    [manager removeAnnotation:self.annotations.lastObject];
+    XCTAssertEqual(manager.annotations.count, self.annotations.count - 1);
+    XCTAssertEqual([[manager.clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.annotations.count - 1);
+}
+
+- (void)testCoordinateSource {
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.delegate = self;
+    manager.asynchronous = NO;
+    manager.marginFactor = 0;
+    
+    NSUInteger count = self.annotations.count;
+    CLLocationCoordinate2D *coordinates = malloc(count * sizeof(CLLocationCoordinate2D));
+    for (NSUInteger i = 0; i < count; i++) {
+        coordinates[i] = self.annotations[i].coordinate;
+    }
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 8, MKMapSizeWorld.height / 8);
+    self.map.visibleMapRect = rect;
+    self.map.zoom = 4;
+    [manager setCoordinates:coordinates identifiers:NULL count:count];
+    free(coordinates);
+    
+    // Only the points of the clustered area get an annotation.
+    NSUInteger clustered = [[manager.clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue];
+    XCTAssertTrue(clustered);
+    XCTAssertGreaterThanOrEqual(self.materialized, clustered);
+    XCTAssertLessThan(self.materialized, count);
+    
+    id<MKAnnotation> annotation = [manager annotationWithIdentifier:0];
+    XCTAssertEqual(annotation, self.annotations[0]);
+    [manager selectAnnotation:annotation animated:NO];
+    XCTAssertEqual(manager.selectedAnnotation, annotation);
+    
+    // Toggling the coordinate observation keeps the points, which are not all resolved.
+    manager.observesAnnotationCoordinates = !manager.observesAnnotationCoordinates;
+    XCTAssertLessThan(self.materialized, count);
+    XCTAssertEqual([manager annotationWithIdentifier:1], self.annotations[1]);
+}
+
+- (id<MKAnnotation>)clusterManager:(CKClusterManager *)clusterManager annotationWithIdentifier:(uint64_t)identifier {
+    self.materialized++;
+    return self.annotations[(NSUInteger)identifier];
+}
+
+- (void)testBatchMoves {
+    CKCountingGridAlgorithm *algorithm = [CKCountingGridAlgorithm new];
+    CKClusterManager *manager = self.map.clusterManager;
+    manager.algorithm = algorithm;
+    manager.asynchronous = NO;
+    manager.marginFactor = 0;
+    manager.minimumUpdateInterval = 0;
+    manager.observesAnnotationCoordinates = NO;
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 8, MKMapSizeWorld.height / 8);
+    self.map.visibleMapRect = rect;
+    self.map.zoom = 4;
+    manager.annotations = self.annotations;
+    
+    NSUInteger calls = algorithm.calls;
+    
+    // Moves outside of the clustered area leave the clusters alone.
+    CLLocationCoordinate2D far = MKCoordinateForMapPoint(MKMapPointMake(MKMapSizeWorld.width * 7 / 8, MKMapSizeWorld.height * 7 / 8));
+    NSArray *annotations = @[self.annotations.lastObject];
+    [manager updateCoordinates:&far forAnnotations:annotations];
+    XCTAssertEqual(algorithm.calls, calls);
+    
+    // Moving annotations within the same tile clusters it again once, the other tiles keep their clusters.
+    NSArray<CKCluster *> *clusters = manager.clusters;
+    CLLocationCoordinate2D coordinates[2];
+    coordinates[0] = coordinates[1] = MKCoordinateForMapPoint(MKMapPointMake(MKMapRectGetMidX(rect), MKMapRectGetMidY(rect)));
+    annotations = [self.annotations subarrayWithRange:NSMakeRange(0, 2)];
+    [manager updateCoordinates:coordinates forAnnotations:annotations];
+    XCTAssertEqual(algorithm.calls, calls + 1);
+    
+    NSUInteger found = 0, kept = 0;
+    for (CKCluster *cluster in manager.clusters) {
+        for (id<MKAnnotation> annotation in annotations) {
+            if ([cluster containsAnnotation:annotation]) found++;
+        }
+        if ([clusters indexOfObjectIdenticalTo:cluster] != NSNotFound) kept++;
+    }
+    XCTAssertEqual(found, 2);
+    XCTAssertGreaterThan(kept, 0);
+}
+
+@end
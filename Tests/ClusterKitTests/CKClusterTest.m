@@ -0,0 +1,313 @@
+// CKClusterTest.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <XCTest/XCTest.h>
+#import <ClusterKit/CKCluster.h>
+
+#import "CKAnnotation.h"
+
+@interface CKClusterTest : XCTestCase
+@property (nonatomic,strong) NSArray<CKAnnotation *> *annotations;
+@end
+
+@implementation CKClusterTest
+
+- (void)setUp {
+    [super setUp];
+    
+    NSMutableArray *annotations = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 100; i++) {
+        CKAnnotation *annotation = [CKAnnotation new];
+        annotation.coordinate = CLLocationCoordinate2DMake(40 + (i * 7 % 100) / 10., 2 + i / 10.);
+        [annotations addObject:annotation];
+    }
+    self.annotations = annotations.copy;
+}
+
+- (hb_cmembers_t *)newMembers {
+    NSUInteger count = self.annotations.count;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(count * sizeof(id));
+    [self.annotations getObjects:annotations range:NSMakeRange(0, count)];
+    
+    hb_cmembers_t *members = hb_cmembers_new(annotations, NULL, count);
+    free(annotations);
+    return members;
+}
+
+- (void)testSharedMembers {
+    hb_cmembers_t *members = [self newMembers];
+    
+    CKCluster *first = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    CKCluster *second = [CKCluster clusterWithCoordinate:self.annotations[40].coordinate];
+    [first setMembers:members range:NSMakeRange(0, 40)];
+    [second setMembers:members range:NSMakeRange(40, 60)];
+    hb_cmembers_release(members);
+    
+    XCTAssertEqual(first.count, 40);
+    XCTAssertEqual(second.count, 60);
+    XCTAssertEqualObjects(first.annotations, [self.annotations subarrayWithRange:NSMakeRange(0, 40)]);
+    XCTAssertEqual(first.firstAnnotation, self.annotations[0]);
+    XCTAssertEqual(first.lastAnnotation, self.annotations[39]);
+    XCTAssertEqual(second[0], self.annotations[40]);
+    
+    NSUInteger count = 0;
+    for (id<MKAnnotation> annotation in second) {
+        XCTAssertEqual(annotation, self.annotations[40 + count]);
+        count++;
+    }
+    XCTAssertEqual(count, 60);
+    
+    XCTAssertTrue([first containsAnnotation:self.annotations[39]]);
+    XCTAssertFalse([first containsAnnotation:self.annotations[40]]);
+    XCTAssertFalse([first intersectsCluster:second]);
+    
+    MKMapRect bounds = MKMapRectNull;
+    for (id<MKAnnotation> annotation in first) {
+        bounds = MKMapRectByAddingPoint(bounds, MKMapPointForCoordinate(annotation.coordinate));
+    }
+    XCTAssertTrue(MKMapRectEqualToRect(first.bounds, bounds));
+    
+    // Mutating a cluster leaves the one sharing its storage untouched
+    [first addAnnotation:self.annotations[50]];
+    [first removeAnnotation:self.annotations[0]];
+    XCTAssertEqual(first.count, 40);
+    XCTAssertEqual(first.lastAnnotation, self.annotations[50]);
+    XCTAssertEqual(second.count, 60);
+    XCTAssertEqual(second[10], self.annotations[50]);
+    XCTAssertTrue([first intersectsCluster:second]);
+}
+
+- (void)testSameMembership {
+    hb_cmembers_t *members = [self newMembers];
+    
+    CKCluster *shared = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    [shared setMembers:members range:NSMakeRange(0, self.annotations.count)];
+    hb_cmembers_release(members);
+    
+    CKCluster *built = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    for (CKAnnotation *annotation in self.annotations.reverseObjectEnumerator) {
+        [built addAnnotation:annotation];
+        [built addAnnotation:annotation];
+    }
+    
+    XCTAssertEqual(built.count, self.annotations.count);
+    XCTAssertEqual(shared.identifier, built.identifier);
+    XCTAssertEqual(shared.fingerprint, built.fingerprint);
+    XCTAssertEqualObjects(shared, built);
+    XCTAssertTrue(MKMapRectEqualToRect(shared.bounds, built.bounds));
+    
+    [built removeAnnotation:self.annotations[10]];
+    XCTAssertFalse([built containsAnnotation:self.annotations[10]]);
+    XCTAssertNotEqualObjects(shared, built);
+    XCTAssertTrue([built isSubsetOfCluster:shared]);
+    XCTAssertFalse([shared isSubsetOfCluster:built]);
+}
+
+- (void)testLargeClusterIndex {
+    NSUInteger count = self.annotations.count;
+    CKCluster *cluster = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    [cluster setAnnotations:self.annotations];
+    
+    for (CKAnnotation *annotation in self.annotations) {
+        XCTAssertTrue([cluster containsAnnotation:annotation]);
+    }
+    XCTAssertFalse([cluster containsAnnotation:[CKAnnotation new]]);
+    
+    // Membership follows the mutations.
+    [cluster removeAnnotation:self.annotations[10]];
+    XCTAssertFalse([cluster containsAnnotation:self.annotations[10]]);
+    XCTAssertEqual(cluster[10], self.annotations[11]);
+    
+    [cluster addAnnotation:self.annotations[10]];
+    [cluster addAnnotation:self.annotations[10]];
+    XCTAssertEqual(cluster.count, count);
+    XCTAssertEqual(cluster.lastAnnotation, self.annotations[10]);
+    
+    [cluster removeAnnotation:self.annotations[20]];
+    XCTAssertFalse([cluster containsAnnotation:self.annotations[20]]);
+    XCTAssertTrue([cluster containsAnnotation:self.annotations[21]]);
+}
+
+- (void)testTakenMembers {
+    NSUInteger count = self.annotations.count;
+    CKAnnotationBuffer buffer = {0};
+    CKAnnotationBufferReserve(&buffer, count);
+    [self.annotations getObjects:buffer.annotations range:NSMakeRange(0, count)];
+    for (NSUInteger i = 0; i < count; i++) {
+        buffer.points[i] = MKMapPointForCoordinate(self.annotations[i].coordinate);
+    }
+    
+    // The array keeps the annotations alive, the storage only retains it.
+    hb_cmembers_t *members = hb_cmembers_take(&buffer, count, self.annotations);
+    XCTAssertTrue(buffer.annotations == NULL);
+    
+    CKCluster *cluster = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    [cluster setMembers:members range:NSMakeRange(10, 20)];
+    hb_cmembers_release(members);
+    
+    CKCluster *built = [CKCluster clusterWithCoordinate:self.annotations[0].coordinate];
+    for (CKAnnotation *annotation in [self.annotations subarrayWithRange:NSMakeRange(10, 20)]) {
+        [built addAnnotation:annotation];
+    }
+    XCTAssertEqualObjects(cluster, built);
+    XCTAssertEqual(cluster.identifier, built.identifier);
+    XCTAssertTrue(MKMapRectEqualToRect(cluster.bounds, built.bounds));
+    
+    // Mutating the cluster copies its annotations out of the storage.
+    [cluster removeAnnotation:self.annotations[10]];
+    [built removeAnnotation:self.annotations[10]];
+    XCTAssertEqualObjects(cluster, built);
+}
+
+- (void)testClusterCoordinate {
+    
+    for (Class class in @[[CKCentroidCluster class], [CKNearestCentroidCluster class], [CKBottomCluster class]]) {
+        hb_cmembers_t *members = [self newMembers];
+        
+        CKCluster *shared = [class clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+        [shared setMembers:members range:NSMakeRange(0, self.annotations.count)];
+        hb_cmembers_release(members);
+        
+        CKCluster *built = [class clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+        for (CKAnnotation *annotation in self.annotations) {
+            [built addAnnotation:annotation];
+        }
+        
+        XCTAssertEqualWithAccuracy(shared.coordinate.latitude, built.coordinate.latitude, 1e-9, @"%@", class);
+        XCTAssertEqualWithAccuracy(shared.coordinate.longitude, built.coordinate.longitude, 1e-9, @"%@", class);
+        XCTAssertEqual(shared.firstAnnotation, built.firstAnnotation, @"%@", class);
+    }
+}
+
+- (void)testNearestCentroid {
+    CKNearestCentroidCluster *cluster = [CKNearestCentroidCluster clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+    NSMutableArray<CKAnnotation *> *members = [NSMutableArray array];
+    
+    id<MKAnnotation> (^nearest)(void) = ^id<MKAnnotation>{
+        CLLocationDegrees latitude = 0, longitude = 0;
+        for (CKAnnotation *annotation in members) {
+            latitude += annotation.coordinate.latitude;
+            longitude += annotation.coordinate.longitude;
+        }
+        CLLocationCoordinate2D center = CLLocationCoordinate2DMake(latitude / members.count, longitude / members.count);
+        
+        CKAnnotation *nearest = nil;
+        for (CKAnnotation *annotation in members) {
+            if (!nearest || CKDistance(center, annotation.coordinate) < CKDistance(center, nearest.coordinate)) nearest = annotation;
+        }
+        return nearest;
+    };
+    
+    for (CKAnnotation *annotation in self.annotations) {
+        [cluster addAnnotation:annotation];
+        [members addObject:annotation];
+    }
+    XCTAssertEqual(cluster.firstAnnotation, nearest());
+    XCTAssertEqual(cluster.coordinate.latitude, nearest().coordinate.latitude);
+    XCTAssertEqual(cluster.coordinate.longitude, nearest().coordinate.longitude);
+    
+    // Removing the nearest annotation elects another one
+    for (NSUInteger i = 0; i < 10; i++) {
+        id<MKAnnotation> first = cluster.firstAnnotation;
+        [cluster removeAnnotation:first];
+        [members removeObject:first];
+        XCTAssertEqual(cluster.firstAnnotation, nearest());
+        XCTAssertEqual(cluster[0], nearest());
+    }
+    
+    XCTAssertEqual(cluster.count, self.annotations.count - 10);
+    XCTAssertEqualObjects([NSSet setWithArray:cluster.annotations], [NSSet setWithArray:members]);
+}
+
+- (void)testBulkConstruction {
+    NSUInteger count = self.annotations.count;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(count * sizeof(id));
+    [self.annotations getObjects:annotations range:NSMakeRange(0, count)];
+    
+    for (Class class in @[[CKCluster class], [CKCentroidCluster class], [CKNearestCentroidCluster class], [CKBottomCluster class]]) {
+        CKCluster *bulk = [class clusterWithAnnotations:annotations count:count];
+        XCTAssertTrue([bulk isKindOfClass:class]);
+        XCTAssertEqual(bulk.count, count);
+        
+        CKCluster *built = [class clusterWithCoordinate:self.annotations[0].coordinate];
+        for (CKAnnotation *annotation in self.annotations) {
+            [built addAnnotation:annotation];
+        }
+        XCTAssertEqualObjects(bulk, built, @"%@", class);
+        XCTAssertEqual(bulk.firstAnnotation, built.firstAnnotation, @"%@", class);
+        XCTAssertEqualWithAccuracy(bulk.coordinate.latitude, built.coordinate.latitude, 1e-9, @"%@", class);
+        XCTAssertEqualWithAccuracy(bulk.coordinate.longitude, built.coordinate.longitude, 1e-9, @"%@", class);
+        
+        // Replacing the annotations recomputes the cluster
+        NSArray *half = [self.annotations subarrayWithRange:NSMakeRange(0, count / 2)];
+        [bulk setAnnotations:half];
+        for (CKAnnotation *annotation in [self.annotations subarrayWithRange:NSMakeRange(count / 2, count - count / 2)]) {
+            [built removeAnnotation:annotation];
+        }
+        XCTAssertEqualObjects(bulk, built, @"%@", class);
+        XCTAssertEqual(bulk.firstAnnotation, built.firstAnnotation, @"%@", class);
+        XCTAssertTrue(MKMapRectEqualToRect(bulk.bounds, built.bounds), @"%@", class);
+    }
+    
+    free(annotations);
+}
+
+- (void)testBottomCluster {
+    CKBottomCluster *cluster = [CKBottomCluster clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+    [cluster setAnnotations:self.annotations];
+    
+    NSArray *sorted = [self.annotations sortedArrayUsingComparator:^NSComparisonResult(CKAnnotation *obj1, CKAnnotation *obj2) {
+        return [@(obj1.coordinate.latitude) compare:@(obj2.coordinate.latitude)];
+    }];
+    
+    for (CKAnnotation *annotation in sorted) {
+        XCTAssertEqual(cluster.firstAnnotation, annotation);
+        XCTAssertEqual(cluster.coordinate.latitude, annotation.coordinate.latitude);
+        [cluster removeAnnotation:annotation];
+    }
+    XCTAssertEqual(cluster.count, 0);
+    XCTAssertFalse(CLLocationCoordinate2DIsValid(cluster.coordinate));
+}
+
+- (void)testSharedBottomCluster {
+    hb_cmembers_t *members = [self newMembers];
+    
+    CKBottomCluster *bottom = [CKBottomCluster clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+    CKCluster *shared = [CKCluster clusterWithCoordinate:kCLLocationCoordinate2DInvalid];
+    [bottom setMembers:members range:NSMakeRange(0, self.annotations.count) coordinate:kCLLocationCoordinate2DInvalid];
+    [shared setMembers:members range:NSMakeRange(0, self.annotations.count)];
+    hb_cmembers_release(members);
+    
+    id<MKAnnotation> expected = self.annotations[0];
+    for (CKAnnotation *annotation in self.annotations) {
+        if (MKMapPointForCoordinate(annotation.coordinate).y > MKMapPointForCoordinate(expected.coordinate).y) expected = annotation;
+    }
+    
+    // The coordinate is read without reordering the shared storage, which is copied once the order is exposed.
+    XCTAssertEqual(bottom.coordinate.latitude, expected.coordinate.latitude);
+    XCTAssertEqualObjects(shared.annotations, self.annotations);
+    XCTAssertEqual(bottom.firstAnnotation, expected);
+    XCTAssertEqualObjects(shared.annotations, self.annotations);
+    XCTAssertEqualObjects([NSSet setWithArray:bottom.annotations], [NSSet setWithArray:self.annotations]);
+}
+
+@end
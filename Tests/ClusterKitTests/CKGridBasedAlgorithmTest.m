@@ -55,6 +55,62 @@
     [super tearDown];
 }
 
+- (void)testClusterResult {
+    
+    CKGridBasedAlgorithm *algorithm = [CKGridBasedAlgorithm new];
+    
+    double zoom = 3;
+    long numCells = (long)ceil(256 * pow(2, zoom) / algorithm.cellSize);
+    
+    NSArray<CKCluster *> *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:zoom tree:self.tree];
+    XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.tree.annotations.count);
+    
+    NSMutableSet *cells = [NSMutableSet set];
+    for (CKCluster *cluster in clusters) {
+        NSMutableSet *cell = [NSMutableSet set];
+        for (id<MKAnnotation> annotation in cluster) {
+            MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+            NSUInteger col = numCells * point.x / MKMapSizeWorld.width;
+            NSUInteger row = numCells * point.y / MKMapSizeWorld.height;
+            [cell addObject:@(numCells * row + col)];
+        }
+        XCTAssertEqual(cell.count, 1);
+        XCTAssertFalse([cells intersectsSet:cell]);
+        [cells unionSet:cell];
+    }
+}
+
+- (void)testParallelResult {
+    
+    // Enough annotations for the clustering to be split in stripes.
+    srand48(42);
+    NSMutableArray *annotations = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 50000; i++) {
+        CKAnnotation *annotation = [CKAnnotation new];
+        annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(drand48() * MKMapSizeWorld.width, drand48() * MKMapSizeWorld.height));
+        [annotations addObject:annotation];
+    }
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:annotations];
+    
+    CKGridBasedAlgorithm *algorithm = [CKGridBasedAlgorithm new];
+    
+    double zoom = 4;
+    long numCells = (long)ceil(256 * pow(2, zoom) / algorithm.cellSize);
+    
+    NSArray<CKCluster *> *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:zoom tree:tree];
+    XCTAssertEqualObjects(clusters, [algorithm clustersInRect:MKMapRectWorld zoom:zoom tree:tree]);
+    
+    // Each column is small enough to be clustered on the calling thread.
+    NSMutableArray<CKCluster *> *expected = [NSMutableArray array];
+    for (long col = 0; col < numCells; col++) {
+        MKMapRect rect = MKMapRectMake(col * MKMapSizeWorld.width / numCells, 0, MKMapSizeWorld.width / numCells, MKMapSizeWorld.height);
+        [expected addObjectsFromArray:[algorithm clustersInRect:rect zoom:zoom tree:tree]];
+    }
+    
+    XCTAssertEqual(clusters.count, expected.count);
+    XCTAssertEqualObjects([NSSet setWithArray:clusters], [NSSet setWithArray:expected]);
+}
+
 - (void)testZoom1Performance {
     
     CKGridBasedAlgorithm *algorithm = [CKGridBasedAlgorithm new];
@@ -105,4 +161,23 @@
     }];
 }
 
+- (void)testParallelPerformance {
+    
+    srand48(42);
+    NSMutableArray *annotations = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 500000; i++) {
+        CKAnnotation *annotation = [CKAnnotation new];
+        annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(drand48() * MKMapSizeWorld.width, drand48() * MKMapSizeWorld.height));
+        [annotations addObject:annotation];
+    }
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:annotations];
+    
+    CKGridBasedAlgorithm *algorithm = [CKGridBasedAlgorithm new];
+    
+    [self measureBlock:^{
+        NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:8 tree:tree];
+        XCTAssertTrue(clusters.count, @"No cluster");
+    }];
+}
+
 @end
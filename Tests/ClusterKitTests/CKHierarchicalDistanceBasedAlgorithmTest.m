@@ -0,0 +1,173 @@
+// CKHierarchicalDistanceBasedAlgorithmTest.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+#import <XCTest/XCTest.h>
+#import <ClusterKit/CKHierarchicalDistanceBasedAlgorithm.h>
+#import <ClusterKit/CKQuadTree.h>
+
+#import "CKAnnotation.h"
+
+@interface CKHierarchicalDistanceBasedAlgorithmTest : XCTestCase <CKAnnotationTreeDelegate>
+@property (nonatomic,strong) id<CKAnnotationTree> tree;
+@property (nonatomic,strong) NSSet<id<MKAnnotation>> *rejected;
+@end
+
+@implementation CKHierarchicalDistanceBasedAlgorithmTest
+
+- (void)setUp {
+    [super setUp];
+    
+    NSMutableArray *annotations = [NSMutableArray array];
+    
+    for (double x = 0; x < MKMapSizeWorld.width; x += MKMapSizeWorld.width / 100) {
+        for (double y = 0; y < MKMapSizeWorld.height; y += MKMapSizeWorld.height / 100) {
+            
+            MKMapPoint point = MKMapPointMake(x, y);
+            CKAnnotation *annotation = [CKAnnotation new];
+            annotation.coordinate = MKCoordinateForMapPoint(point);
+            [annotations addObject:annotation];
+        }
+    }
+    
+    self.tree = [[CKQuadTree alloc] initWithAnnotations:annotations];
+}
+
+- (void)testBuildPerformance {
+    
+    [self measureBlock:^{
+        CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+        NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:1 tree:self.tree];
+        XCTAssertTrue(clusters.count, @"No cluster");
+    }];
+}
+
+- (void)testZoom1Performance {
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    [algorithm clustersInRect:MKMapRectWorld zoom:1 tree:self.tree];
+    
+    [self measureBlock:^{
+        NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:1 tree:self.tree];
+        XCTAssertTrue(clusters.count, @"No cluster");
+    }];
+}
+
+- (void)testZoom8Performance {
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    [algorithm clustersInRect:MKMapRectWorld zoom:8 tree:self.tree];
+    
+    [self measureBlock:^{
+        NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:8 tree:self.tree];
+        XCTAssertTrue(clusters.count, @"No cluster");
+    }];
+}
+
+- (void)testClusterResult {
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    
+    for (NSUInteger zoom = 0; zoom <= algorithm.maxZoomLevel + 1; zoom += 3) {
+        NSArray<CKCluster *> *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:zoom tree:self.tree];
+        
+        NSMutableSet *annotations = [NSMutableSet set];
+        for (CKCluster *cluster in clusters) {
+            [annotations addObjectsFromArray:cluster.annotations];
+        }
+        
+        XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], self.tree.annotations.count);
+        XCTAssertEqual(annotations.count, self.tree.annotations.count);
+    }
+    
+    NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:algorithm.maxZoomLevel + 1 tree:self.tree];
+    XCTAssertEqual(clusters.count, self.tree.annotations.count);
+}
+
+- (void)testHierarchy {
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    NSArray<CKCluster *> *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:2 tree:self.tree];
+    
+    for (CKCluster *cluster in clusters) {
+        NSArray<CKCluster *> *children = [algorithm childrenOfCluster:cluster];
+        XCTAssertTrue(children.count, @"No children");
+        
+        NSUInteger count = 0;
+        for (CKCluster *child in children) {
+            XCTAssertTrue([child isSubsetOfCluster:cluster]);
+            XCTAssertEqualObjects([algorithm parentOfCluster:child], cluster);
+            count += child.count;
+        }
+        XCTAssertEqual(count, cluster.count);
+    }
+}
+
+- (void)testFilteredAnnotations {
+    
+    NSArray<id<MKAnnotation>> *annotations = self.tree.annotations;
+    self.rejected = [NSSet setWithArray:[annotations subarrayWithRange:NSMakeRange(0, annotations.count / 3)]];
+    self.tree.delegate = self;
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    NSArray<CKCluster *> *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:2 tree:self.tree];
+    XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], annotations.count - self.rejected.count);
+    
+    for (CKCluster *cluster in clusters) {
+        for (id<MKAnnotation> annotation in cluster) {
+            XCTAssertFalse([self.rejected containsObject:annotation]);
+        }
+    }
+    
+    // Whole nodes are extracted once the delegate stops filtering.
+    self.rejected = nil;
+    clusters = [algorithm clustersInRect:MKMapRectWorld zoom:2 tree:self.tree];
+    XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], annotations.count);
+    
+    for (CKCluster *cluster in clusters) {
+        XCTAssertTrue(MKMapRectContainsPoint(MKMapRectInset(cluster.bounds, -1, -1), MKMapPointForCoordinate(cluster.coordinate)));
+    }
+}
+
+- (void)testTreeUpdate {
+    
+    NSUInteger count = self.tree.annotations.count;
+    
+    CKHierarchicalDistanceBasedAlgorithm *algorithm = [CKHierarchicalDistanceBasedAlgorithm new];
+    NSArray *clusters = [algorithm clustersInRect:MKMapRectWorld zoom:4 tree:self.tree];
+    XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], count);
+    
+    [self.tree removeAnnotations:[self.tree.annotations subarrayWithRange:NSMakeRange(0, 100)]];
+    
+    clusters = [algorithm clustersInRect:MKMapRectWorld zoom:4 tree:self.tree];
+    XCTAssertEqual([[clusters valueForKeyPath:@"@sum.count"] unsignedIntegerValue], count - 100);
+}
+
+#pragma mark <CKAnnotationTreeDelegate>
+
+- (BOOL)annotationTreeFiltersAnnotations:(id<CKAnnotationTree>)annotationTree {
+    return self.rejected.count > 0;
+}
+
+- (BOOL)annotationTree:(id<CKAnnotationTree>)annotationTree shouldExtractAnnotation:(id<MKAnnotation>)annotation {
+    return ![self.rejected containsObject:annotation];
+}
+
+@end
@@ -55,6 +55,82 @@
     [super tearDown];
 }
 
+- (void)testClusterResult {
+    
+    CKNonHierarchicalDistanceBasedAlgorithm *algorithm = [CKNonHierarchicalDistanceBasedAlgorithm new];
+    
+    MKMapRect rects[] = {
+        MKMapRectWorld,
+        MKMapRectMake(MKMapSizeWorld.width / 3, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 5, MKMapSizeWorld.height / 3),
+        MKMapRectMake(MKMapSizeWorld.width * 7 / 8, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4)
+    };
+    
+    for (NSUInteger i = 0; i < sizeof(rects) / sizeof(MKMapRect); i++) {
+        for (double zoom = 1; zoom <= 5; zoom++) {
+            NSArray *clusters = [algorithm clustersInRect:rects[i] zoom:zoom tree:self.tree];
+            NSArray *expected = [self clustersInRect:rects[i] zoom:zoom cellSize:algorithm.cellSize clusterClass:[CKCluster class]];
+            XCTAssertEqualObjects(clusters, expected);
+        }
+    }
+}
+
+- (void)testCentroidClusterResult {
+    
+    CKNonHierarchicalDistanceBasedAlgorithm *algorithm = [CKNonHierarchicalDistanceBasedAlgorithm new];
+    [algorithm registerClusterClass:[CKCentroidCluster class]];
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 3, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 5, MKMapSizeWorld.height / 3);
+    
+    // Distances are measured to the centroid as it moves, not to the seed.
+    for (double zoom = 1; zoom <= 5; zoom++) {
+        NSArray<CKCluster *> *clusters = [algorithm clustersInRect:rect zoom:zoom tree:self.tree];
+        NSArray<CKCluster *> *expected = [self clustersInRect:rect zoom:zoom cellSize:algorithm.cellSize clusterClass:[CKCentroidCluster class]];
+        XCTAssertEqualObjects(clusters, expected);
+        
+        for (NSUInteger i = 0; i < MIN(clusters.count, expected.count); i++) {
+            XCTAssertEqualWithAccuracy(clusters[i].coordinate.latitude, expected[i].coordinate.latitude, 1e-9);
+            XCTAssertEqualWithAccuracy(clusters[i].coordinate.longitude, expected[i].coordinate.longitude, 1e-9);
+        }
+    }
+}
+
+/// Straightforward implementation of the algorithm, querying the tree for the neighbors of every cluster.
+- (NSArray<CKCluster *> *)clustersInRect:(MKMapRect)rect zoom:(double)zoom cellSize:(CGFloat)cellSize clusterClass:(Class)clusterClass {
+    double halfSpan = 100 * cellSize / pow(2, zoom + 8) / 2;
+    
+    NSMutableArray<CKCluster *> *clusters = [NSMutableArray array];
+    NSMapTable<id<MKAnnotation>, CKCluster *> *visited = [NSMapTable strongToStrongObjectsMapTable];
+    NSMapTable<id<MKAnnotation>, NSNumber *> *distances = [NSMapTable strongToStrongObjectsMapTable];
+    
+    for (id<MKAnnotation> annotation in [self.tree annotationsInRect:rect]) {
+        if ([visited objectForKey:annotation]) continue;
+        
+        CKCluster *cluster = [clusterClass clusterWithCoordinate:annotation.coordinate];
+        [clusters addObject:cluster];
+        
+        CLLocationCoordinate2D center = annotation.coordinate;
+        MKMapPoint a = MKMapPointForCoordinate(CLLocationCoordinate2DMake(MIN(center.latitude + halfSpan, 90), MAX(center.longitude - halfSpan, -180)));
+        MKMapPoint b = MKMapPointForCoordinate(CLLocationCoordinate2DMake(MAX(center.latitude - halfSpan, -90), MIN(center.longitude + halfSpan, 180)));
+        MKMapRect clusterRect = MKMapRectMake(MIN(a.x,b.x), MIN(a.y,b.y), ABS(a.x-b.x), ABS(a.y-b.y));
+        
+        for (id<MKAnnotation> neighbor in [self.tree annotationsInRect:clusterRect]) {
+            double distance = CKDistance(neighbor.coordinate, cluster.coordinate);
+            
+            CKCluster *previous = [visited objectForKey:neighbor];
+            if (previous) {
+                if ([distances objectForKey:neighbor].doubleValue < distance) continue;
+                [previous removeAnnotation:neighbor];
+            }
+            
+            [visited setObject:cluster forKey:neighbor];
+            [distances setObject:@(distance) forKey:neighbor];
+            [cluster addAnnotation:neighbor];
+        }
+    }
+    
+    return [clusters filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"count > 0"]];
+}
+
 - (void)testZoom1Performance {
     
     CKNonHierarchicalDistanceBasedAlgorithm *algorithm = [CKNonHierarchicalDistanceBasedAlgorithm new];
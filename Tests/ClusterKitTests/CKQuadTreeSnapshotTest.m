@@ -0,0 +1,172 @@
+// CKQuadTreeSnapshotTest.m
+//
+// Copyright © 2017 Hulab. All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#import <XCTest/XCTest.h>
+#import <ClusterKit/CKQuadTreeSnapshot.h>
+#import <ClusterKit/CKQuadTree.h>
+
+#import "CKAnnotation.h"
+
+@interface CKQuadTreeSnapshotTest : XCTestCase
+@property (nonatomic,strong) NSArray<CKAnnotation *> *annotations;
+@property (nonatomic,copy) NSString *path;
+@end
+
+@implementation CKQuadTreeSnapshotTest
+
+- (void)setUp {
+    [super setUp];
+    
+    NSMutableArray *annotations = [NSMutableArray array];
+    
+    for (double x = 0; x < MKMapSizeWorld.width; x += MKMapSizeWorld.width / 100) {
+        for (double y = 0; y < MKMapSizeWorld.height; y += MKMapSizeWorld.height / 100) {
+            
+            MKMapPoint point = MKMapPointMake(x, y);
+            CKAnnotation *annotation = [CKAnnotation new];
+            annotation.coordinate = MKCoordinateForMapPoint(point);
+            [annotations addObject:annotation];
+        }
+    }
+    self.annotations = annotations.copy;
+    self.path = [NSTemporaryDirectory() stringByAppendingPathComponent:NSUUID.UUID.UUIDString];
+    
+    NSError *error = nil;
+    XCTAssertTrue([CKQuadTreeSnapshot writeAnnotations:self.annotations identifiers:^uint64_t(id<MKAnnotation> annotation) {
+        return [self.annotations indexOfObjectIdenticalTo:annotation];
+    } toFile:self.path error:&error], @"%@", error);
+}
+
+- (void)tearDown {
+    [[NSFileManager defaultManager] removeItemAtPath:self.path error:nil];
+    [super tearDown];
+}
+
+- (CKQuadTreeSnapshot *)load {
+    return [[CKQuadTreeSnapshot alloc] initWithContentsOfFile:self.path resolver:^id<MKAnnotation>(uint64_t identifier) {
+        return identifier < self.annotations.count ? self.annotations[identifier] : nil;
+    } error:nil];
+}
+
+- (void)testQueryResult {
+    CKQuadTreeSnapshot *snapshot = [self load];
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:self.annotations];
+    
+    XCTAssertNotNil(snapshot);
+    XCTAssertEqual(snapshot.count, self.annotations.count);
+    XCTAssertEqual(snapshot.resolvedCount, 0);
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 8, MKMapSizeWorld.height / 8);
+    NSSet *expected = [NSSet setWithArray:[tree annotationsInRect:rect]];
+    XCTAssertEqualObjects([NSSet setWithArray:[snapshot annotationsInRect:rect]], expected);
+    XCTAssertEqual([snapshot countAnnotationsInRect:rect], expected.count);
+    
+    // Only the annotations returned so far are resolved.
+    XCTAssertEqual(snapshot.resolvedCount, expected.count);
+    
+    CKAnnotationBuffer buffer = {0};
+    [snapshot annotationsInRect:MKMapRectWorld buffer:&buffer];
+    XCTAssertEqual(buffer.count, self.annotations.count);
+    for (NSUInteger i = 0; i < buffer.count; i++) {
+        MKMapPoint point = MKMapPointForCoordinate(buffer.annotations[i].coordinate);
+        XCTAssertEqual(point.x, buffer.points[i].x);
+        XCTAssertEqual(point.y, buffer.points[i].y);
+    }
+    CKAnnotationBufferFree(&buffer);
+}
+
+- (void)testCoordinates {
+    NSUInteger count = self.annotations.count;
+    CLLocationCoordinate2D *coordinates = malloc(count * sizeof(CLLocationCoordinate2D));
+    for (NSUInteger i = 0; i < count; i++) {
+        coordinates[i] = self.annotations[i].coordinate;
+    }
+    
+    CKQuadTreeSnapshot *snapshot = [[CKQuadTreeSnapshot alloc] initWithCoordinates:coordinates identifiers:NULL count:count resolver:nil];
+    free(coordinates);
+    XCTAssertEqual(snapshot.count, count);
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 8, MKMapSizeWorld.height / 8);
+    NSArray *annotations = [snapshot annotationsInRect:rect];
+    XCTAssertEqual(annotations.count, [snapshot countAnnotationsInRect:rect]);
+    XCTAssertEqual(snapshot.resolvedCount, annotations.count);
+    
+    // Proxies are created once, and stand for the point of their identifier.
+    for (CKAnnotationProxy *proxy in annotations) {
+        XCTAssertTrue([proxy isKindOfClass:[CKAnnotationProxy class]]);
+        CLLocationCoordinate2D coordinate = self.annotations[(NSUInteger)proxy.identifier].coordinate;
+        XCTAssertEqualWithAccuracy(proxy.coordinate.latitude, coordinate.latitude, 1e-9);
+        XCTAssertEqualWithAccuracy(proxy.coordinate.longitude, coordinate.longitude, 1e-9);
+        XCTAssertEqual([snapshot annotationWithIdentifier:proxy.identifier], proxy);
+    }
+    XCTAssertEqual(snapshot.resolvedCount, annotations.count);
+}
+
+- (void)testMutation {
+    CKQuadTreeSnapshot *snapshot = [self load];
+    NSUInteger version = snapshot.version;
+    
+    CKAnnotation *annotation = [CKAnnotation new];
+    annotation.coordinate = CLLocationCoordinate2DMake(48.85, 2.35);
+    [snapshot insertAnnotations:@[annotation]];
+    [snapshot removeAnnotations:@[self.annotations.firstObject]];
+    
+    XCTAssertGreaterThan(snapshot.version, version);
+    XCTAssertEqual(snapshot.count, self.annotations.count);
+    XCTAssertTrue([[snapshot annotationsInRect:MKMapRectWorld] containsObject:annotation]);
+    XCTAssertFalse([[snapshot annotationsInRect:MKMapRectWorld] containsObject:self.annotations.firstObject]);
+    
+    // Annotations keep their identifier once the snapshot is thawed.
+    XCTAssertEqual([snapshot annotationWithIdentifier:1], self.annotations[1]);
+    XCTAssertNil([snapshot annotationWithIdentifier:0]);
+}
+
+- (void)testInvalidFile {
+    NSError *error = nil;
+    NSMutableData *data = [NSMutableData dataWithContentsOfFile:self.path];
+    
+    // Truncated
+    [[data subdataWithRange:NSMakeRange(0, data.length / 2)] writeToFile:self.path atomically:YES];
+    XCTAssertNil([[CKQuadTreeSnapshot alloc] initWithContentsOfFile:self.path resolver:^id<MKAnnotation>(uint64_t identifier) { return nil; } error:&error]);
+    XCTAssertEqualObjects(error.domain, NSCocoaErrorDomain);
+    XCTAssertEqual(error.code, NSFileReadCorruptFileError);
+    
+    // Unknown version
+    ((uint64_t *)data.mutableBytes)[1] = CFSwapInt64HostToLittle(CK_QSNAP_VERSION + 1);
+    [data writeToFile:self.path atomically:YES];
+    XCTAssertNil([[CKQuadTreeSnapshot alloc] initWithContentsOfFile:self.path resolver:^id<MKAnnotation>(uint64_t identifier) { return nil; } error:&error]);
+    XCTAssertEqual(error.code, NSFileReadCorruptFileError);
+    
+    // Two quadrants of the root sharing a child, the header being followed by the root node
+    ((uint64_t *)data.mutableBytes)[1] = CFSwapInt64HostToLittle(CK_QSNAP_VERSION);
+    uint64_t *root = (uint64_t *)data.mutableBytes + 4;
+    root[3 + 1] = root[3];
+    [data writeToFile:self.path atomically:YES];
+    XCTAssertNil([[CKQuadTreeSnapshot alloc] initWithContentsOfFile:self.path resolver:^id<MKAnnotation>(uint64_t identifier) { return nil; } error:&error]);
+    XCTAssertEqual(error.code, NSFileReadCorruptFileError);
+    
+    [[NSFileManager defaultManager] removeItemAtPath:self.path error:nil];
+    XCTAssertNil([[CKQuadTreeSnapshot alloc] initWithContentsOfFile:self.path resolver:^id<MKAnnotation>(uint64_t identifier) { return nil; } error:&error]);
+    XCTAssertEqual(error.code, NSFileReadNoSuchFileError);
+}
+
+@end
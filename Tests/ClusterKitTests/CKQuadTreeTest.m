@@ -25,9 +25,10 @@
 
 #import "CKAnnotation.h"
 
-@interface CKQuadTreeTest : XCTestCase
+@interface CKQuadTreeTest : XCTestCase <CKAnnotationTreeDelegate>
 @property (nonatomic,strong) NSArray *annotations;
 @property (nonatomic,assign) hb_qtree_t *tree;
+@property (nonatomic,strong) NSArray *moved;
 @end
 
 @implementation CKQuadTreeTest
@@ -57,6 +58,283 @@
     [super tearDown];
 }
 
+- (void)testBuildPerformance {
+    
+    [self measureBlock:^{
+        hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+        for (id<MKAnnotation> annotation in self.annotations) {
+            hb_qtree_insert(tree, annotation);
+        }
+        hb_qtree_free(tree);
+    }];
+}
+
+- (void)testFreePerformance {
+    
+    [self measureMetrics:[[self class] defaultPerformanceMetrics] automaticallyStartMeasuring:NO forBlock:^{
+        hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+        for (id<MKAnnotation> annotation in self.annotations) {
+            hb_qtree_insert(tree, annotation);
+        }
+        
+        [self startMeasuring];
+        hb_qtree_free(tree);
+        [self stopMeasuring];
+    }];
+}
+
+- (void)testClearResult {
+    hb_qtree_clear(self.tree);
+    
+    __block NSUInteger count = 0;
+    hb_qtree_find_in_range(self.tree, MKMapRectWorld, ^(id<MKAnnotation>  _Nonnull annotation) {
+        count++;
+    });
+    XCTAssertEqual(count, 0, @"Tree should be empty after clear");
+    
+    for (id<MKAnnotation> annotation in self.annotations) {
+        hb_qtree_insert(self.tree, annotation);
+    }
+    
+    hb_qtree_find_in_range(self.tree, MKMapRectWorld, ^(id<MKAnnotation>  _Nonnull annotation) {
+        count++;
+    });
+    XCTAssertEqual(count, self.annotations.count, @"Tree should be reusable after clear");
+}
+
+- (void)testBulkLoadPerformance {
+    NSUInteger count = self.annotations.count;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(count * sizeof(id));
+    [self.annotations getObjects:annotations range:NSMakeRange(0, count)];
+    
+    [self measureBlock:^{
+        hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+        hb_qtree_bulk_load(tree, annotations, count);
+        hb_qtree_free(tree);
+    }];
+    
+    free(annotations);
+}
+
+- (void)testBulkLoadResult {
+    NSUInteger count = self.annotations.count;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc(count * sizeof(id));
+    [self.annotations getObjects:annotations range:NSMakeRange(0, count)];
+    
+    hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+    hb_qtree_bulk_load(tree, annotations, count);
+    free(annotations);
+    
+    MKMapRect rect = MKMapRectInset(MKMapRectWorld, MKMapSizeWorld.width / 3, MKMapSizeWorld.height / 5);
+    
+    NSMutableSet *expected = [NSMutableSet set];
+    hb_qtree_find_in_range(self.tree, rect, ^(id<MKAnnotation>  _Nonnull annotation) {
+        [expected addObject:annotation];
+    });
+    
+    NSMutableSet *result = [NSMutableSet set];
+    hb_qtree_find_in_range(tree, rect, ^(id<MKAnnotation>  _Nonnull annotation) {
+        [result addObject:annotation];
+    });
+    
+    XCTAssertEqualObjects(result, expected, @"Bulk loaded tree should find the same annotations");
+    
+    hb_qtree_remove(tree, expected.anyObject);
+    hb_qtree_insert(tree, expected.anyObject);
+    
+    __block NSUInteger total = 0;
+    hb_qtree_find_in_range(tree, MKMapRectWorld, ^(id<MKAnnotation>  _Nonnull annotation) {
+        total++;
+    });
+    XCTAssertEqual(total, count, @"Bulk loaded tree should support updates");
+    
+    hb_qtree_free(tree);
+}
+
+- (void)testParallelBulkLoadResult {
+    
+    // Enough annotations for the load to be spread over the cores, some of them given twice.
+    srand48(7);
+    NSUInteger count = 100000;
+    __unsafe_unretained id<MKAnnotation> *annotations = (__unsafe_unretained id<MKAnnotation> *)malloc((count + 100) * sizeof(id));
+    NSMutableArray *objects = [NSMutableArray array];
+    hb_qtree_t *expected = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        CKAnnotation *annotation = [CKAnnotation new];
+        annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(drand48() * MKMapSizeWorld.width, drand48() * MKMapSizeWorld.height));
+        [objects addObject:annotation];
+        annotations[i] = annotation;
+        hb_qtree_insert(expected, annotation);
+    }
+    for (NSUInteger i = 0; i < 100; i++) {
+        annotations[count + i] = annotations[i * 7];
+    }
+    
+    hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+    hb_qtree_bulk_load(tree, annotations, count + 100);
+    free(annotations);
+    
+    XCTAssertEqual(hb_qtree_count_in_range(tree, MKMapRectWorld), count);
+    
+    for (NSUInteger i = 0; i < 20; i++) {
+        MKMapRect rect = MKMapRectMake(drand48() * MKMapSizeWorld.width, drand48() * MKMapSizeWorld.height, drand48() * MKMapSizeWorld.width / 4, drand48() * MKMapSizeWorld.height / 4);
+        XCTAssertEqual(hb_qtree_count_in_range(tree, rect), hb_qtree_count_in_range(expected, rect));
+    }
+    
+    hb_qtree_remove(tree, objects.firstObject);
+    XCTAssertEqual(hb_qtree_count_in_range(tree, MKMapRectWorld), count - 1, @"Bulk loaded tree should support updates");
+    
+    hb_qtree_free(tree);
+    hb_qtree_free(expected);
+}
+
+- (void)testInsertRemoveAnnotations {
+    NSUInteger half = self.annotations.count / 2;
+    NSArray *first = [self.annotations subarrayWithRange:NSMakeRange(0, half)];
+    NSArray *second = [self.annotations subarrayWithRange:NSMakeRange(half, self.annotations.count - half)];
+    
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:first];
+    [tree insertAnnotations:second];
+    [tree insertAnnotations:first];
+    
+    XCTAssertEqual(tree.annotations.count, self.annotations.count, @"Tree should ignore duplicated insertions");
+    XCTAssertEqual([tree annotationsInRect:MKMapRectWorld].count, self.annotations.count, @"Tree should find inserted annotations");
+    
+    [tree removeAnnotations:first];
+    
+    XCTAssertEqual(tree.annotations.count, second.count, @"Tree should have removed annotations");
+    XCTAssertEqualObjects([NSSet setWithArray:[tree annotationsInRect:MKMapRectWorld]], [NSSet setWithArray:second], @"Tree should only find remaining annotations");
+}
+
+- (void)testRemovePerformance {
+    
+    [self measureBlock:^{
+        hb_qtree_t *tree = hb_qtree_new(MKMapRectWorld, CK_QTREE_STDCAP);
+        for (id<MKAnnotation> annotation in self.annotations) {
+            hb_qtree_insert(tree, annotation);
+        }
+        for (id<MKAnnotation> annotation in self.annotations) {
+            hb_qtree_remove(tree, annotation);
+        }
+        hb_qtree_free(tree);
+    }];
+}
+
+- (void)testMoveAnnotation {
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:self.annotations];
+    CKAnnotation *annotation = self.annotations.firstObject;
+    
+    MKMapRect se = MKMapRectMake(MKMapSizeWorld.width / 2, MKMapSizeWorld.height / 2, MKMapSizeWorld.width / 2, MKMapSizeWorld.height / 2);
+    
+    MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+    XCTAssertTrue([[tree annotationsInRect:MKMapRectMake(point.x, point.y, 1, 1)] containsObject:annotation]);
+    
+    // Small move within the same node
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(point.x + 0.5, point.y + 0.5));
+    XCTAssertTrue([[tree annotationsInRect:MKMapRectMake(point.x, point.y, 1, 1)] containsObject:annotation]);
+    
+    // Move to another quadrant
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(MKMapRectGetMidX(se), MKMapRectGetMidY(se)));
+    XCTAssertFalse([[tree annotationsInRect:MKMapRectMake(point.x, point.y, 1, 1)] containsObject:annotation]);
+    XCTAssertTrue([[tree annotationsInRect:se] containsObject:annotation]);
+    XCTAssertEqual([tree annotationsInRect:MKMapRectWorld].count, self.annotations.count);
+}
+
+- (void)testBatchUpdate {
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:self.annotations observesCoordinates:NO];
+    tree.delegate = self;
+    XCTAssertFalse(tree.observesCoordinates);
+    
+    MKMapRect se = MKMapRectMake(MKMapSizeWorld.width / 2, MKMapSizeWorld.height / 2, MKMapSizeWorld.width / 2, MKMapSizeWorld.height / 2);
+    MKMapPoint target = MKMapPointMake(MKMapRectGetMidX(se) + 0.5, MKMapRectGetMidY(se) + 0.5);
+    
+    NSArray<CKAnnotation *> *annotations = [self.annotations subarrayWithRange:NSMakeRange(0, 10)];
+    CLLocationCoordinate2D coordinates[10];
+    for (NSUInteger i = 0; i < 10; i++) {
+        coordinates[i] = MKCoordinateForMapPoint(target);
+    }
+    
+    NSUInteger version = tree.version;
+    [tree updateCoordinates:coordinates forAnnotations:annotations];
+    XCTAssertEqual(tree.version, version + 1);
+    XCTAssertEqualObjects(self.moved, annotations);
+    
+    NSArray *found = [tree annotationsInRect:MKMapRectMake(target.x - 1, target.y - 1, 2, 2)];
+    for (CKAnnotation *annotation in annotations) {
+        XCTAssertTrue([found containsObject:annotation]);
+    }
+    XCTAssertEqual([tree annotationsInRect:MKMapRectWorld].count, self.annotations.count);
+    
+    // Without observation, setting a coordinate does not move the annotation.
+    CKAnnotation *annotation = annotations.firstObject;
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(1, 1));
+    XCTAssertTrue([[tree annotationsInRect:MKMapRectMake(target.x - 1, target.y - 1, 2, 2)] containsObject:annotation]);
+}
+
+- (void)annotationTree:(id<CKAnnotationTree>)annotationTree didMoveAnnotations:(NSArray<id<MKAnnotation>> *)annotations from:(const MKMapPoint *)from to:(const MKMapPoint *)to {
+    self.moved = annotations;
+}
+
+- (void)testAggregates {
+    CKQuadTree *tree = [[CKQuadTree alloc] initWithAnnotations:self.annotations];
+    
+    double (^value)(id<MKAnnotation>) = ^double(id<MKAnnotation> annotation) {
+        return annotation.coordinate.latitude;
+    };
+    XCTAssertEqual([tree registerReducer:CKReducerSum value:value], 0);
+    XCTAssertEqual([tree registerReducer:CKReducerMin value:value], 1);
+    XCTAssertEqual([tree registerReducer:CKReducerMax value:value], 2);
+    
+    void (^check)(MKMapRect) = ^(MKMapRect rect) {
+        NSUInteger count = 0;
+        double sum = 0, min = INFINITY, max = -INFINITY;
+        MKMapPoint center = MKMapPointMake(0, 0);
+        MKMapRect bounds = MKMapRectNull;
+        
+        for (id<MKAnnotation> annotation in self.annotations) {
+            MKMapPoint point = MKMapPointForCoordinate(annotation.coordinate);
+            if (!MKMapRectContainsPoint(rect, point)) continue;
+            double v = value(annotation);
+            count++;
+            sum += v;
+            min = MIN(min, v);
+            max = MAX(max, v);
+            center = MKMapPointMake(center.x + point.x, center.y + point.y);
+            bounds = MKMapRectUnion(bounds, MKMapRectMake(point.x, point.y, 0, 0));
+        }
+        
+        double reduced[3];
+        CKAnnotationAggregate aggregate = [tree aggregateAnnotationsInRect:rect reduced:reduced];
+        XCTAssertEqual(aggregate.count, count);
+        XCTAssertEqualWithAccuracy(aggregate.sum.x, center.x, 1);
+        XCTAssertEqualWithAccuracy(aggregate.sum.y, center.y, 1);
+        XCTAssertEqualWithAccuracy(reduced[0], sum, 1e-6);
+        XCTAssertEqual(reduced[1], min);
+        XCTAssertEqual(reduced[2], max);
+        XCTAssertEqual(MKMapRectIsNull(aggregate.bounds), MKMapRectIsNull(bounds));
+        if (count) {
+            XCTAssertEqual(MKMapRectGetMinX(aggregate.bounds), MKMapRectGetMinX(bounds));
+            XCTAssertEqual(MKMapRectGetMinY(aggregate.bounds), MKMapRectGetMinY(bounds));
+        }
+    };
+    
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 5, MKMapSizeWorld.height / 7, MKMapSizeWorld.width / 3, MKMapSizeWorld.height / 2);
+    check(MKMapRectWorld);
+    check(rect);
+    
+    // Aggregates follow the moving annotations
+    CKAnnotation *annotation = self.annotations.firstObject;
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(MKMapRectGetMidX(rect), MKMapRectGetMidY(rect)));
+    check(MKMapRectWorld);
+    check(rect);
+    
+    annotation = self.annotations[self.annotations.count / 2];
+    annotation.coordinate = MKCoordinateForMapPoint(MKMapPointMake(1, 1));
+    check(MKMapRectWorld);
+    check(rect);
+}
+
 - (void)testQueryPerformance {
     MKMapRect rect = MKMapRectInset(MKMapRectWorld, MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4);
     
@@ -65,6 +343,53 @@
     }];
 }
 
+- (void)testWorldQueryPerformance {
+    
+    [self measureBlock:^{
+        hb_qtree_find_in_range(self.tree, MKMapRectWorld, ^(id<MKAnnotation>  _Nonnull annotation) {});
+    }];
+}
+
+- (void)testBufferQueryPerformance {
+    __block CKAnnotationBuffer buffer = {0};
+    
+    [self measureBlock:^{
+        buffer.count = 0;
+        hb_qtree_fill_in_range(self.tree, MKMapRectWorld, &buffer);
+    }];
+    
+    CKAnnotationBufferFree(&buffer);
+}
+
+- (void)testBufferQueryResult {
+    MKMapRect rect = MKMapRectMake(MKMapSizeWorld.width / 4, MKMapSizeWorld.height / 4, MKMapSizeWorld.width / 3, MKMapSizeWorld.height / 3);
+    
+    NSMutableSet *expected = [NSMutableSet set];
+    hb_qtree_find_in_range(self.tree, rect, ^(id<MKAnnotation>  _Nonnull annotation) {
+        [expected addObject:annotation];
+    });
+    
+    CKAnnotationBuffer buffer = {0};
+    XCTAssertEqual(hb_qtree_fill_in_range(self.tree, rect, &buffer), expected.count);
+    XCTAssertEqual(buffer.count, expected.count);
+    XCTAssertEqualObjects([NSSet setWithObjects:buffer.annotations count:buffer.count], expected);
+    
+    for (NSUInteger i = 0; i < buffer.count; i++) {
+        MKMapPoint point = MKMapPointForCoordinate(buffer.annotations[i].coordinate);
+        XCTAssertEqual(buffer.points[i].x, point.x);
+        XCTAssertEqual(buffer.points[i].y, point.y);
+    }
+    CKAnnotationBufferFree(&buffer);
+    
+    XCTAssertEqual(hb_qtree_count_in_range(self.tree, rect), expected.count);
+    
+    __unsafe_unretained id<MKAnnotation> annotations[8];
+    XCTAssertEqual(hb_qtree_get_in_range(self.tree, rect, annotations, 8), expected.count);
+    for (NSUInteger i = 0; i < 8; i++) {
+        XCTAssertTrue([expected containsObject:annotations[i]]);
+    }
+}
+
 - (void)testQueryResult {
     
     NSMutableArray *annotations = [NSMutableArray array];